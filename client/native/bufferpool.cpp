@@ -0,0 +1,210 @@
+#include <stdio.h>
+#include <string.h>
+#include <SDL.h>
+#include "bufferpool.h"
+
+// pages are this big, unless something bigger has to fit in one
+#define BUFFER_PAGE_SIZE        (8 << 20)
+// and pieces of them are a multiple of this
+#define BUFFER_ALIGN            (256)
+
+#define STAGING_SIZE            (6 << 20)
+#define STAGING_SEGMENT_SIZE    (STAGING_SIZE / STAGING_SEGMENTS)
+
+static void init_staging(StagingRing *sr)
+{
+  memset(sr, 0, sizeof(*sr));
+  if (!SDL_GL_ExtensionSupported("GL_ARB_buffer_storage")) {
+    printf("terrain uploads go through glBufferSubData\n");
+    return;
+  }
+  GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+  glGenBuffers(1, &sr->sr_buffer);
+  glBindBuffer(GL_COPY_READ_BUFFER, sr->sr_buffer);
+  glBufferStorage(GL_COPY_READ_BUFFER, STAGING_SIZE, NULL, flags);
+  sr->sr_map = (unsigned char *)glMapBufferRange(GL_COPY_READ_BUFFER, 0, STAGING_SIZE, flags);
+  if (!sr->sr_map) {
+    fprintf(stderr, "warning: could not map staging buffer\n");
+    glDeleteBuffers(1, &sr->sr_buffer);
+    sr->sr_buffer = 0;
+    return;
+  }
+  printf("terrain uploads go through %d MB of persistently mapped staging\n",
+         STAGING_SIZE >> 20);
+}
+
+TerrainBuffers *create_terrain_buffers(void)
+{
+  TerrainBuffers *tb = new TerrainBuffers();
+  tb->tb_vertices.pool_target = GL_ARRAY_BUFFER;
+  tb->tb_indices.pool_target = GL_ELEMENT_ARRAY_BUFFER;
+  init_staging(&tb->tb_staging);
+  return tb;
+}
+
+static BufferPage *new_page(BufferPool *pool, size_t size)
+{
+  // clear out any errors left over, so we see just this one
+  while (glGetError() != GL_NO_ERROR) {
+  }
+  GLuint id;
+  glGenBuffers(1, &id);
+  glBindBuffer(pool->pool_target, id);
+  glBufferData(pool->pool_target, size, NULL, GL_STATIC_DRAW);
+  if (glGetError() == GL_OUT_OF_MEMORY) {
+    glDeleteBuffers(1, &id);
+    return NULL;
+  }
+  BufferPage *p = new BufferPage();
+  p->bp_pool = pool;
+  p->bp_buffer = id;
+  p->bp_size = size;
+  p->bp_used = 0;
+  p->bp_free[0] = size;
+  pool->pool_pages.push_back(p);
+  return p;
+}
+
+// take need bytes from the first free block in p that has them
+static bool take(BufferPage *p, size_t need, BufferRange *r)
+{
+  for (std::map<size_t,size_t>::iterator i=p->bp_free.begin(); i!=p->bp_free.end(); ++i) {
+    if (i->second >= need) {
+      size_t offset = i->first;
+      size_t left = i->second - need;
+      p->bp_free.erase(i);
+      if (left) {
+        p->bp_free[offset + need] = left;
+      }
+      p->bp_used += need;
+      r->br_page = p;
+      r->br_offset = offset;
+      r->br_size = need;
+      return true;
+    }
+  }
+  return false;
+}
+
+bool buffer_alloc(BufferPool *pool, size_t bytes, BufferRange *r)
+{
+  size_t need = (bytes + BUFFER_ALIGN - 1) & ~(size_t)(BUFFER_ALIGN - 1);
+  if (need == 0) {
+    need = BUFFER_ALIGN;
+  }
+  for (size_t i=0; i<pool->pool_pages.size(); i++) {
+    if (take(pool->pool_pages[i], need, r)) {
+      return true;
+    }
+  }
+  BufferPage *p = new_page(pool, (need > BUFFER_PAGE_SIZE) ? need : BUFFER_PAGE_SIZE);
+  if (!p) {
+    fprintf(stderr, "warning: out of memory for a %zu byte terrain buffer\n", need);
+    return false;
+  }
+  return take(p, need, r);
+}
+
+void buffer_free(BufferRange *r)
+{
+  BufferPage *p = r->br_page;
+  if (!p) {
+    return;
+  }
+  size_t offset = r->br_offset;
+  size_t size = r->br_size;
+  r->br_page = NULL;
+  p->bp_used -= size;
+
+  // merge with the free blocks on either side
+  std::map<size_t,size_t>::iterator next = p->bp_free.lower_bound(offset);
+  if ((next != p->bp_free.end()) && (next->first == offset + size)) {
+    size += next->second;
+    next = p->bp_free.erase(next);
+  }
+  if (next != p->bp_free.begin()) {
+    std::map<size_t,size_t>::iterator prev = next;
+    --prev;
+    if (prev->first + prev->second == offset) {
+      prev->second += size;
+      size = 0;
+    }
+  }
+  if (size) {
+    p->bp_free[offset] = size;
+  }
+
+  BufferPool *pool = p->bp_pool;
+  if ((p->bp_used == 0) && (pool->pool_pages.size() > 1)) {
+    for (size_t i=0; i<pool->pool_pages.size(); i++) {
+      if (pool->pool_pages[i] == p) {
+        pool->pool_pages.erase(pool->pool_pages.begin() + i);
+        break;
+      }
+    }
+    glDeleteBuffers(1, &p->bp_buffer);
+    delete p;
+  }
+}
+
+// move on to the next segment of the ring, waiting for the GPU to be
+// done with what we put in it last time around
+static void next_segment(StagingRing *sr)
+{
+  sr->sr_fence[sr->sr_segment] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+  sr->sr_segment = (sr->sr_segment + 1) % STAGING_SEGMENTS;
+  sr->sr_head = 0;
+  GLsync f = sr->sr_fence[sr->sr_segment];
+  if (f) {
+    if (glClientWaitSync(f, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000000) == GL_TIMEOUT_EXPIRED) {
+      fprintf(stderr, "warning: timed out waiting for staging segment\n");
+    }
+    glDeleteSync(f);
+    sr->sr_fence[sr->sr_segment] = 0;
+  }
+}
+
+void buffer_upload(TerrainBuffers *tb, BufferRange const& r, size_t at,
+                   void const *data, size_t len)
+{
+  if (len == 0) {
+    return;
+  }
+  StagingRing *sr = &tb->tb_staging;
+  if (sr->sr_buffer && (len <= STAGING_SEGMENT_SIZE)) {
+    if (sr->sr_head + len > STAGING_SEGMENT_SIZE) {
+      next_segment(sr);
+    }
+    size_t from = sr->sr_segment * STAGING_SEGMENT_SIZE + sr->sr_head;
+    memcpy(sr->sr_map + from, data, len);
+    glBindBuffer(GL_COPY_READ_BUFFER, sr->sr_buffer);
+    glBindBuffer(GL_COPY_WRITE_BUFFER, r.buffer());
+    glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER,
+                        from, r.br_offset + at, len);
+    sr->sr_head += (len + 15) & ~(size_t)15;
+    sr->sr_staged += len;
+  } else {
+    GLenum target = r.br_page->bp_pool->pool_target;
+    glBindBuffer(target, r.buffer());
+    glBufferSubData(target, r.br_offset + at, len, data);
+    sr->sr_direct += len;
+  }
+}
+
+void buffer_pool_stats(BufferPool const *pool, BufferPoolStats *s)
+{
+  memset(s, 0, sizeof(*s));
+  for (size_t i=0; i<pool->pool_pages.size(); i++) {
+    BufferPage const *p = pool->pool_pages[i];
+    size_t biggest = 0;
+    for (std::map<size_t,size_t>::const_iterator j=p->bp_free.begin(); j!=p->bp_free.end(); ++j) {
+      if (j->second > biggest) {
+        biggest = j->second;
+      }
+    }
+    s->bps_pages++;
+    s->bps_allocated += p->bp_used;
+    s->bps_free += p->bp_size - p->bp_used;
+    s->bps_fragmented += p->bp_size - p->bp_used - biggest;
+  }
+}
@@ -0,0 +1,88 @@
+#ifndef _H_HEXPLORE_CLIENT_BUFFERPOOL   // -*-c++-*-
+#define _H_HEXPLORE_CLIENT_BUFFERPOOL
+
+#define GL_GLEXT_PROTOTYPES
+#include <GL/gl.h>
+#include <GL/glext.h>
+#include <stddef.h>
+#include <map>
+#include <vector>
+
+/**
+ *   The terrain meshes don't each get buffer objects of their own;
+ *   they are carved out of a few big pages, one BufferPool of them for
+ *   vertices and one for indices.  Each page keeps a list of its free
+ *   blocks (merged with their neighbors as they are freed), and a page
+ *   is deleted when the last thing in it is, unless it's the only one.
+ */
+
+struct BufferPool;
+
+struct BufferPage {
+  BufferPool           *bp_pool;
+  GLuint                bp_buffer;
+  size_t                bp_size;
+  size_t                bp_used;
+  std::map<size_t,size_t> bp_free;      // offset to size of each free block
+};
+
+// a piece of a page; br_page is NULL if there's nothing allocated
+struct BufferRange {
+  BufferRange() : br_page(NULL), br_offset(0), br_size(0) { }
+  BufferPage           *br_page;
+  size_t                br_offset;      // in bytes
+  size_t                br_size;
+  GLuint buffer() const { return br_page->bp_buffer; }
+};
+
+struct BufferPool {
+  GLenum                pool_target;    // GL_ARRAY_BUFFER or GL_ELEMENT_ARRAY_BUFFER
+  std::vector<BufferPage*> pool_pages;
+};
+
+struct BufferPoolStats {
+  unsigned              bps_pages;
+  size_t                bps_allocated;
+  size_t                bps_free;
+  size_t                bps_fragmented; // free, but not in the biggest block of its page
+};
+
+/**
+ *   Where the context can map a buffer persistently (GL 4.4, or
+ *   ARB_buffer_storage), uploads are written into a ring of staging
+ *   memory that stays mapped, and copied from there into the pages on
+ *   the GPU's side.  The ring is used a segment at a time, and a fence
+ *   after each one keeps us from writing over a segment the GPU is
+ *   still copying from.  Without it, uploads are glBufferSubData().
+ */
+
+#define STAGING_SEGMENTS        (3)
+
+struct StagingRing {
+  GLuint                sr_buffer;      // 0 if we can't map persistently
+  unsigned char        *sr_map;
+  size_t                sr_head;        // next free byte in the current segment
+  unsigned              sr_segment;
+  GLsync                sr_fence[STAGING_SEGMENTS];
+  unsigned long         sr_staged;      // bytes that went through the ring
+  unsigned long         sr_direct;      // and that didn't
+};
+
+struct TerrainBuffers {
+  BufferPool            tb_vertices;
+  BufferPool            tb_indices;
+  StagingRing           tb_staging;
+};
+
+// needs the GL context to be current
+TerrainBuffers *create_terrain_buffers(void);
+
+// returns false if GL couldn't make a page big enough
+bool buffer_alloc(BufferPool *pool, size_t bytes, BufferRange *r);
+void buffer_free(BufferRange *r);
+// write len bytes of data at offset at in a range
+void buffer_upload(TerrainBuffers *tb, BufferRange const& r, size_t at,
+                   void const *data, size_t len);
+void buffer_pool_stats(BufferPool const *pool, BufferPoolStats *s);
+
+#endif /* _H_HEXPLORE_CLIENT_BUFFERPOOL */
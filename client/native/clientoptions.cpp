@@ -12,13 +12,14 @@ enum {
   OVERRIDE_USERNAME = (1<<0),
   OVERRIDE_PLAYERNAME = (1<<1),
   OVERRIDE_SERVER_HOST = (1<<2),
-  OVERRIDE_SERVER_PORT = (1<<3)
+  OVERRIDE_SERVER_PORT = (1<<3),
+  OVERRIDE_REGION_BUDGET = (1<<4)
 };
 
 bool ClientOptions::parseCommandLine(int argc, char *argv[])
 {
   while (1) {
-    switch(getopt(argc, argv, "DP:h:u:p:d:")) {
+    switch(getopt(argc, argv, "DP:h:u:p:d:M:")) {
     case 'd':
       homedir = optarg;
       break;
@@ -33,6 +34,10 @@ bool ClientOptions::parseCommandLine(int argc, char *argv[])
       server_port = atoi(optarg);
       override |= OVERRIDE_SERVER_PORT;
       break;
+    case 'M':
+      region_budget_mb = atoi(optarg);
+      override |= OVERRIDE_REGION_BUDGET;
+      break;
     case 'u':
       username = optarg;
       override |= OVERRIDE_USERNAME;
@@ -42,7 +47,7 @@ bool ClientOptions::parseCommandLine(int argc, char *argv[])
       override |= OVERRIDE_PLAYERNAME;
       break;
     case '?':
-      fprintf(stderr, "usage: %s [-D] [-p port] [-h host] [-u username] [-p playername]\n", argv[0]);
+      fprintf(stderr, "usage: %s [-D] [-p port] [-h host] [-u username] [-p playername] [-M megabytes]\n", argv[0]);
       return false;
     case -1:
       return true;
@@ -58,6 +63,7 @@ ClientOptions::ClientOptions()
     playername("^0"),
     server_host("localhost"),
     server_port(1666),
+    region_budget_mb(64),
     debug_animus(NULL)
 {
 }
@@ -93,6 +99,10 @@ bool ClientOptions::parseConfigFile()
       root["server"]["port"].isInt()) {
     server_port = root["server"]["port"].asInt();
   }
+  if (!(override & OVERRIDE_REGION_BUDGET) &&
+      root["cache"]["megabytes"].isInt()) {
+    region_budget_mb = root["cache"]["megabytes"].asInt();
+  }
   return true;
 }
 
@@ -110,6 +120,10 @@ bool ClientOptions::validate()
             homedir.c_str());
     return false;
   }
+  if (region_budget_mb < 1) {
+    fprintf(stderr, "region cache budget must be at least 1 MB\n");
+    return false;
+  }
 
   /*
   if (!username) {
@@ -142,6 +156,7 @@ int main(int argc, char *argv[])
   printf("playername = \"%s\"\n", conf.playername.c_str());
   printf("server.host = \"%s\"\n", conf.server_host.c_str());
   printf("server.port = %d\n", conf.server_port);
+  printf("cache.megabytes = %d\n", conf.region_budget_mb);
   return 0;
 }
 #endif
@@ -19,6 +19,9 @@ struct ClientOptions {
   std::string playername;
   std::string server_host;
   int server_port;
+  // how much memory (in MB) the terrain cache may hold before
+  // regions far from the player are evicted
+  int region_budget_mb;
   FILE *debug_animus;
 };
 
@@ -0,0 +1,109 @@
+#include <math.h>
+#include <algorithm>
+#include "ui.h"
+#include "drawlist.h"
+#include <hexcom/hex.h>
+
+void draw_list_add(DrawList *dl, unsigned pass, Mesh *m, GLuint texture,
+                   glm::mat4 const& model)
+{
+  DrawItem di;
+  di.di_pass = pass;
+  di.di_program = m->shader->shaderId;
+  di.di_texture = texture;
+  di.di_vertex_array = m->vertexArray;
+  di.di_mesh = m;
+  di.di_model = model;
+  dl->dl_items.push_back(di);
+}
+
+static bool draw_order(DrawItem const& a, DrawItem const& b)
+{
+  if (a.di_pass != b.di_pass) {
+    return a.di_pass < b.di_pass;
+  }
+  if (a.di_program != b.di_program) {
+    return a.di_program < b.di_program;
+  }
+  if (a.di_texture != b.di_texture) {
+    return a.di_texture < b.di_texture;
+  }
+  return a.di_vertex_array < b.di_vertex_array;
+}
+
+// a program keeps its uniforms, so these stay set until the next
+// time we switch to it
+void prepare_shader(UserInterface *ui, ShaderRef const *shader)
+{
+  // configure the variable 'theTextureSampler' to use texture unit 0
+  glUniform1i(shader->shaderPgmTextureIndex, 0);
+
+  if (shader->waterWiggleIndex) {
+    float dx = 0.3 * cos(ui->frameTime * 1.0e-6) / TEXTURE_GRID_WIDTH;
+    float dy = 0.1 * sin(ui->frameTime * 1.0e-6) / TEXTURE_GRID_WIDTH;
+    glUniform2f(shader->waterWiggleIndex, dx, dy);
+  }
+  if (shader->fogColorIndex) {
+    glUniform4f(shader->fogColorIndex,
+                ui->skyColor.r,
+                ui->skyColor.g,
+                ui->skyColor.b,
+                1);
+  }
+  if (shader->fogDensityIndex) {
+    glUniform1f(shader->fogDensityIndex, ui->fogDensity);
+  }
+  if (shader->packScaleIndex) {
+    glUniform3f(shader->packScaleIndex, PACK_X_UNIT, PACK_Y_UNIT, PACK_Z_UNIT);
+  }
+}
+
+void draw_list_submit(UserInterface *ui, DrawList *dl, DrawStats *stats)
+{
+  std::vector<DrawItem>& items(dl->dl_items);
+  if (items.empty()) {
+    return;
+  }
+  std::sort(items.begin(), items.end(), draw_order);
+
+  glm::mat4 vp = ui->projectionMatrix * ui->current_viewpoint.vp_matrix;
+  DrawItem const *prev = NULL;
+  for (size_t i=0; i<items.size(); i++) {
+    DrawItem const& di(items[i]);
+    if ((di.di_pass == DRAW_PASS_BLEND) && (!prev || (prev->di_pass != DRAW_PASS_BLEND))) {
+      glEnable(GL_BLEND);
+      glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+    }
+    bool new_program = !prev || (di.di_program != prev->di_program);
+    if (new_program) {
+      glUseProgram(di.di_program);
+      prepare_shader(ui, di.di_mesh->shader);
+      stats->ds_programs++;
+    }
+    if (!prev || (di.di_texture != prev->di_texture)) {
+      glBindTexture(GL_TEXTURE_2D, di.di_texture);
+      stats->ds_textures++;
+    }
+    if (!prev || (di.di_vertex_array != prev->di_vertex_array)) {
+      glBindVertexArray(di.di_vertex_array);
+      stats->ds_vertex_arrays++;
+    }
+    if (new_program || (di.di_model != prev->di_model)) {
+      glm::mat4 MVP = vp * di.di_model;
+      glUniformMatrix4fv(di.di_mesh->shader->shaderPgmMVPMatrixIndex,
+                         1, GL_FALSE, &MVP[0][0]);
+      stats->ds_matrices++;
+    }
+    di.di_mesh->draw(ui);
+    prev = &di;
+  }
+
+  // leave the default vertex array bound, so binding buffers (as the
+  // uploads do) can't change one of ours
+  glBindVertexArray(0);
+  if (prev->di_pass == DRAW_PASS_BLEND) {
+    glDisable(GL_BLEND);
+  }
+  stats->ds_items += items.size();
+  items.clear();
+}
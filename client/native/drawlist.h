@@ -0,0 +1,60 @@
+#ifndef _H_HEXPLORE_CLIENT_DRAWLIST   // -*-c++-*-
+#define _H_HEXPLORE_CLIENT_DRAWLIST
+
+#define GL_GLEXT_PROTOTYPES
+#include <GL/gl.h>
+#include <GL/glext.h>
+#include <glm/glm.hpp>
+#include <vector>
+
+struct Mesh;
+struct ShaderRef;
+struct UserInterface;
+
+/**
+ *   The terrain and the entities aren't drawn as they are visited;
+ *   each mesh to be drawn goes into a DrawList instead, which is
+ *   sorted by the state it needs (its pass, then its shader, texture
+ *   and vertex array) and drawn in that order.  So each of those is
+ *   bound once for a run of items that share it, rather than once
+ *   for every item, and the MVP only goes to the shader when the
+ *   model matrix changes.
+ */
+
+#define DRAW_PASS_OPAQUE        (0)
+#define DRAW_PASS_BLEND         (1)     // after all the opaque ones
+
+struct DrawItem {
+  unsigned      di_pass;
+  GLuint        di_program;
+  GLuint        di_texture;
+  GLuint        di_vertex_array;
+  Mesh         *di_mesh;
+  glm::mat4     di_model;
+};
+
+// what it took to draw a list; "changes" are the state binds made
+struct DrawStats {
+  unsigned      ds_items;
+  unsigned      ds_programs;            // glUseProgram()s
+  unsigned      ds_textures;            // glBindTexture()s
+  unsigned      ds_vertex_arrays;       // glBindVertexArray()s
+  unsigned      ds_matrices;            // MVP uploads
+  unsigned      ds_multidraws;          // of terrain (see TerrainMultiDraw)
+  unsigned      ds_instances;           // entities drawn by instancing
+};
+
+struct DrawList {
+  std::vector<DrawItem> dl_items;
+};
+
+void draw_list_add(DrawList *dl, unsigned pass, Mesh *m, GLuint texture,
+                   glm::mat4 const& model);
+// draw everything in the list (into texture unit 0), adding to
+// *stats, and empty it
+void draw_list_submit(UserInterface *ui, DrawList *dl, DrawStats *stats);
+// set the uniforms a shader has that are the same for all it draws in
+// a frame; do it on switching to the shader
+void prepare_shader(UserInterface *ui, ShaderRef const *shader);
+
+#endif /* _H_HEXPLORE_CLIENT_DRAWLIST */
@@ -1,6 +1,7 @@
 #include <unistd.h>
 #include <sys/types.h>
 #include <set>
+#include <algorithm>
 #include "ui.h"
 #include <zlib.h>
 #include <sys/time.h>
@@ -51,6 +52,9 @@ unsigned nextAnimusUid = 1;
 
 void ui_hopup(UserInterface *ui, float dz, float duration);
 bool ui_remove_animus(UserInterface *ui, PlayerAnimus *a);
+void ui_want_region(UserInterface *ui, Posn const& p);
+void ui_want_regions_around(UserInterface *ui, Posn const& center);
+void ui_freeze_distant_regions(UserInterface *ui, Posn const& center);
 
 static Curve *hop_up;
 #define RUN_SPEED_FACTOR                (2.0f)
@@ -58,8 +62,25 @@ static Curve *hop_up;
 #define CROUCH_WALK_SPEED_FACTOR        (0.5f)
 #define SELECTION_RANGE                 (12.0)
 
+/**
+ *   Terrain is drawn out to VIEW_DISTANCE from the camera.  Regions
+ *   within LOD_DETAIL_REGIONS of the camera's region (counting as for
+ *   coldDistance) are drawn in full detail, those within
+ *   LOD_HALF_REGIONS with their 2x2 coarse mesh, and the rest with
+ *   their 4x4 one
+ */
+#define VIEW_DISTANCE                   (10*REGION_SIZE)
+#define LOD_DETAIL_REGIONS              (2)
+#define LOD_HALF_REGIONS                (5)
+// the far plane is past the far corners of the farthest regions drawn,
+// and the fog (which leaves exp(-(density * distance)^2) of the color)
+// has all but hidden them by then: 5% is left at VIEW_DISTANCE
+#define FAR_PLANE                       ((float)(VIEW_DISTANCE + REGION_SIZE))
+#define FOG_DENSITY                     ((float)(1.73 / VIEW_DISTANCE))
+
 void show_axes(UserInterface *ui, glm::mat4 model);
 void show_box(UserInterface *ui, frect box);
+void ui_draw_instanced_entities(UserInterface *ui);
 
 struct Posture {
   uint8_t       clearance;
@@ -86,6 +107,8 @@ static const Posture posture_info[3] = {
 
 #define TEXT_POPUP_W  (8*40)    // 40 characters wide
 #define TEXT_POPUP_H  (8*2)     // 2 columns high
+#define STATS_OVERLAY_W (8*24+4)        // 24 characters wide
+#define STATS_OVERLAY_H (10*9+4)        // 9 lines high
 
 unsigned keymap[] = {
   SDL_SCANCODE_W,
@@ -378,6 +401,30 @@ void ui_popup_update(UserInterface *ui)
   o->flush();
 }
 
+// write what it took to draw the last frame into the stats overlay
+void ui_stats_update(UserInterface *ui, double fps)
+{
+  OverlayImage *o = ui->statsOverlay;
+  DrawStats const& ds(ui->drawStats);
+  char lines[9][32];
+  snprintf(lines[0], sizeof(lines[0]), "%.1f fps", fps);
+  snprintf(lines[1], sizeof(lines[1]), "%u draws", ds.ds_items);
+  snprintf(lines[2], sizeof(lines[2]), "%u programs", ds.ds_programs);
+  snprintf(lines[3], sizeof(lines[3]), "%u textures", ds.ds_textures);
+  snprintf(lines[4], sizeof(lines[4]), "%u vertex arrays", ds.ds_vertex_arrays);
+  snprintf(lines[5], sizeof(lines[5]), "%u matrices", ds.ds_matrices);
+  snprintf(lines[6], sizeof(lines[6]), "%u multi-draws", ds.ds_multidraws);
+  snprintf(lines[7], sizeof(lines[7]), "%u instances", ds.ds_instances);
+  snprintf(lines[8], sizeof(lines[8]), "%u sections occluded",
+           ui->cullStats.sections_occluded);
+
+  o->fill(0xc0ffffff);
+  for (int i=0; i<9; i++) {
+    o->write(*ui->popupFont, lines[i], 2, 2 + 10*i);
+  }
+  o->flush();
+}
+
 Animus::~Animus()
 {
 }
@@ -472,13 +519,11 @@ bool PlayerWalkingAnimus::update(double dt)
   {
     Posn posn(s.x & ~(REGION_SIZE-1), s.y & ~(REGION_SIZE-1));
     if (!(posn == pa_ui->currentRegionPosn)) {
-      // check to see if we have this and all the adjacent regions cached
-      for (int drx=-1; drx<=1; drx++) {
-        for (int dry=-1; dry<=1; dry++) {
-          Posn p(posn.x + drx * REGION_SIZE, posn.y + dry * REGION_SIZE);
-          pa_ui->world->requestRegionIfNotPresent(pa_ui->cnx, p);
-        }
-      }
+      pa_ui->currentRegionPosn = posn;
+      pa_ui->world->state.window.recenter(posn, pa_ui->world->state.regionCache);
+      ui_freeze_distant_regions(pa_ui, posn);
+      // check to see if we have the regions in view cached
+      ui_want_regions_around(pa_ui, posn);
     }
   }
   if (!s.span) {
@@ -575,11 +620,11 @@ bool PlayerWalkingAnimus::update(double dt)
     fprintf(debug_animus, " adj {%d,%d,%d+%d}", adj.x, adj.y, adj.z, adj.span->height);
   }
   int z = floor(pa_ui->location[2] / z_scale);
-  SpanVector const& spanvec(rgn->columns[idy][idx]);
+  SpanColumn spanvec(rgn->column(idx, idy));
 
-  unsigned char v_type[64];
+  unsigned char v_type[64 + EXPAND_SLOP];
   const int floor_index = 32;
-  expandSpan(rgn, spanvec, z-floor_index, sizeof(v_type), &v_type[0], NULL);
+  expandColumns(rgn, &spanvec, 1, z-floor_index, 64, sizeof(v_type), &v_type[0], NULL);
 
 #define MAX_STEP_UP     (5)
 #define MAX_JUMP_UP     (20)
@@ -1325,7 +1370,7 @@ void ui_outline_hit(struct UserInterface *ui)
         } else {*/ 
       int z0 = rgn->basement + px.z0();
       int ze = rgn->basement + px.hitz();
-      SpanVector const& span(rgn->columns[px.y()][px.x()]);
+      SpanColumn span(rgn->column(px.x(), px.y()));
       outline_hex_prism(ui, 
                         rgn->origin.x + px.x(), 
                         rgn->origin.y + px.y(), 
@@ -1445,6 +1490,65 @@ void ui_render_status(struct UserInterface *ui)
   SDL_RenderPresent(rend);
 }
 
+// the origin of the region the camera is over
+static Posn camera_region(struct UserInterface *ui)
+{
+  int x, y;
+  convert_xy_to_hex(ui->location.x, ui->location.y, &x, &y);
+  return Posn(x & ~(REGION_SIZE-1), y & ~(REGION_SIZE-1));
+}
+
+// distance between two regions, in regions, in the same sense as coldDistance
+static int region_distance(Posn const& a, Posn const& b)
+{
+  int dx = abs(a.x - b.x) >> REGION_SIZE_BITS;
+  int dy = abs(a.y - b.y) >> REGION_SIZE_BITS;
+  return (dx > dy) ? dx : dy;
+}
+
+// is any of the region at p close enough to the camera to be drawn?
+static bool region_in_view(struct UserInterface *ui, Posn const& p)
+{
+  glm::vec2 terrain_center(hex_center_x(p.x + REGION_SIZE/2,
+                                        p.y + REGION_SIZE/2),
+                           hex_center_y(p.x + REGION_SIZE/2,
+                                        p.y + REGION_SIZE/2));
+  glm::vec2 camera(ui->location.x, ui->location.y);
+  return glm::distance(terrain_center, camera) < VIEW_DISTANCE;
+}
+
+// the mesh a section is drawn with, d regions from the camera's; the
+// coarse meshes only ever stand higher than the detailed ones, and
+// reach to the edge of the region, so neighbors drawn at different
+// levels overlap rather than leaving cracks
+static Mesh *section_mesh(TerrainSection *m, int d)
+{
+  if ((d <= LOD_DETAIL_REGIONS) && m->ts_ground) {
+    return m->ts_ground;
+  } else if (d <= LOD_HALF_REGIONS) {
+    return m->ts_coarse[0];
+  } else {
+    return m->ts_coarse[1];
+  }
+}
+
+// a box around an entity however it's turned, since Entity::bbox()
+// is of the model unturned (about its origin)
+static frect entity_cull_box(Entity *e)
+{
+  frect const& b(e->handler->bbox);
+  double r = std::max(std::max(fabs(b.x0), fabs(b.x1)),
+                      std::max(fabs(b.y0), fabs(b.y1)));
+  frect c;
+  c.x0 = e->location.x - r;
+  c.y0 = e->location.y - r;
+  c.z0 = e->location.z + b.z0;
+  c.x1 = e->location.x + r;
+  c.y1 = e->location.y + r;
+  c.z1 = e->location.z + b.z1;
+  return c;
+}
+
 void ui_render(struct UserInterface *ui)
 {
   glDisable(GL_DEPTH_TEST);
@@ -1498,47 +1602,92 @@ void ui_render(struct UserInterface *ui)
   glEnable(GL_CULL_FACE);
 
   glActiveTexture(GL_TEXTURE0);
-  glBindTexture(GL_TEXTURE_2D, ui->textureId);
   //printf("rendering terrain:");
-  std::vector<Mesh*> water;
-
-  glPushAttrib(GL_ALL_ATTRIB_BITS);
+  Posn here(camera_region(ui));
+  ui->frustum.extract(ui->projectionMatrix * ui->current_viewpoint.vp_matrix);
+  memset(&ui->cullStats, 0, sizeof(ui->cullStats));
+  memset(&ui->drawStats, 0, sizeof(ui->drawStats));
+
+  // first what the frustum leaves, with the solid ground of the
+  // nearest of it drawn into the occlusion buffer
+  std::vector<TerrainSection*> sections;
+  OcclusionBuffer *ob = ui->occlusionCulling ? ui->occlusion : NULL;
+  if (ob) {
+    occlusion_begin(ob, ui->projectionMatrix * ui->current_viewpoint.vp_matrix);
+  }
   for (std::vector<TerrainSection>::iterator m=ui->terrain.begin(); m!=ui->terrain.end(); ++m) {
     Posn p(m->ts_posn);
-    glm::mat4 identity(1);
-    glm::vec2 terrain_center(hex_center_x(p.x + REGION_SIZE/2,
-                                          p.y + REGION_SIZE/2),
-                             hex_center_y(p.x + REGION_SIZE/2,
-                                          p.y + REGION_SIZE/2));
-    glm::vec2 camera(ui->location.x, ui->location.y);
-    if (glm::distance(terrain_center, camera) < 5*REGION_SIZE) {
-      Mesh *mesh = m->ts_ground;
-      mesh->render(ui, identity);
-      if (m->ts_water) {
+    if (!region_in_view(ui, p)) {
+      continue;
+    }
+    if (!ui->frustum.visible(m->ts_bbox)) {
+      ui->cullStats.sections_culled++;
+      continue;
+    }
+    sections.push_back(&*m);
+    int d = region_distance(p, here);
+    if (ob && (d <= OCCLUDER_REGIONS) && section_mesh(&*m, d)) {
+      for (int i=0; i<m->ts_num_occluders; i++) {
+        occlusion_add_occluder(ob, m->ts_occluders[i]);
+      }
+    }
+  }
+  if (ob) {
+    occlusion_end(ob);
+  }
+
+  glm::mat4 identity(1);
+  TerrainMultiDraw *tmd = ui->multiDraw ? ui->terrainMultiDraw : NULL;
+  std::vector<Mesh*> water;     // for tmd, after everything opaque
+  for (std::vector<TerrainSection*>::iterator i=sections.begin(); i!=sections.end(); ++i) {
+    TerrainSection *m = *i;
+    if (ob && !occlusion_visible(ob, m->ts_bbox)) {
+      ui->cullStats.sections_occluded++;
+      continue;
+    }
+    ui->cullStats.sections_drawn++;
+    int d = region_distance(m->ts_posn, here);
+    Mesh *mesh = section_mesh(m, d);
+    if ((d <= LOD_DETAIL_REGIONS) && m->ts_ground && m->ts_water) {
+      if (tmd) {
         water.push_back(m->ts_water);
+      } else {
+        draw_list_add(&ui->drawList, DRAW_PASS_BLEND, m->ts_water, ui->textureId, identity);
       }
     }
+    if (mesh && tmd) {
+      terrain_multidraw_add(tmd, mesh);
+    } else if (mesh) {
+      draw_list_add(&ui->drawList, DRAW_PASS_OPAQUE, mesh, ui->textureId, identity);
+    }
   }
-  if (!water.empty()) {
+  if (tmd) {
+    terrain_multidraw_submit(ui, tmd, &ui->terrainShader, ui->textureId, &ui->drawStats);
+  }
+
+  for (EntityMap::iterator i=ui->entities.begin(); i!=ui->entities.end(); ++i) {
+    Entity *e = i->second;
+    if (!e->handler) {
+      continue;
+    }
+    if (!ui->frustum.visible(entity_cull_box(e))) {
+      ui->cullStats.entities_culled++;
+      continue;
+    }
+    ui->cullStats.entities_drawn++;
+    e->handler->draw(ui, e);
+  }
+  draw_list_submit(ui, &ui->drawList, &ui->drawStats);
+  ui_draw_instanced_entities(ui);
+  if (tmd && !water.empty()) {
     glEnable(GL_BLEND);
     glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
-    glm::mat4 identity(1);
     for (std::vector<Mesh*>::iterator m=water.begin(); m!=water.end(); ++m) {
-      (*m)->render(ui, identity);
+      terrain_multidraw_add(tmd, *m);
     }
+    terrain_multidraw_submit(ui, tmd, &ui->waterShader, ui->textureId, &ui->drawStats);
     glDisable(GL_BLEND);
   }
-  glPopAttrib();
-
-  glActiveTexture(GL_TEXTURE0);
-
-  glPushAttrib(GL_ALL_ATTRIB_BITS);
-  for (EntityMap::iterator i=ui->entities.begin(); i!=ui->entities.end(); ++i) {
-    if (i->second->handler) {
-      i->second->handler->draw(ui, i->second);
-    }
-  }
-  glPopAttrib();
 
   glPushAttrib(GL_ALL_ATTRIB_BITS);
   ui_outline_hit(ui);
@@ -1558,6 +1707,13 @@ void ui_render(struct UserInterface *ui)
                     0, 
                     (7-ui->toolSlot) * dy);
   }
+  if (ui->statsOverlay) {
+    int window_w, window_h;
+    SDL_GetWindowSize(ui->window, &window_w, &window_h);
+    ui_render_overlay(ui, ui->statsOverlay,
+                      window_w - STATS_OVERLAY_W*2 - 20, 20,
+                      2.0);
+  }
   glPopAttrib();
 
   glDisable(GL_BLEND);
@@ -1712,6 +1868,16 @@ GLuint load_shader_program(const char *vertex, const char *frag)
   GLuint id = glCreateProgram();
   glAttachShader(id, vertex_shader);
   glAttachShader(id, frag_shader);
+  // the meshes count on the attributes being in this order
+  glBindAttribLocation(id, 0, "vertexPosition_modelspace");
+  glBindAttribLocation(id, 1, "vertexUV");
+  glBindAttribLocation(id, 2, "vertexAmbient");
+  glBindAttribLocation(id, 3, "vertexNormalIndex");
+  glBindAttribLocation(id, 4, "vertexTile");
+  glBindAttribLocation(id, 5, "drawOrigin");    // see TerrainMultiDraw
+  glBindAttribLocation(id, 8, "instanceLocation");      // see draw_instanced()
+  glBindAttribLocation(id, 9, "instanceArgs0");
+  glBindAttribLocation(id, 10, "instanceArgs1");
   glLinkProgram(id);
 
   // Check the program
@@ -1739,46 +1905,251 @@ long real_time(void)    // real time in microseconds
   return tv.tv_sec * 1000000 + tv.tv_usec;
 }
 
-void remesh_region(struct UserInterface *ui, ClientRegion *rgn)
+static void release_terrain_section(struct UserInterface *ui, Posn const& p)
 {
-  TerrainSection s = build_section_from_region(ui, rgn);
-
   for (std::vector<TerrainSection>::iterator i=ui->terrain.begin(); i!=ui->terrain.end(); ++i) {
-    if ((i->ts_posn.x == rgn->origin.x)
-        && (i->ts_posn.y == rgn->origin.y)) {
+    if ((i->ts_posn.x == p.x)
+        && (i->ts_posn.y == p.y)) {
       i->releaseContents();
       ui->terrain.erase(i);
       break;
     }
   }
+}
+
+static TerrainSection *find_terrain_section(struct UserInterface *ui, Posn const& p)
+{
+  for (std::vector<TerrainSection>::iterator i=ui->terrain.begin(); i!=ui->terrain.end(); ++i) {
+    if ((i->ts_posn.x == p.x)
+        && (i->ts_posn.y == p.y)) {
+      return &*i;
+    }
+  }
+  return NULL;
+}
+
+// mesh a region at the detail it will be drawn at
+void remesh_region(struct UserInterface *ui, ClientRegion *rgn)
+{
+  if (region_distance(rgn->origin, camera_region(ui)) <= LOD_DETAIL_REGIONS) {
+    queue_region_mesh(ui, rgn);
+  } else {
+    queue_coarse_mesh(ui, rgn);
+  }
+}
+
+// a freshly built mesh for a region replaces what it had
+static void install_terrain_section(struct UserInterface *ui,
+                                    ClientRegion *rgn,
+                                    TerrainSection const& s)
+{
+  release_terrain_section(ui, rgn->origin);
   ui->terrain.push_back(s);
 }
 
+/**
+ *  A region has just come into the cache; mesh it, and re-mesh the
+ *  regions next door that were meshed without it, since they have
+ *  faces along the shared edge that are now hidden
+ */
+static void ui_region_arrived(struct UserInterface *ui, ClientRegion *rgn)
+{
+  remesh_region(ui, rgn);
+
+  std::vector<ClientRegion*> stale;
+  for (std::vector<TerrainSection>::iterator i=ui->terrain.begin(); i!=ui->terrain.end(); ++i) {
+    int dx = (i->ts_posn.x - rgn->origin.x) / REGION_SIZE;
+    int dy = (i->ts_posn.y - rgn->origin.y) / REGION_SIZE;
+    if ((abs(dx) > 1) || (abs(dy) > 1) || ((dx == 0) && (dy == 0))) {
+      continue;
+    }
+    // from over there, we are at (-dx,-dy)
+    if (!(i->ts_neighbors & TS_NEIGHBOR_BIT(-dx, -dy))) {
+      ClientRegion *r = ui->world->lookupRegion(i->ts_posn);
+      if (r) {
+        stale.push_back(r);
+      }
+    }
+  }
+  for (std::vector<ClientRegion*>::iterator i=stale.begin(); i!=stale.end(); ++i) {
+    remesh_region(ui, *i);
+  }
+}
+
+/**
+ *  Re-mesh the chunks of the columns that have changed (given in
+ *  world coordinates), and of the columns facing them, in whatever
+ *  regions they are in
+ */
+static void remesh_columns(struct UserInterface *ui, std::vector<Posn> const& changed)
+{
+  std::vector<ClientRegion*> rgns;
+  std::vector<unsigned> chunks;
+  for (std::vector<Posn>::const_iterator i=changed.begin(); i!=changed.end(); ++i) {
+    for (int face=0; face<=6; face++) {
+      int nx = i->x, ny = i->y;
+      if (face < 6) {
+        hex_neighbor(face, &nx, &ny);
+      }
+      Posn p(nx & ~(REGION_SIZE-1), ny & ~(REGION_SIZE-1));
+      ClientRegion *r = ui->world->lookupRegion(p);
+      if (!r) {
+        continue;
+      }
+      size_t k = std::find(rgns.begin(), rgns.end(), r) - rgns.begin();
+      if (k == rgns.size()) {
+        rgns.push_back(r);
+        chunks.push_back(0);
+      }
+      chunks[k] |= TS_CHUNK_BIT(nx - p.x, ny - p.y);
+    }
+  }
+  Posn here(camera_region(ui));
+  for (size_t k=0; k<rgns.size(); k++) {
+    if (region_distance(rgns[k]->origin, here) <= LOD_DETAIL_REGIONS) {
+      queue_chunk_mesh(ui, rgns[k], chunks[k]);
+    } else {
+      queue_coarse_mesh(ui, rgns[k]);
+    }
+  }
+}
+
+/**
+ *  Re-mesh after an edit to the column at (x,y) (in world
+ *  coordinates)
+ */
+static void remesh_after_edit(struct UserInterface *ui, int x, int y)
+{
+  remesh_columns(ui, std::vector<Posn>(1, Posn(x, y)));
+}
+
+/**
+ *  Make sure we have a region, either by bringing it back from
+ *  the cold tier or by asking the server for it
+ */
+void ui_want_region(struct UserInterface *ui, Posn const& p)
+{
+  ClientRegion *rgn = ui->world->thawRegion(p);
+  if (rgn) {
+    ui_region_arrived(ui, rgn);
+    return;
+  }
+  ui->world->requestRegionIfNotPresent(ui->cnx, p);
+}
+
+/**
+ *  Called when the player moves into a new region: make sure we
+ *  have, or are getting, every region in view.  The ones near enough
+ *  to be drawn in detail are kept hot, and one that only has coarse
+ *  meshes is meshed in detail; farther away, a region with no mesh at
+ *  all is thawed (or fetched) just long enough to build its coarse ones
+ */
+void ui_want_regions_around(struct UserInterface *ui, Posn const& center)
+{
+  int reach = (int)ceil(VIEW_DISTANCE / (REGION_SIZE * y_stride));
+  // nearest first, so the server sends those first too
+  for (int d=0; d<=reach; d++) {
+    for (int dy=-d; dy<=d; dy++) {
+      for (int dx=-d; dx<=d; dx++) {
+        if ((abs(dx) != d) && (abs(dy) != d)) {
+          continue;
+        }
+        Posn p(center.x + dx * REGION_SIZE, center.y + dy * REGION_SIZE);
+        if (d <= LOD_DETAIL_REGIONS) {
+          ui_want_region(ui, p);
+          ClientRegion *rgn = ui->world->lookupRegion(p);
+          TerrainSection *s = find_terrain_section(ui, p);
+          if (rgn && s && !s->ts_ground && (s->ts_serial == rgn->meshSerial)) {
+            queue_region_mesh(ui, rgn);
+          }
+        } else if (region_in_view(ui, p) && !find_terrain_section(ui, p)) {
+          ui_want_region(ui, p);
+        }
+      }
+    }
+  }
+}
+
+/**
+ *  Called when the player moves into a new region: put the regions
+ *  that are now far away into the cold tier, and then evict down to
+ *  the memory budget.  Frozen regions still in view keep their coarse
+ *  meshes; otherwise, their meshes go too
+ */
+void ui_freeze_distant_regions(struct UserInterface *ui, Posn const& center)
+{
+  std::vector<Posn> frozen;
+  std::vector<Posn> evicted;
+  ui->world->freezeDistantRegions(center, &frozen);
+  int n_evicted = ui->world->evictToBudget(center, &evicted);
+  for (std::vector<Posn>::iterator i=frozen.begin(); i!=frozen.end(); ++i) {
+    TerrainSection *s = find_terrain_section(ui, *i);
+    if (s && region_in_view(ui, *i)) {
+      s->releaseDetail();
+    } else {
+      release_terrain_section(ui, *i);
+    }
+  }
+  for (std::vector<Posn>::iterator i=evicted.begin(); i!=evicted.end(); ++i) {
+    release_terrain_section(ui, *i);
+  }
+  // and the coarse meshes of cold regions now out of view
+  std::vector<Posn> gone;
+  for (std::vector<TerrainSection>::iterator i=ui->terrain.begin(); i!=ui->terrain.end(); ++i) {
+    if (!region_in_view(ui, i->ts_posn)) {
+      gone.push_back(i->ts_posn);
+    }
+  }
+  for (std::vector<Posn>::iterator i=gone.begin(); i!=gone.end(); ++i) {
+    release_terrain_section(ui, *i);
+  }
+  if (frozen.empty() && (n_evicted == 0)) {
+    return;
+  }
+
+  World *w = &ui->world->state;
+  printf("froze %zu regions, evicted %d; %zu hot, %zu cold in %zu bytes\n",
+         frozen.size(),
+         n_evicted,
+         w->regionCache.size(),
+         w->coldCache.size(),
+         ui->world->residentBytes());
+}
+
 void place_block(struct UserInterface *ui)
 {
   ClientRegion *rgn;
-  SpanVector *vec = ui->world->getColumn(ui->pick.x, 
-                                         ui->pick.y, 
-                                         &rgn);
-  vec->back().height += 1;
+  SpanColumn col = ui->world->getColumn(ui->pick.x, 
+                                        ui->pick.y, 
+                                        &rgn);
+  // edits go through the store, so it can drop its index of the column
+  SpanVector edit(col.begin(), col.end());
+  edit.back().height += 1;
+  rgn->columns.assign(ui->pick.x - rgn->origin.x,
+                      ui->pick.y - rgn->origin.y,
+                      edit);
   //ui->mainmesh = build_mesh_from_region(ui, rgn);
-  printf("place_block() h=%d\n", vec->back().height);
-  remesh_region(ui, rgn);
+  printf("place_block() h=%d\n", edit.back().height);
+  remesh_after_edit(ui, ui->pick.x, ui->pick.y);
 }
 
 void destroy_block(struct UserInterface *ui)
 {
   ClientRegion *rgn;
-  SpanVector *vec = ui->world->getColumn(ui->pick.x, 
-                                         ui->pick.y, 
-                                         &rgn);
-  if (vec->back().height == 1) {
-    vec->pop_back();
+  SpanColumn col = ui->world->getColumn(ui->pick.x, 
+                                        ui->pick.y, 
+                                        &rgn);
+  SpanVector edit(col.begin(), col.end());
+  if (edit.back().height == 1) {
+    edit.pop_back();
   } else {
-    vec->back().height -= 1;
+    edit.back().height -= 1;
   }
+  rgn->columns.assign(ui->pick.x - rgn->origin.x,
+                      ui->pick.y - rgn->origin.y,
+                      edit);
   //ui->mainmesh = build_mesh_from_region(ui, rgn);
-  remesh_region(ui, rgn);
+  remesh_after_edit(ui, ui->pick.x, ui->pick.y);
 }
 
 static const char shifted[] = "aAbBcCdDeEfFgGhHiIjJkKlLmMnNoOpPqQrRsStTuUvVwWxXyYzZ1!2@3#4$5%6^7&8*9(0)-_=+[{]}\\|;:'\",<.>/?`~";
@@ -1804,7 +2175,7 @@ void ui_process_command(UserInterface *ui, std::string const& text)
   if (text == "home") {
     ui_remove_all_animae(ui);
     Posn p(0,0);
-    ui->world->requestRegionIfNotPresent(ui->cnx, p);
+    ui_want_region(ui, p);
     glm::vec3 l(0.5, 0.5, 10000);
     SpanInfo s = ui->world->getSpanBelow(l);
     if (s.region && s.span) {
@@ -1830,6 +2201,64 @@ void ui_process_command(UserInterface *ui, std::string const& text)
     }
     return;
   }
+  if (text == "stats") {
+    if (ui->statsOverlay) {
+      delete ui->statsOverlay;
+      ui->statsOverlay = NULL;
+    } else {
+      ui->statsOverlay = new OverlayImage(STATS_OVERLAY_W, STATS_OVERLAY_H);
+      ui_stats_update(ui, 0);
+    }
+    return;
+  }
+  if (text == "multidraw") {
+    if (!ui->terrainMultiDraw) {
+      printf("no multi-draw-indirect here\n");
+      return;
+    }
+    ui->multiDraw = !ui->multiDraw;
+    printf("multi-draw terrain %s\n", ui->multiDraw ? "on" : "off");
+    return;
+  }
+  if (text == "instancing") {
+    if (!ui->instanceBuffer) {
+      printf("no instancing here\n");
+      return;
+    }
+    ui->instancing = !ui->instancing;
+    printf("instanced entities %s\n", ui->instancing ? "on" : "off");
+    return;
+  }
+  if (text == "occlusion") {
+    ui->occlusionCulling = !ui->occlusionCulling;
+    printf("occlusion culling %s\n", ui->occlusionCulling ? "on" : "off");
+    return;
+  }
+  if (text == "meshlog") {
+    mesh_build_verbose = !mesh_build_verbose;
+    printf("mesh build log %s\n", mesh_build_verbose ? "on" : "off");
+    return;
+  }
+  // record the regions we have, for "bench_mesher -r"
+  if (text.substr(0, 12) == "saveregions ") {
+    std::string path(text.substr(12));
+    FILE *f = fopen(path.c_str(), "wb");
+    if (!f) {
+      perror(path.c_str());
+      return;
+    }
+    int n = 0;
+    for (regionCacheType::iterator j = ui->world->state.regionCache.begin();
+         j != ui->world->state.regionCache.end();
+         ++j) {
+      if (writeRegionRecord(f, j->second)) {
+        n++;
+      }
+    }
+    fclose(f);
+    printf("saved %d regions to %s\n", n, path.c_str());
+    return;
+  }
 
   if (text[0] == '/') {
     tell_entity(ui, text.substr(1));
@@ -2015,10 +2444,6 @@ void GUIWireHandler::dispatch(wire::terrain::Terrain *msg)
 {
   wire::terrain::Rect const& area = msg->area();
   printf("Got terrain data (%d,%d)\n", area.x(), area.y());
-  bool verbose = false;
-  /*if ((area.x() == 0) && (area.y() == 0)) {
-    verbose = true;
-    }*/
 
   World *w = &ui->world->state;
 
@@ -2027,47 +2452,46 @@ void GUIWireHandler::dispatch(wire::terrain::Terrain *msg)
   rgn->origin.y = area.y();
   rgn->basement = msg->basement();
 
-  // Decode the span array
-  unsigned char *p0 = (unsigned char *)&msg->spanarray()[0];
-  unsigned char *p = p0;
+  std::string const& spans(msg->spanarray());
+  if (!decodeSpanArray(rgn, (unsigned char const *)spans.data(), spans.size())) {
+    fprintf(stderr, "warning: truncated span array for region (%d,%d)\n",
+            area.x(), area.y());
+    delete rgn;
+    return;
+  }
+
+  // this supersedes anything we had put aside
+  ui->world->dropColdRegion(rgn->origin);
+  regionCacheType::iterator j = w->regionCache.find(rgn->origin);
+  if (j == w->regionCache.end()) {
+    ui->world->insertRegion(rgn);
+    ui_region_arrived(ui, rgn);
+    return;
+  }
+
+  // a new version of a region we have (e.g., after an edit, which we
+  // will usually have made already), so just re-mesh what's changed
+  ClientRegion *old = j->second;
+  uint32_t changed[REGION_SIZE];
+  int n = diffRegions(old, rgn, changed);
+  rgn->meshSerial = old->meshSerial;
+  ui->world->removeRegion(j);
+  delete old;
+  ui->world->insertRegion(rgn);
+  rgn->picker = makeRegionPicker(rgn);
 
+  std::vector<Posn> cols;
   for (int y=0; y<REGION_SIZE; y++) {
     for (int x=0; x<REGION_SIZE; x++) {
-      bool cverbose = (verbose && (x == 0) && (y == 2));
-      std::vector<Span>& col = rgn->columns[y][x];
-      while (*p) {
-        if (cverbose) {
-          printf(": %02x %02x %02x %02x %02x %02x\n", p[0], p[1], p[2], p[3], p[4], p[5]);
-        }
-        unsigned h = *p++;
-        if (h == 0x7F) {
-          h = ((unsigned)p[0] << 8) + p[1];
-          p += 2;
-        }
-        Span s;
-        s.height = h;
-        s.type = p[0];
-        s.flags = p[1];
-        p += 2;
-        if (cverbose) {
-          printf("decoded (%d,%d) - h=%d t=%d f=%d\n", x, y, s.height, s.type, s.flags);
-        }
-        col.push_back(s);
+      if (changed[y] & (1U << x)) {
+        cols.push_back(Posn(rgn->origin.x + x, rgn->origin.y + y));
       }
-      if (cverbose) {
-        printf("  col has %ld spans\n", col.size());
-      }
-      p++;
     }
   }
-
-  regionCacheType::iterator j = w->regionCache.find(rgn->origin);
-  if (j != w->regionCache.end()) {
-    w->regionCache.erase(j);
+  if (n > 0) {
+    printf("  %d columns changed\n", n);
   }
-  w->regionCache.insert(regionCacheType::value_type(rgn->origin, rgn));
-
-  remesh_region(ui, rgn);
+  remesh_columns(ui, cols);
 }
 
 void GUIWireHandler::dispatch(wire::entity::EntityType *etype)
@@ -2191,8 +2615,21 @@ struct SimpleEntityHandler : EntityHandler {
                    PickPoint *pickat);
 
   GLuint textureId;
+  std::vector<InstancedPiece> pieces;   // empty if it can't be instanced
+  std::vector<EntityInstance> instances;        // to be drawn this frame
 };
 
+void ui_draw_instanced_entities(UserInterface *ui)
+{
+  for (size_t i=0; i<ui->instancedHandlers.size(); i++) {
+    SimpleEntityHandler *h = ui->instancedHandlers[i];
+    draw_instanced(ui, &ui->robotShader, h->textureId,
+                   h->pieces, h->instances, &ui->drawStats);
+    h->instances.clear();
+  }
+  ui->instancedHandlers.clear();
+}
+
 const wire::model::Image *find_image(UserInterface *ui, 
                                      wire::entity::EntityType const& et,
                                      std::string const& name)
@@ -2286,6 +2723,9 @@ SimpleEntityHandler::SimpleEntityHandler(UserInterface *ui,
     //printf("FOUND...\n");
     mesh = internalize_model_mesh(*m, &ui->robotShader, &bbox, glm::mat4(1));
     mesh->picker = make_simple_picker(bbox);
+    if (!instanced_pieces(mesh, &pieces)) {
+      printf("%s entities are too complex to draw with instancing\n", et->type().c_str());
+    }
   }
 }
 
@@ -2424,27 +2864,50 @@ void SimpleEntityHandler::draw(UserInterface *ui, Entity *ent)
   model = glm::translate(model, loc);
 
   float dt = (ui->frameTime - ui->launchTime) * 1.0e-6;
-  float args[] = { facing,                              // Shell
+  float args[ENTITY_ARGS] = { facing,                   // Shell
                    (float)(30*sin(10*(dt+0.7))),        // BR
                    (float)(30*sin(10*(dt+1.5))),        // FR
                    (float)(20*sin(10*(dt+2.1))),        // BL
                    (float)(30*sin(3*dt)),               // H
                    (float)(20*sin(10*(dt+2.1))),        // FL
                    0, 0 };
-  glBindTexture(GL_TEXTURE_2D, textureId);
-  mesh->render(ui, model, &args[0]);
+  if (!ui->instancing || pieces.empty()) {
+    mesh->enqueue(&ui->drawList, textureId, model, &args[0]);
+    return;
+  }
+  if (instances.empty()) {
+    ui->instancedHandlers.push_back(this);
+  }
+  EntityInstance ei;
+  ei.ei_location[0] = loc.x;
+  ei.ei_location[1] = loc.y;
+  ei.ei_location[2] = loc.z;
+  memcpy(ei.ei_args, args, sizeof(ei.ei_args));
+  instances.push_back(ei);
 }
 
 EntityHandler *EntityHandler::get(UserInterface *ui,
                                   std::string const& type,
                                   std::string const& subtype)
 {
+  // the entities of a type (and subtype) share a handler, so they can
+  // be drawn together; they're names, with no NULs in them, so a NUL
+  // separates them in the key
+  std::string key(type);
+  key += '\0';
+  key += subtype;
+  EntityHandlerMap::iterator h = ui->entityHandlers.find(key);
+  if (h != ui->entityHandlers.end()) {
+    return h->second;
+  }
   EntityTypeMap::iterator i = ui->etypes.find(type);
   if (i == ui->etypes.end()) {
     fprintf(stderr, "warning: in EntityHandler::get(\"%s\"), no such entity type\n", type.c_str());
     return NULL;
   }
-  return new SimpleEntityHandler(ui, i->second);
+  EntityHandler *eh = new SimpleEntityHandler(ui, i->second);
+  ui->entityHandlers[key] = eh;
+  return eh;
 }
 
 void UserInterface::update_entity(wire::entity::EntityInfo const& info)
@@ -2574,7 +3037,7 @@ void ui_process_place(struct UserInterface *ui)
   int use_z = rgn->basement + px.hitz();
   int use_h = ui->toolHeight;
 
-  SpanVector const& span(rgn->columns[px.y()][px.x()]);
+  SpanColumn span(rgn->column(px.x(), px.y()));
 
   int use_x = px.x(), use_y = px.y();
   if (px.face() == PICK_INDEX_FACE_TOP) {
@@ -2593,9 +3056,9 @@ void ui_process_place(struct UserInterface *ui)
     }
     // if we are placing along a face, adjust the z location to align
     // with the adjoining column
-    unsigned char v_type[64];
+    unsigned char v_type[64 + EXPAND_SLOP];
     use_z -= use_h / 2;
-    expandSpan(rgn, span, use_z-32, sizeof(v_type), &v_type[0], NULL);
+    expandColumns(rgn, &span, 1, use_z-32, 64, sizeof(v_type), &v_type[0], NULL);
     int max_adj = (use_h < 20) ? use_h : 20;
     for (int adj=0; adj<=((2*max_adj)+1); adj++) {
       int dz = (adj == 0) ? 0 : ((adj & 1) ? -((adj-1)/2) : (adj-1)/2);
@@ -2634,7 +3097,7 @@ void ui_process_dig(struct UserInterface *ui)
   int use_h = 1;
 
   if (px.face() == PICK_INDEX_FACE_TOP) {
-    SpanVector const& span(rgn->columns[px.y()][px.x()]);
+    SpanColumn span(rgn->column(px.x(), px.y()));
     use_z = rgn->basement + px.z0() + span[px.span()].height;
     use_z -= use_h;
   } else if (px.face() == PICK_INDEX_FACE_BOTTOM) {
@@ -2728,6 +3191,7 @@ void ui_run(struct UserInterface *ui)
 
   while (!ui->done_flag) {
     g->flush_incoming(ui->cnx);
+    collect_region_meshes(ui, install_terrain_section);
     ui_process_event(ui);
 
     ui->frame += 1;
@@ -2742,11 +3206,46 @@ void ui_run(struct UserInterface *ui)
     long dt = ui->frameTime - ui->fpsReport.time;
     if (dt > 1000000) {
       long dframes = ui->frame - ui->fpsReport.frame;
-      printf("FPS %.3f  at  %.3f %.3f %.3f  facing %.1f\n", (double)dframes / (dt * 1.0e-6),
+      double fps = (double)dframes / (dt * 1.0e-6);
+      printf("FPS %.3f  at  %.3f %.3f %.3f  facing %.1f\n", fps,
              ui->location.x,
              ui->location.y,
              ui->location.z,
              ui->facing);
+      RegionCacheStats const& rcs(ui->world->state.stats);
+      printf("    regions %zu hot %zu cold, %.1f of %zu MB;"
+             " %lu hits %lu misses %lu evictions\n",
+             ui->world->state.regionCache.size(),
+             ui->world->state.coldCache.size(),
+             ui->world->residentBytes() / 1048576.0,
+             ui->world->regionBudget >> 20,
+             rcs.rcs_hits,
+             rcs.rcs_misses,
+             rcs.rcs_evictions);
+      printf("    drew %u sections (%u culled, %u occluded), %u entities (%u culled)\n",
+             ui->cullStats.sections_drawn, ui->cullStats.sections_culled,
+             ui->cullStats.sections_occluded,
+             ui->cullStats.entities_drawn, ui->cullStats.entities_culled);
+      DrawStats const& ds(ui->drawStats);
+      printf("    %u draws: %u programs, %u textures, %u vertex arrays, %u matrices,"
+             " %u multi-draws, %u instances\n",
+             ds.ds_items, ds.ds_programs, ds.ds_textures,
+             ds.ds_vertex_arrays, ds.ds_matrices, ds.ds_multidraws, ds.ds_instances);
+      if (ui->statsOverlay) {
+        ui_stats_update(ui, fps);
+      }
+      BufferPoolStats vs, is;
+      buffer_pool_stats(&ui->terrainBuffers->tb_vertices, &vs);
+      buffer_pool_stats(&ui->terrainBuffers->tb_indices, &is);
+      StagingRing const& sr(ui->terrainBuffers->tb_staging);
+      printf("    terrain buffers %u+%u pages, %.1f MB allocated %.1f MB free"
+             " (%.1f MB fragmented); %.1f MB uploaded staged, %.1f MB direct\n",
+             vs.bps_pages, is.bps_pages,
+             (vs.bps_allocated + is.bps_allocated) / 1048576.0,
+             (vs.bps_free + is.bps_free) / 1048576.0,
+             (vs.bps_fragmented + is.bps_fragmented) / 1048576.0,
+             sr.sr_staged / 1048576.0,
+             sr.sr_direct / 1048576.0);
       ui->fpsReport.time = ui->frameTime;
       ui->fpsReport.frame = ui->frame;
       // flush everything every second
@@ -2762,6 +3261,8 @@ void ui_run(struct UserInterface *ui)
 
 void ui_close(struct UserInterface *ui)
 {
+  stop_mesh_workers(ui->meshWorkers);
+  ui->meshWorkers = NULL;
   SDL_GL_DeleteContext(ui->glcontext);
   SDL_DestroyRenderer(ui->renderer);
   SDL_Quit();
@@ -2774,6 +3275,17 @@ UserInterface::UserInterface(ClientOptions const& opt)
   fpsReport.time = 0;
   fpsReport.frame = 0;
   outlineMesh = NULL;
+  meshWorkers = NULL;
+  terrainBuffers = NULL;
+  terrainMultiDraw = NULL;
+  multiDraw = false;
+  instanceBuffer = 0;
+  instancing = false;
+  occlusion = new OcclusionBuffer();
+  occlusionCulling = true;
+  memset(&cullStats, 0, sizeof(cullStats));
+  memset(&drawStats, 0, sizeof(drawStats));
+  statsOverlay = NULL;
   toolSlot = 0;
   toolHeight = 6;
   placeToolType = 3;
@@ -2833,6 +3345,17 @@ UserInterface::UserInterface(ClientOptions const& opt)
   if (!glcontext) {
     fatal("SDL_GL_CreateContext", SDL_GetError());
   }
+  terrainBuffers = create_terrain_buffers();
+  terrainMultiDraw = create_terrain_multidraw();
+  multiDraw = (terrainMultiDraw != NULL);
+  instanceBuffer = 0;
+  if (SDL_GL_ExtensionSupported("GL_ARB_instanced_arrays")
+      && SDL_GL_ExtensionSupported("GL_ARB_draw_instanced")) {
+    glGenBuffers(1, &instanceBuffer);
+  } else {
+    printf("entities are drawn one at a time\n");
+  }
+  instancing = (instanceBuffer != 0);
 
   /* Initialize OpenGL stuff */
 
@@ -2845,6 +3368,8 @@ UserInterface::UserInterface(ClientOptions const& opt)
   sr.fogColorIndex = glGetUniformLocation(sr.shaderId, "fogColor");
   sr.fogDensityIndex = glGetUniformLocation(sr.shaderId, "fogDensity");
   sr.waterWiggleIndex = 0;
+  sr.regionOriginIndex = glGetUniformLocation(sr.shaderId, "regionOrigin");
+  sr.packScaleIndex = glGetUniformLocation(sr.shaderId, "packScale");
   terrainShader = sr;
 
 
@@ -2855,6 +3380,8 @@ UserInterface::UserInterface(ClientOptions const& opt)
   sr.fogColorIndex = glGetUniformLocation(sr.shaderId, "fogColor");
   sr.fogDensityIndex = glGetUniformLocation(sr.shaderId, "fogDensity");
   sr.waterWiggleIndex = glGetUniformLocation(sr.shaderId, "waterWiggle");
+  sr.regionOriginIndex = glGetUniformLocation(sr.shaderId, "regionOrigin");
+  sr.packScaleIndex = glGetUniformLocation(sr.shaderId, "packScale");
   waterShader = sr;
 
   memset(&sr, 0, sizeof(sr));
@@ -2873,6 +3400,12 @@ UserInterface::UserInterface(ClientOptions const& opt)
   sr.fogColorIndex = 0;
   sr.fogDensityIndex = 0;
   sr.waterWiggleIndex = 0;
+  sr.regionOriginIndex = glGetUniformLocation(sr.shaderId, "regionOrigin");
+  sr.packScaleIndex = glGetUniformLocation(sr.shaderId, "packScale");
+  sr.posedIndex = glGetUniformLocation(sr.shaderId, "posed");
+  sr.jointMatrixIndex = glGetUniformLocation(sr.shaderId, "jointMatrix");
+  sr.jointAxisIndex = glGetUniformLocation(sr.shaderId, "jointAxis");
+  sr.jointSelectIndex = glGetUniformLocation(sr.shaderId, "jointSelect");
   robotShader = sr;
 
   outlineShader.shaderId = load_shader_program("shaders/outline.vertex.glsl",
@@ -2886,8 +3419,9 @@ UserInterface::UserInterface(ClientOptions const& opt)
   //build_mesh(this);
 
   // Projection matrix
-  // Projection matrix : 45° Field of View, 4:3 ratio, display range : 0.1 unit <-> 100 units
-  projectionMatrix = glm::perspective(45.0f, 4.0f / 3.0f, 0.1f, 100.0f);
+  // Projection matrix : 45° Field of View, 4:3 ratio, display range : 0.1 unit <-> FAR_PLANE
+  projectionMatrix = glm::perspective(45.0f, 4.0f / 3.0f, 0.1f, FAR_PLANE);
+  fogDensity = FOG_DENSITY;
 
   textureId = ui_load_textures("textures/terrain.png");
   cursorTexture = ui_load_textures("textures/turtle.png");
@@ -2970,6 +3504,7 @@ int main(int argc, char *argv[])
 
     ui->cnx = cnx;
     ui->world = w;
+    ui->meshWorkers = start_mesh_workers();
 
     printf("run...\n");
     ui_run(ui);
@@ -1,775 +1,853 @@
 #include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <deque>
+#include <algorithm>
 #include "ui.h"
 #include <hexcom/misc.h>
 #include "world.h"
 #include <hexcom/hex.h>
+#include <hexcom/terrainmesh.h>
 #include "wire/model.pb.h"
 
 void show_axes(UserInterface *ui, glm::mat4 model);
 
-#define TEXTURE_GRID_WIDTH      (16)
-#define SIDE_TEXTURE_HEIGHT     (10)    // how many z-units the texture covers
-
   static inline double terrain_u(unsigned index) {
     return (index % TEXTURE_GRID_WIDTH) * (1.0 / TEXTURE_GRID_WIDTH);
   }
   static inline double terrain_v(unsigned index) {
     return (index / TEXTURE_GRID_WIDTH) * (1.0 / TEXTURE_GRID_WIDTH);
   }
-  enum TextureIds {
-    GRASSY_DIRT_TOP,
-    GRASSY_DIRT_BOTTOM = GRASSY_DIRT_TOP,
-    GRASSY_DIRT_SIDE_FIRST,
-    GRASSY_DIRT_SIDE_REST,
 
-    OAK_TREE_TOP,
-    OAK_TREE_BOTTOM = OAK_TREE_TOP,
-    OAK_TREE_SIDE_FIRST,
-    OAK_TREE_SIDE_REST,
+Mesh::~Mesh()
+{
+  if (vertexArray) {
+    glDeleteVertexArrays(1, &vertexArray);
+  }
+}
 
-    ROCK_TOP = 16,
-    ROCK_BOTTOM = ROCK_TOP,
-    ROCK_SIDE_FIRST = ROCK_TOP,
-    ROCK_SIDE_REST = ROCK_TOP,
+struct TriangularMesh : Mesh {
+  virtual ~TriangularMesh();
+  virtual void draw(UserInterface *ui);
+};
 
-    SAND_TOP = 18,
-    SAND_BOTTOM = SAND_TOP,
-    SAND_SIDE_FIRST = SAND_TOP,
-    SAND_SIDE_REST = SAND_TOP,
+TriangularMesh::~TriangularMesh()
+{
+  GLuint ids[4] = { vertexBuffer, uvBufferId, ambientBufferId, indexBufferId };
+  glDeleteBuffers(4, ids);
+}
 
-    RAILWAY_1_TOP = (10*16)+8,
-    WATER_PHASE_1 = (12*16)+13
-  };
+/**
+ *   Where one chunk of a region's mesh lives in the buffers of its
+ *   PackedTerrainMesh.  Each chunk is given room to grow, so that
+ *   after an edit it can usually be re-meshed and written over in
+ *   place; the spare triangles are degenerate.
+ */
+
+struct TerrainChunk {
+  unsigned      tc_vertex0, tc_vertex_room;
+  unsigned      tc_index0, tc_index_room;       // in triangles
+  unsigned      tc_water0, tc_water_room;       // likewise, for the water
+  unsigned      tc_serial;      // of the mesh job it came from
+};
 
+#define CHUNK_ROOM(n)   ((n) + (n)/4 + 16)
+
+/**
+ *   The vertices and indices of a packed mesh are ranges of the pages
+ *   in UserInterface::terrainBuffers; vertexBuffer and indexBufferId
+ *   are those pages.  A water mesh has only indices of its own, and
+ *   draws with the vertices of the ground mesh it goes with.
+ */
+
+struct PackedTerrainMesh : Mesh {
+  glm::vec3     origin;         // world coordinates of the region's origin
+  GLenum        indexType;      // GL_UNSIGNED_SHORT if there are few enough vertices
+  std::vector<TerrainChunk> chunks;     // by chunk number (ground mesh only)
+  BufferRange   vertexRange;    // (not allocated for a water mesh)
+  BufferRange   indexRange;
+  size_t        vertexOffset;   // in vertexBuffer, of our (or the ground's) vertices
+  virtual ~PackedTerrainMesh();
+  virtual void draw(UserInterface *ui);
+};
 
-Mesh::~Mesh()
+PackedTerrainMesh::~PackedTerrainMesh()
 {
+  buffer_free(&vertexRange);
+  buffer_free(&indexRange);
 }
 
-struct TriangularMesh : Mesh {
-  virtual void render(UserInterface *ui,
-                      glm::mat4 const& model);
-};
-
 struct LineMesh : Mesh {
-  virtual void render(UserInterface *ui,
-                      glm::mat4 const& model);
+  virtual void draw(UserInterface *ui);
 };
 
-struct MeshAccumulator {
-  GLfloat *posnp, *uvp, *ambientp, *normalp;
-  GLuint *indexp, *linep;
-  unsigned count;
-  unsigned top_texture_index;
-  unsigned bottom_texture_index;
-  unsigned side1_texture_index;
-  unsigned side2_texture_index;
-  Slab *current;
-  GLfloat z0, z1;
-  GLfloat hex[6][2];
-  GLfloat hexnorm[6][2];
-  GLfloat posn[3*10000000];
-  GLfloat normal[3*10000000];
-  GLfloat uv[2*10000000];
-  GLfloat ambient[10000000];
-  GLuint index[3*10000000];
-  GLuint lines[2*10000000];
-
-  GLuint transparent_index[3*100000];
-  unsigned num_transparent;
-
-  MeshAccumulator()
-    : posnp( &posn[0] ),
-      uvp( &uv[0] ),
-      ambientp( &ambient[0] ),
-      normalp( &normal[0] ),
-      indexp( &index[0] ),
-      linep( &lines[0] ),
-      count(0),
-      num_transparent(0)
-  {
-  }
+static GLuint gen_posn(MeshAccumulator *ma)
+{
+  GLuint id;
+
+  glGenBuffers(1, &id);
+  glBindBuffer(GL_ARRAY_BUFFER, id);
+  glBufferData(GL_ARRAY_BUFFER,
+               ma->count * 3 * sizeof(GLfloat),
+               ma->posn.data(),
+               GL_STATIC_DRAW);
+  return id;
+}
 
-  unsigned vertex(float x, float y, float z,
-                  float u, float v,
-                  float a,
-                  float nx, float ny, float nz) {
-    /*printf("new vertex %u : %.3f %.3f %.3f   %.3f %.3f\n",
-      count, x, y, z, u, v);*/
-    posnp[0] = x;
-    posnp[1] = y;
-    posnp[2] = z;
-    uvp[0] = u;
-    uvp[1] = v;
-    ambientp[0] = a;
-    normalp[0] = nx;
-    normalp[1] = ny;
-    normalp[2] = nz;
-    normalp += 3;
-    posnp += 3;
-    uvp += 2;
-    ambientp += 1;
-    return count++;
-  }
-
-  void line(unsigned a, unsigned b) {
-    linep[0] = a;
-    linep[1] = b;
-    linep += 2;
-  }
-
-  void triangle(unsigned a, unsigned b, unsigned c) {
-    indexp[0] = a;
-    indexp[1] = b;
-    indexp[2] = c;
-    indexp += 3;
-  }
-
-  void transparent_triangle(unsigned a, unsigned b, unsigned c) {
-    transparent_index[3*num_transparent] = a;
-    transparent_index[3*num_transparent+1] = b;
-    transparent_index[3*num_transparent+2] = c;
-    num_transparent++;
-  }
-
-  GLuint gen_posn() {
-    GLuint id;
-
-    glGenBuffers(1, &id);
-    glBindBuffer(GL_ARRAY_BUFFER, id);
-    glBufferData(GL_ARRAY_BUFFER,
-                 count * 3 * sizeof(GLfloat),
-                 &posn[0],
-                 GL_STATIC_DRAW);
-    return id;
-  }
-
-  GLuint gen_normal() {
-    GLuint id;
-
-    glGenBuffers(1, &id);
-    glBindBuffer(GL_ARRAY_BUFFER, id);
-    glBufferData(GL_ARRAY_BUFFER,
-                 count * 3 * sizeof(GLfloat),
-                 &normal[0],
-                 GL_STATIC_DRAW);
-    return id;
-  }
-
-  GLuint gen_uv() {
-    GLuint id;
-    /*
-    for (unsigned i=0; i<count; i++) {
-      printf("uv[%d]  %.3f %.3f\n",
-             i,
-             TEXTURE_GRID_WIDTH*uv[i*2+0],
-             TEXTURE_GRID_WIDTH*uv[i*2+1]);
-    }
-    */
-    glGenBuffers(1, &id);
-    glBindBuffer(GL_ARRAY_BUFFER, id);
-    glBufferData(GL_ARRAY_BUFFER,
-                 count * 2 * sizeof(GLfloat),
-                 &uv[0],
-                 GL_STATIC_DRAW);
-    return id;
-  }
-
-  GLuint gen_ambient() {
-    GLuint id;
-    glGenBuffers(1, &id);
-    glBindBuffer(GL_ARRAY_BUFFER, id);
-    glBufferData(GL_ARRAY_BUFFER,
-                 count * 1 * sizeof(GLfloat),
-                 &ambient[0],
-                 GL_STATIC_DRAW);
-    return id;
-  }
-
-  unsigned size() {
-    return (indexp - &index[0])/3;
-  }
-
-  GLuint gen_transparent_index() {
-    GLuint id;
-    glGenBuffers(1, &id);
-    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, id);
-    unsigned num = num_transparent;
-    glBufferData(GL_ELEMENT_ARRAY_BUFFER,
-                 num * 3 * sizeof(GLuint),
-                 &transparent_index[0],
-                 GL_STATIC_DRAW);
-    return id;
-  }
-
-  GLuint gen_index() {
-    GLuint id;
-    glGenBuffers(1, &id);
-    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, id);
-    unsigned num = (indexp - &index[0])/3;
-
-    /*
-    for (unsigned i=0; i<num; i++) {
-      printf("index[%d]  %d %d %d\n",
-             i, index[i*3+0], index[i*3+1], index[i*3+2]);
-    }
-    */
-    glBufferData(GL_ELEMENT_ARRAY_BUFFER,
-                 num * 3 * sizeof(GLuint),
-                 &index[0],
-                 GL_STATIC_DRAW);
-    //printf("index size = %u\n", num);
-    return id;
-  }
-
-  GLuint gen_lines(unsigned *nump) {
-    GLuint id;
-    glGenBuffers(1, &id);
-    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, id);
-    unsigned num = (linep - &lines[0])/2;
-    *nump = num;
-    glBufferData(GL_ELEMENT_ARRAY_BUFFER,
-                 num * 2 * sizeof(GLuint),
-                 &lines[0],
-                 GL_STATIC_DRAW);
-    return id;
+static GLuint gen_uv(MeshAccumulator *ma)
+{
+  GLuint id;
+  /*
+  for (unsigned i=0; i<ma->count; i++) {
+    printf("uv[%d]  %.3f %.3f\n",
+           i,
+           TEXTURE_GRID_WIDTH*ma->uv[i*2+0],
+           TEXTURE_GRID_WIDTH*ma->uv[i*2+1]);
   }
+  */
+  glGenBuffers(1, &id);
+  glBindBuffer(GL_ARRAY_BUFFER, id);
+  glBufferData(GL_ARRAY_BUFFER,
+               ma->count * 2 * sizeof(GLfloat),
+               ma->uv.data(),
+               GL_STATIC_DRAW);
+  return id;
+}
+
+static GLuint gen_ambient(MeshAccumulator *ma)
+{
+  GLuint id;
+  glGenBuffers(1, &id);
+  glBindBuffer(GL_ARRAY_BUFFER, id);
+  glBufferData(GL_ARRAY_BUFFER,
+               ma->count * 1 * sizeof(GLfloat),
+               ma->ambient.data(),
+               GL_STATIC_DRAW);
+  return id;
+}
+
+static GLuint gen_index(MeshAccumulator *ma)
+{
+  GLuint id;
+  glGenBuffers(1, &id);
+  glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, id);
+  unsigned num = (ma->indexp - ma->index.data())/3;
 
   /*
-   *
-   *       4
-   *       /\
-   *      /  \
-   *    5/    \
-   *    |      |3
-   *    |      |
-   *    |      |
-   *    0\    /2
-   *      \  /
-   *       \/
-   *        1
-   *
-   *
-   *
-   *
-   *
-   *
-   *
-   */
-
-  void setup(Slab *slab) {
-    current = slab;
-    double x0 = slab->x * x_stride;
-    if (slab->y & 1) {
-      x0 += x_stride / 2;
-    }
-    double y0 = slab->y * y_stride;
-    z0 = slab->z0 * z_scale;
-    z1 = slab->z1 * z_scale;
-
-    hex[0][0] = x0;
-    hex[0][1] = y0;
-    // face norms are labeled after the vertex # that precedes them,
-    // so face[0] is between vertex 0 and vertex 1
-    hexnorm[0][0] = cos(DEG_TO_RAD((210+270)/2.0));
-    hexnorm[0][1] = sin(DEG_TO_RAD((210+270)/2.0));
-
-    hex[1][0] = x0 + x_stride/2;
-    hex[1][1] = y0 - a;
-    hexnorm[1][0] = cos(DEG_TO_RAD((270+330)/2.0));
-    hexnorm[1][1] = sin(DEG_TO_RAD((270+330)/2.0));
-
-    hex[2][0] = x0 + x_stride;
-    hex[2][1] = y0;
-    hexnorm[2][0] = cos(DEG_TO_RAD(0));
-    hexnorm[2][1] = sin(DEG_TO_RAD(0));
-
-    hex[3][0] = x0 + x_stride;
-    hex[3][1] = y0 + edge;
-    hexnorm[3][0] = cos(DEG_TO_RAD((30+90)/2.0));
-    hexnorm[3][1] = sin(DEG_TO_RAD((30+90)/2.0));
-
-    hex[4][0] = x0 + x_stride/2;
-    hex[4][1] = y0 + (edge+a);
-    hexnorm[4][0] = cos(DEG_TO_RAD((90+150)/2.0));
-    hexnorm[4][1] = sin(DEG_TO_RAD((90+150)/2.0));
-
-    hex[5][0] = x0;
-    hex[5][1] = y0 + edge;
-    hexnorm[5][0] = cos(DEG_TO_RAD((150+210)/2.0));
-    hexnorm[5][1] = sin(DEG_TO_RAD((150+210)/2.0));
-
-    switch (slab->type) {
-    case 1:
-      top_texture_index = GRASSY_DIRT_TOP;
-      bottom_texture_index = GRASSY_DIRT_BOTTOM;
-      side1_texture_index = GRASSY_DIRT_SIDE_FIRST;
-      side2_texture_index = GRASSY_DIRT_SIDE_REST;
-      break;
-    case 2:
-      top_texture_index = OAK_TREE_TOP;
-      bottom_texture_index = OAK_TREE_BOTTOM;
-      side1_texture_index = OAK_TREE_SIDE_FIRST;
-      side2_texture_index = OAK_TREE_SIDE_REST;
-      break;
-    case 3:
-      top_texture_index = ROCK_TOP;
-      bottom_texture_index = ROCK_BOTTOM;
-      side1_texture_index = ROCK_SIDE_FIRST;
-      side2_texture_index = ROCK_SIDE_REST;
-      break;
-    case 4:
-      top_texture_index = SAND_TOP;
-      bottom_texture_index = SAND_BOTTOM;
-      side1_texture_index = SAND_SIDE_FIRST;
-      side2_texture_index = SAND_SIDE_REST;
-      break;
+  for (unsigned i=0; i<num; i++) {
+    printf("index[%d]  %d %d %d\n",
+           i, ma->index[i*3+0], ma->index[i*3+1], ma->index[i*3+2]);
+  }
+  */
+  glBufferData(GL_ELEMENT_ARRAY_BUFFER,
+               num * 3 * sizeof(GLuint),
+               ma->index.data(),
+               GL_STATIC_DRAW);
+  //printf("index size = %u\n", num);
+  return id;
+}
 
-    case 5:
-      top_texture_index = RAILWAY_1_TOP;
-      bottom_texture_index = ROCK_BOTTOM;
-      side1_texture_index = ROCK_SIDE_FIRST;
-      side2_texture_index = ROCK_SIDE_REST;
-      break;
-      
-    case 240:
-      top_texture_index = WATER_PHASE_1;
-      bottom_texture_index = WATER_PHASE_1;
-      side1_texture_index = WATER_PHASE_1;
-      side2_texture_index = WATER_PHASE_1;
-      break;
-    }
+static TriangularMesh *make_triangular(MeshAccumulator *ma, ShaderRef *shader)
+{
+  TriangularMesh *m = new TriangularMesh();
+  m->vertexBuffer = gen_posn(ma);
+  m->uvBufferId = gen_uv(ma);
+  m->ambientBufferId = gen_ambient(ma);
+  m->indexBufferId = gen_index(ma);
+  m->count = ma->size();
+  m->shader = shader;
+
+  glGenVertexArrays(1, &m->vertexArray);
+  glBindVertexArray(m->vertexArray);
+  // First attribute buffer -- vertices
+  glEnableVertexAttribArray(0);
+  glBindBuffer(GL_ARRAY_BUFFER, m->vertexBuffer);
+  glVertexAttribPointer(0,              // attribute 0
+                        3,              // size  len([x,y,z])
+                        GL_FLOAT,       // type
+                        GL_FALSE,       // normalized?
+                        0,              // stride
+                        (void*)0);      // array buffer offset;
+
+  // 2nd attribute -- texture UV coordinates
+  glEnableVertexAttribArray(1);
+  glBindBuffer(GL_ARRAY_BUFFER, m->uvBufferId);
+  glVertexAttribPointer(1,              // attribute 1
+                        2,              // size  len([U,V])
+                        GL_FLOAT,       // type
+                        GL_FALSE,       // normalized?
+                        0,              // stride
+                        (void*)0);      // array buffer offset;
+
+  // 3rd attribute -- surface ambient lighting value
+  glEnableVertexAttribArray(2);
+  glBindBuffer(GL_ARRAY_BUFFER, m->ambientBufferId);
+  glVertexAttribPointer(2,              // attribute 2
+                        1,              // size  len([A])
+                        GL_FLOAT,       // type
+                        GL_FALSE,       // normalized?
+                        0,              // stride
+                        (void*)0);      // array buffer offset;
+
+  glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, m->indexBufferId);
+  glBindVertexArray(0);
+  return m;
+}
+
+// indices can be 16 bits if there aren't too many vertices
+static GLenum packed_index_type(unsigned vertices)
+{
+  return (vertices <= 65536) ? GL_UNSIGNED_SHORT : GL_UNSIGNED_INT;
+}
+
+static size_t index_size(GLenum type)
+{
+  return (type == GL_UNSIGNED_SHORT) ? sizeof(GLushort) : sizeof(GLuint);
+}
+
+// write the staged indices into an index range, starting at triangle
+// number at
+static void upload_staged_index(MeshAccumulator *ma, TerrainBuffers *tb,
+                                BufferRange const& r, GLenum type, unsigned at)
+{
+  if (type == GL_UNSIGNED_SHORT) {
+    ma->index16.assign(ma->staged.begin(), ma->staged.end());
+    buffer_upload(tb, r, at * 3 * sizeof(GLushort),
+                  ma->index16.data(), ma->index16.size() * sizeof(GLushort));
+  } else {
+    buffer_upload(tb, r, at * 3 * sizeof(GLuint),
+                  ma->staged.data(), ma->staged.size() * sizeof(GLuint));
   }
+}
 
-  void water_top() {
-    double u0 = terrain_u(top_texture_index);
-    double v0 = terrain_v(top_texture_index);
-    const double t_s = 1.0/(4*a*TEXTURE_GRID_WIDTH);
-    const double v_a = a * t_s;
-    const double v_e = edge * t_s;
-    const double u_w = x_stride * t_s;
-
-    v0 += v_a;
-    float ambient = 1.0;
-    float nx = 0, ny = 0, nz = 1;
-    unsigned k0 = vertex(hex[0][0], hex[0][1], z1, u0, v0, ambient, nx, ny, nz);
-    unsigned k1 = vertex(hex[1][0], hex[1][1], z1, u0 + u_w/2, v0 - v_a, ambient, nx, ny, nz);
-    unsigned k2 = vertex(hex[2][0], hex[2][1], z1, u0 + u_w, v0, ambient, nx, ny, nz);
-    unsigned k3 = vertex(hex[3][0], hex[3][1], z1, u0 + u_w, v0 + v_e, ambient, nx, ny, nz);
-    unsigned k4 = vertex(hex[4][0], hex[4][1], z1, u0 + u_w/2, v0 + (v_a+v_e), ambient, nx, ny, nz);
-    unsigned k5 = vertex(hex[5][0], hex[5][1], z1, u0, v0 + v_e, ambient, nx, ny, nz);
-
-    transparent_triangle(k0, k1, k2);
-    transparent_triangle(k2, k3, k5);
-    transparent_triangle(k3, k4, k5);
-    transparent_triangle(k5, k0, k2);
-  }
-
-  void hextop() {
-    double u0 = terrain_u(top_texture_index);
-    double v0 = terrain_v(top_texture_index);
-    const double t_s = 1.0/(4*a*TEXTURE_GRID_WIDTH);
-    const double v_a = a * t_s;
-    const double v_e = edge * t_s;
-    const double u_w = x_stride * t_s;
-
-    v0 += v_a;
-    float ambient = 1.0;
-    switch (current->flags & DEEP_SHADOW) {
-    case DEEP_SHADOW: ambient = 0.5; break;
-    case MEDIUM_SHADOW: ambient = 0.667; break;
-    case LIGHT_SHADOW: ambient = 0.9; break;
-    }
-    float nx = 0, ny = 0, nz = 1;
-    unsigned k0 = vertex(hex[0][0], hex[0][1], z1, u0, v0, ambient, nx, ny, nz);
-    unsigned k1 = vertex(hex[1][0], hex[1][1], z1, u0 + u_w/2, v0 - v_a, ambient, nx, ny, nz);
-    unsigned k2 = vertex(hex[2][0], hex[2][1], z1, u0 + u_w, v0, ambient, nx, ny, nz);
-    unsigned k3 = vertex(hex[3][0], hex[3][1], z1, u0 + u_w, v0 + v_e, ambient, nx, ny, nz);
-    unsigned k4 = vertex(hex[4][0], hex[4][1], z1, u0 + u_w/2, v0 + (v_a+v_e), ambient, nx, ny, nz);
-    unsigned k5 = vertex(hex[5][0], hex[5][1], z1, u0, v0 + v_e, ambient, nx, ny, nz);
-
-    triangle(k0, k1, k2);
-    triangle(k2, k3, k5);
-    triangle(k3, k4, k5);
-    triangle(k5, k0, k2);
-    line(k0, k1);
-    line(k1, k2);
-    line(k2, k3);
-    line(k3, k4);
-    line(k4, k5);
-    line(k5, k0);
-  }
-
-  void hexbottom() {
-    double u0 = terrain_u(bottom_texture_index);
-    double v0 = terrain_v(bottom_texture_index);
-    const double t_s = 1.0/(4*a*TEXTURE_GRID_WIDTH);
-    const double v_a = a * t_s;
-    const double v_e = edge * t_s;
-    const double u_w = x_stride * t_s;
-    v0 += v_a;
-
-    float nx = 0, ny = 0, nz = -1;
-
-    unsigned k0 = vertex(hex[0][0], hex[0][1], z0, u0, v0, 1, nx, ny, nz);
-    unsigned k1 = vertex(hex[1][0], hex[1][1], z0, u0 + u_w/2, v0 - v_a, 1, nx, ny, nz);
-    unsigned k2 = vertex(hex[2][0], hex[2][1], z0, u0 + u_w, v0, 1, nx, ny, nz);
-    unsigned k3 = vertex(hex[3][0], hex[3][1], z0, u0 + u_w, v0 + v_e, 1, nx, ny, nz);
-    unsigned k4 = vertex(hex[4][0], hex[4][1], z0, u0 + u_w/2, v0 + (v_a+v_e), 1, nx, ny, nz);
-    unsigned k5 = vertex(hex[5][0], hex[5][1], z0, u0, v0 + v_e, 1, nx, ny, nz);
-
-    triangle(k2, k1, k0);
-    triangle(k5, k3, k2);
-    triangle(k5, k4, k3);
-    triangle(k2, k0, k5);
-    line(k0, k1);
-    line(k1, k2);
-    line(k2, k3);
-    line(k3, k4);
-    line(k4, k5);
-    line(k5, k0);
-  }
-
-  void face(int f0) {
-    int f1 = (f0+1)%6;
-    int height = (current->z1 - current->z0);
-    // generate the face fragment that's at the top
-    double u0 = terrain_u(side1_texture_index);
-    double v0 = terrain_v(side1_texture_index);
-    const double u_w = 1.0/TEXTURE_GRID_WIDTH;
-    int h = (height > SIDE_TEXTURE_HEIGHT) ? SIDE_TEXTURE_HEIGHT : height;
-    double v_w = h / (double)(SIDE_TEXTURE_HEIGHT*TEXTURE_GRID_WIDTH);
-    short zi = current->z1;
-    double z = zi * z_scale;
-    double dz = h * z_scale;
-
-    float nx = hexnorm[f0][0];
-    float ny = hexnorm[f0][1];
-    float nz = 0;
-    unsigned k0 = vertex(hex[f0][0], hex[f0][1], z, u0, v0, 1, nx, ny, nz);
-    unsigned k1 = vertex(hex[f1][0], hex[f1][1], z, u0 + u_w, v0, 1, nx, ny, nz);
-    unsigned k2 = vertex(hex[f1][0], hex[f1][1], z-dz, u0 + u_w, v0 + v_w, 0.5, nx, ny, nz);
-    unsigned k3 = vertex(hex[f0][0], hex[f0][1], z-dz, u0, v0 + v_w, 0.5, nx, ny, nz);
-
-    triangle(k0, k3, k1);
-    triangle(k1, k3, k2);
-    // generate the remaining face fragments
-    height -= h;
-    zi -= h;
-
-    u0 = terrain_u(side2_texture_index);
-    v0 = terrain_v(side2_texture_index);
-    while (height > 0) {
-      h = (height > SIDE_TEXTURE_HEIGHT) ? SIDE_TEXTURE_HEIGHT : height;
-      v_w = h / (double)(SIDE_TEXTURE_HEIGHT*TEXTURE_GRID_WIDTH);
-      z = zi * z_scale;
-      dz = h * z_scale;
-
-      unsigned k0 = vertex(hex[f0][0], hex[f0][1], z, u0, v0, 0.5, nx, ny, nz);
-      unsigned k1 = vertex(hex[f1][0], hex[f1][1], z, u0 + u_w, v0, 0.5, nx, ny, nz);
-      unsigned k2 = vertex(hex[f1][0], hex[f1][1], z-dz, u0 + u_w, v0 + v_w, 0.5, nx, ny, nz);
-      unsigned k3 = vertex(hex[f0][0], hex[f0][1], z-dz, u0, v0 + v_w, 0.5, nx, ny, nz);
-
-      triangle(k0, k3, k1);
-      triangle(k1, k3, k2);
-      height -= h;
-      zi -= h;
-    }
+// allocate a packed mesh's index range, and fill it with the staged
+// indices; false if there's no room for it
+static bool alloc_staged_index(MeshAccumulator *ma, TerrainBuffers *tb,
+                               PackedTerrainMesh *m)
+{
+  if (!buffer_alloc(&tb->tb_indices, ma->staged.size() * index_size(m->indexType),
+                    &m->indexRange)) {
+    return false;
   }
+  m->indexBufferId = m->indexRange.buffer();
+  upload_staged_index(ma, tb, m->indexRange, m->indexType, 0);
+  return true;
+}
 
-  frect bbox(glm::mat4 xf) {
-    frect b;
-                   
-    if (count == 0) {
-      b.x0 = b.x1 = b.y0 = b.y1 = b.z0 = b.z1 = 0;
-    } else {
-      for (unsigned i=0; i<count; i++) {
-        glm::vec4 p(posn[i*3+0], posn[i*3+1], posn[i*3+2], 1);
-        p = xf * p;
-        if (i == 0) {
-          b.x0 = b.x1 = p[0];
-          b.y0 = b.y1 = p[1];
-          b.z0 = b.z1 = p[2];
-        } else {
-          b.x0 = (p[0] < b.x0) ? p[0] : b.x0;
-          b.x1 = (p[0] > b.x1) ? p[0] : b.x1;
-          b.y0 = (p[1] < b.y0) ? p[1] : b.y0;
-          b.y1 = (p[1] > b.y1) ? p[1] : b.y1;
-          b.z0 = (p[2] < b.z0) ? p[2] : b.z0;
-          b.z1 = (p[2] > b.z1) ? p[2] : b.z1;
-        }
-      }
-    }
-    return b;
+// likewise, for its vertices
+static bool alloc_vertices(TerrainBuffers *tb, PackedTerrainMesh *m, unsigned vertices)
+{
+  if (!buffer_alloc(&tb->tb_vertices, vertices * sizeof(PackedVertex), &m->vertexRange)) {
+    return false;
   }
+  m->vertexBuffer = m->vertexRange.buffer();
+  m->vertexOffset = m->vertexRange.br_offset;
+  return true;
+}
+
+// point the packed attributes at the vertices offset bytes into the
+// bound GL_ARRAY_BUFFER
+static void packed_attributes(size_t offset)
+{
+  glEnableVertexAttribArray(0);
+  glVertexAttribPointer(0, 3, GL_SHORT, GL_FALSE, sizeof(PackedVertex),
+                        (void*)(offset + offsetof(PackedVertex, pv_posn)));
+  glEnableVertexAttribArray(1);
+  glVertexAttribPointer(1, 2, GL_UNSIGNED_SHORT, GL_FALSE, sizeof(PackedVertex),
+                        (void*)(offset + offsetof(PackedVertex, pv_uv)));
+  glEnableVertexAttribArray(2);
+  glVertexAttribPointer(2, 1, GL_UNSIGNED_BYTE, GL_TRUE, sizeof(PackedVertex),
+                        (void*)(offset + offsetof(PackedVertex, pv_ambient)));
+  glEnableVertexAttribArray(3);
+  glVertexAttribPointer(3, 1, GL_UNSIGNED_BYTE, GL_FALSE, sizeof(PackedVertex),
+                        (void*)(offset + offsetof(PackedVertex, pv_normal)));
+  glEnableVertexAttribArray(4);
+  glVertexAttribPointer(4, 1, GL_UNSIGNED_BYTE, GL_FALSE, sizeof(PackedVertex),
+                        (void*)(offset + offsetof(PackedVertex, pv_tile)));
+}
 
-  TriangularMesh *make_triangular(ShaderRef *shader) {
-    TriangularMesh *m = new TriangularMesh();
-    m->vertexBuffer = gen_posn();
-    m->uvBufferId = gen_uv();
-    m->ambientBufferId = gen_ambient();
-    m->indexBufferId = gen_index();
-    m->count = size();
-    m->shader = shader;
-    return m;
+// set up a packed mesh's vertex array, once its buffers are
+static void packed_vertex_array(PackedTerrainMesh *m)
+{
+  glGenVertexArrays(1, &m->vertexArray);
+  glBindVertexArray(m->vertexArray);
+  // all the attributes come out of our part of the one buffer
+  glBindBuffer(GL_ARRAY_BUFFER, m->vertexBuffer);
+  packed_attributes(m->vertexOffset);
+  glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, m->indexBufferId);
+  glBindVertexArray(0);
+}
+
+/*
+ *  Make the mesh for a region, laying out each chunk with room to
+ *  grow (see TerrainChunk); serial is that of the mesh job
+ */
+static PackedTerrainMesh *make_packed_terrain(MeshAccumulator *ma, TerrainBuffers *tb,
+                                              ShaderRef *shader,
+                                              Posn const& origin, unsigned serial)
+{
+  ma->whole_chunk();
+  PackedTerrainMesh *m = new PackedTerrainMesh();
+  m->chunks.resize(TS_CHUNKS);
+  unsigned vertices = 0, triangles = 0, water = 0;
+  for (size_t i=0; i<ma->chunks.size(); i++) {
+    MeshAccumulator::ChunkRange const& r(ma->chunks[i]);
+    TerrainChunk *c = &m->chunks[r.cr_chunk];
+    c->tc_vertex0 = vertices;
+    c->tc_vertex_room = CHUNK_ROOM(r.cr_vertices);
+    c->tc_index0 = triangles;
+    c->tc_index_room = CHUNK_ROOM(r.cr_triangles);
+    c->tc_water0 = water;
+    c->tc_water_room = ma->num_transparent ? CHUNK_ROOM(r.cr_water_triangles) : 0;
+    c->tc_serial = serial;
+    vertices += c->tc_vertex_room;
+    triangles += c->tc_index_room;
+    water += c->tc_water_room;
   }
 
-  TriangularMesh *make_transparent_triangular(ShaderRef *shader, TriangularMesh *main) {
-    if (num_transparent == 0) {
-      return NULL;
-    }
-    TriangularMesh *m = new TriangularMesh();
-    m->vertexBuffer = main->vertexBuffer;
-    m->uvBufferId = main->uvBufferId;
-    m->ambientBufferId = main->ambientBufferId;
-    m->indexBufferId = gen_transparent_index();
-    m->count = num_transparent;
-    m->shader = shader;
-    return m;
-  }
-
-  LineMesh *make_lines(ShaderRef *shader) {
-    LineMesh *m = new LineMesh();
-    m->vertexBuffer = gen_posn();
-    m->uvBufferId = 0;
-    m->ambientBufferId = 0;
-    m->indexBufferId = gen_lines(&m->count);
-    m->shader = shader;
-    return m;
+  m->uvBufferId = 0;
+  m->ambientBufferId = 0;
+  m->indexType = packed_index_type(vertices);
+  if (!alloc_vertices(tb, m, vertices)) {
+    delete m;
+    return NULL;
   }
-};
+  ma->staged.clear();
+  for (size_t i=0; i<ma->chunks.size(); i++) {
+    MeshAccumulator::ChunkRange const& r(ma->chunks[i]);
+    TerrainChunk const& c(m->chunks[r.cr_chunk]);
+    buffer_upload(tb, m->vertexRange, c.tc_vertex0 * sizeof(PackedVertex),
+                  ma->packed.data() + r.cr_vertex0,
+                  r.cr_vertices * sizeof(PackedVertex));
+    ma->stage_chunk_index(ma->index.data() + 3*r.cr_index0, r.cr_triangles,
+                          c.tc_index_room, r.cr_vertex0, c.tc_vertex0);
+  }
+  if (!alloc_staged_index(ma, tb, m)) {
+    delete m;
+    return NULL;
+  }
+  m->count = triangles;
+  m->shader = shader;
+  m->origin = glm::vec3(hex_x(origin.x, origin.y), hex_y(origin.x, origin.y), 0);
+  packed_vertex_array(m);
+  return m;
+}
 
-// has nothing to contribute (used to skip space in the subject column)
-static inline bool is_space(int t)
+static PackedTerrainMesh *make_transparent_packed(MeshAccumulator *ma, TerrainBuffers *tb,
+                                                  ShaderRef *shader,
+                                                  PackedTerrainMesh *main)
 {
-  return (t==0) || (t==240);
+  if (ma->num_transparent == 0) {
+    return NULL;
+  }
+  PackedTerrainMesh *m = new PackedTerrainMesh();
+  ma->staged.clear();
+  for (size_t i=0; i<ma->chunks.size(); i++) {
+    MeshAccumulator::ChunkRange const& r(ma->chunks[i]);
+    TerrainChunk const& c(main->chunks[r.cr_chunk]);
+    ma->stage_chunk_index(ma->transparent_index.data() + 3*r.cr_water0, r.cr_water_triangles,
+                          c.tc_water_room, r.cr_vertex0, c.tc_vertex0);
+  }
+  m->vertexBuffer = main->vertexBuffer;
+  m->vertexOffset = main->vertexOffset;
+  m->uvBufferId = 0;
+  m->ambientBufferId = 0;
+  m->indexType = main->indexType;
+  if (!alloc_staged_index(ma, tb, m)) {
+    delete m;
+    return NULL;
+  }
+  m->count = ma->staged.size() / 3;
+  m->shader = shader;
+  m->origin = main->origin;
+  packed_vertex_array(m);
+  return m;
 }
 
-// might be seen through (used to skip solids in the neighbor column)
-static inline bool is_solid(int t)
+/*
+ *  Write the chunks meshed here over the ones in a region's mesh,
+ *  unless a later job has written them already; returns false
+ *  (having changed nothing) if any of them has outgrown its room
+ */
+static bool patch_packed_terrain(MeshAccumulator *ma, TerrainBuffers *tb,
+                                 PackedTerrainMesh *ground, PackedTerrainMesh *water,
+                                 unsigned serial)
 {
-  return (t!=0) && (t!=240);
+  for (size_t i=0; i<ma->chunks.size(); i++) {
+    MeshAccumulator::ChunkRange const& r(ma->chunks[i]);
+    TerrainChunk const& c(ground->chunks[r.cr_chunk]);
+    if ((r.cr_vertices > c.tc_vertex_room)
+        || (r.cr_triangles > c.tc_index_room)
+        || (r.cr_water_triangles > (water ? c.tc_water_room : 0))) {
+      return false;
+    }
+  }
+  for (size_t i=0; i<ma->chunks.size(); i++) {
+    MeshAccumulator::ChunkRange const& r(ma->chunks[i]);
+    TerrainChunk *c = &ground->chunks[r.cr_chunk];
+    if (c->tc_serial > serial) {
+      continue;
+    }
+    c->tc_serial = serial;
+    buffer_upload(tb, ground->vertexRange, c->tc_vertex0 * sizeof(PackedVertex),
+                  ma->packed.data() + r.cr_vertex0,
+                  r.cr_vertices * sizeof(PackedVertex));
+    ma->staged.clear();
+    ma->stage_chunk_index(ma->index.data() + 3*r.cr_index0, r.cr_triangles,
+                          c->tc_index_room, r.cr_vertex0, c->tc_vertex0);
+    upload_staged_index(ma, tb, ground->indexRange, ground->indexType, c->tc_index0);
+    if (water) {
+      ma->staged.clear();
+      ma->stage_chunk_index(ma->transparent_index.data() + 3*r.cr_water0, r.cr_water_triangles,
+                            c->tc_water_room, r.cr_vertex0, c->tc_vertex0);
+      upload_staged_index(ma, tb, water->indexRange, water->indexType, c->tc_water0);
+    }
+  }
+  return true;
 }
 
-#define MAX_Z_DEPTH     (10000)
-static void explosive_merge(ClientRegion *rgn,
-                            SpanVector const& me, 
-                            SpanVector const& neighbor,
-                            MeshAccumulator *ma,
-                            int x, int y, 
-                            int face)
+// a mesh without chunks, or any room in it
+static PackedTerrainMesh *make_packed_plain(MeshAccumulator *ma, TerrainBuffers *tb,
+                                            ShaderRef *shader, Posn const& origin)
 {
-  uint8_t me_type[MAX_Z_DEPTH];
-  uint8_t neighbor_type[MAX_Z_DEPTH];
-  uint8_t me_flags[MAX_Z_DEPTH];
-
-  int me_z = 0;
-  for (SpanVector::const_iterator i=me.begin(); i!=me.end(); ++i) {
-    memset(&me_flags[me_z], i->flags, i->height);
-    if (is_space(i->type)) {
-      memset(&me_type[me_z], 0, i->height);
-    } else {
-      memset(&me_type[me_z], i->type, i->height);
-    }
-    me_z += i->height;
+  PackedTerrainMesh *m = new PackedTerrainMesh();
+  m->uvBufferId = 0;
+  m->ambientBufferId = 0;
+  m->indexType = packed_index_type(ma->packed.size());
+  if (!alloc_vertices(tb, m, ma->packed.size())) {
+    delete m;
+    return NULL;
+  }
+  buffer_upload(tb, m->vertexRange, 0,
+                ma->packed.data(), ma->packed.size() * sizeof(PackedVertex));
+  ma->staged.assign(ma->index.data(), ma->indexp);
+  if (!alloc_staged_index(ma, tb, m)) {
+    delete m;
+    return NULL;
   }
+  m->count = ma->size();
+  m->shader = shader;
+  m->origin = glm::vec3(hex_x(origin.x, origin.y), hex_y(origin.x, origin.y), 0);
+  packed_vertex_array(m);
+  return m;
+}
 
-  int neighbor_z = 0;
-  for (SpanVector::const_iterator i=neighbor.begin(); i!=neighbor.end(); ++i) {
-    if (is_solid(i->type)) {
-      memset(&neighbor_type[neighbor_z], 1, i->height);
-    } else {
-      memset(&neighbor_type[neighbor_z], 0, i->height);
+/**
+ *  A region to be meshed by a worker thread.  It carries its own copy
+ *  of the region, and of the columns along the edges of the regions
+ *  around it, so the worker never looks at anything the main thread
+ *  might change (or delete) while it's working.
+ */
+struct MeshJob {
+  Posn                  mj_posn;
+  unsigned              mj_serial;      // matches ClientRegion::meshSerial while wanted
+  unsigned              mj_chunks;      // which to mesh; TS_ALL_CHUNKS for a new mesh
+  unsigned              mj_base;        // otherwise, the serial of the mesh to patch
+  Region               *mj_region[3][3];// [1][1] is the one being meshed
+  unsigned              mj_neighbors;   // TS_NEIGHBOR_BIT for each we have
+  MeshAccumulator      *mj_mesh;        // the result (NULL if just coarse)
+  MeshAccumulator      *mj_coarse[TS_COARSE_LEVELS];
+  long                  mj_time;        // how long the meshing took
+  TerrainMeshStats      mj_stats;
+  frect                 mj_bbox;        // of the region, as it was copied
+  frect                 mj_occluders[REGION_OCCLUDERS];
+  int                   mj_num_occluders;
+  MeshJob              *mj_next;
+};
+
+/**
+ *  Copy just the columns of a neighboring region that are next to the
+ *  region being meshed, which is (dx,dy) regions away from it
+ */
+static Region *copy_edge(Region *src, int dx, int dy)
+{
+  Region *r = new Region();
+  r->origin = src->origin;
+  r->basement = src->basement;
+  for (int y=0; y<REGION_SIZE; y++) {
+    int cy = y + dy * REGION_SIZE;
+    if ((cy < -1) || (cy > REGION_SIZE)) {
+      continue;
     }
-    neighbor_z += i->height;
-  }
-  if (me_z > neighbor_z) {
-    memset(&neighbor_type[neighbor_z], 0, me_z - neighbor_z);
-  }
-
-  int i=0;
-  Slab s;
-  s.x = x;
-  s.y = y;
-  while (i < me_z) {
-    if (me_type[i] && !neighbor_type[i]) {
-      int i0 = i;
-      s.type = me_type[i];
-      s.flags = me_flags[i];
-      while ((i < me_z)
-             && (me_type[i] == s.type) 
-             && (me_flags[i] == s.flags)
-             && !neighbor_type[i]) {
-        i++;
+    for (int x=0; x<REGION_SIZE; x++) {
+      int cx = x + dx * REGION_SIZE;
+      if ((cx >= -1) && (cx <= REGION_SIZE)) {
+        SpanColumn col(src->column(x, y));
+        r->columns.assign(x, y, col.begin(), col.size());
       }
-      s.z0 = i0 + rgn->basement;
-      s.z1 = i + rgn->basement;
-      ma->setup(&s);
-      ma->face(face);
-    } else {
-      i++;
     }
   }
+  return r;
 }
 
 
-TerrainSection build_section_from_region(UserInterface *ui,
-                                         ClientRegion *rgn)
+/**
+ *  The CPU half of meshing a region, which runs on a worker thread;
+ *  the coarse meshes are rebuilt every time, since they are cheap
+ *  and any edit may change them
+ */
+static void mesh_region(MeshJob *job)
 {
-  MeshAccumulator *ma = new MeshAccumulator();
-  uint64_t t0 = real_time();
+  if (job->mj_chunks) {
+    job->mj_mesh = acquire_accumulator();
+    mesh_detail(job->mj_region, job->mj_chunks, job->mj_mesh, &job->mj_stats);
+  }
+  for (int level=0; level<TS_COARSE_LEVELS; level++) {
+    job->mj_coarse[level] = acquire_accumulator();
+    mesh_coarse(job->mj_region[1][1], level, job->mj_coarse[level]);
+  }
+  job->mj_num_occluders = region_occluders(job->mj_region[1][1], job->mj_occluders);
+}
 
-  for (int y=0; y<REGION_SIZE; y++) {
-    for (int x=0; x<REGION_SIZE; x++) {
-      std::vector<Span>& col = rgn->columns[y][x];
-      //printf("build mesh (%d,%d) %lu spans: ", rgn->origin.x + x, rgn->origin.y + y, col.size());
-      std::vector<Span> *col_e = NULL;
-      std::vector<Span> *col_ne = NULL;
-      std::vector<Span> *col_nw = NULL;
-      std::vector<Span> *col_w = NULL;
-      std::vector<Span> *col_sw = NULL;
-      std::vector<Span> *col_se = NULL;
-
-      if (x > 0) {
-        col_w = &rgn->columns[y][x-1];
-        //printf(" W");
-      }
-      if (x < (REGION_SIZE-1)) {
-        col_e = &rgn->columns[y][x+1];
-        //printf(" E");
+/**
+ *   Regions are meshed by a pool of worker threads.  Jobs go out on
+ *   a queue under a lock; the finished ones come back on a lock-free
+ *   stack, which the main thread empties once a frame to upload them.
+ */
+
+// never more than this many workers, however many cores there are
+#define MESH_WORKERS_MAX        (4)
+
+struct MeshWorkers {
+  std::vector<std::thread>      mw_threads;
+  std::mutex                    mw_lock;        // covers mw_jobs and mw_stop
+  std::condition_variable       mw_wakeup;
+  std::deque<MeshJob*>          mw_jobs;
+  bool                          mw_stop;
+  std::atomic<MeshJob*>         mw_done;        // most recently finished first
+};
+
+static unsigned mesh_serial = 0;
+bool mesh_build_verbose = false;
+
+static void mesh_worker(MeshWorkers *mw)
+{
+  while (1) {
+    MeshJob *job;
+    {
+      std::unique_lock<std::mutex> lock(mw->mw_lock);
+      while (!mw->mw_stop && mw->mw_jobs.empty()) {
+        mw->mw_wakeup.wait(lock);
       }
-      if (y > 0) {
-        {
-          int se_x = x, se_y = y;
-          hex_se(&se_x, &se_y);
-          if (se_x < REGION_SIZE) {
-            assert(se_y >= 0);
-            assert(se_x >= 0);
-            col_se = &rgn->columns[se_y][se_x];
-            //printf(" SE");
-          }
-        }
-        {
-          int sw_x = x, sw_y = y;
-          hex_sw(&sw_x, &sw_y);
-          if (sw_x > 0) {
-            assert(sw_y >= 0);
-            assert(sw_x < REGION_SIZE);
-            col_sw = &rgn->columns[sw_y][sw_x];
-            //printf(" SW");
-          }
-        }
+      if (mw->mw_stop) {
+        return;
       }
-      if (y < (REGION_SIZE-1)) {
-        {
-          int ne_x = x, ne_y = y;
-          hex_ne(&ne_x, &ne_y);
-          if (ne_x < REGION_SIZE) {
-            assert(ne_y >= 0);
-            assert(ne_x >= 0);
-            col_ne = &rgn->columns[ne_y][ne_x];
-            //printf(" NE");
-          }
-        }
+      job = mw->mw_jobs.front();
+      mw->mw_jobs.pop_front();
+    }
 
-        {
-          int nw_x = x, nw_y = y;
-          hex_nw(&nw_x, &nw_y);
-          if (nw_x > 0) {
-            assert(nw_y >= 0);
-            assert(nw_x < REGION_SIZE);
-            col_nw = &rgn->columns[nw_y][nw_x];
-            //printf(" NW");
-          }
-        }
+    long t0 = real_time();
+    mesh_region(job);
+    job->mj_time = real_time() - t0;
+    for (int i=0; i<3; i++) {
+      for (int j=0; j<3; j++) {
+        delete job->mj_region[i][j];
+        job->mj_region[i][j] = NULL;
       }
-      //printf("\n");
+    }
 
-      //printf("bmr (%d,%d)  %u\n", x, y, ma->size());
-      Slab s;
-      s.x = rgn->origin.x + x;
-      s.y = rgn->origin.y + y;
-      s.z0 = rgn->basement;
-      bool wantbottom = false;
-
-      for (std::vector<Span>::iterator i=col.begin(); i<col.end(); ++i) {
-        s.z1 = s.z0 + i->height;
-        s.type = i->type;
-        s.flags = i->flags;
-        if (i->type == 240) {
-          // special handling for water
-          ma->setup(&s);
-          ma->water_top();
-        } else if (i->type != 0) {
-          ma->setup(&s);
-          ma->hextop();
-          if (wantbottom) {
-            ma->hexbottom();
-          }
-          if (!col_sw) {
-            ma->face(0);
-          }
-          if (!col_se) {
-            ma->face(1);
-          }
-          if (!col_e) {
-            ma->face(2);
-          }
-          if (!col_ne) {
-            ma->face(3);
-          }
-          if (!col_nw) {
-            ma->face(4);
-          }
-          if (!col_w) {
-            ma->face(5);
-          }
+    MeshJob *head = mw->mw_done.load(std::memory_order_relaxed);
+    do {
+      job->mj_next = head;
+    } while (!mw->mw_done.compare_exchange_weak(head, job,
+                                                std::memory_order_release,
+                                                std::memory_order_relaxed));
+  }
+}
+
+MeshWorkers *start_mesh_workers(void)
+{
+  MeshWorkers *mw = new MeshWorkers();
+  mw->mw_stop = false;
+  mw->mw_done.store(NULL);
+  // pick the expansion kernel now, rather than racing to do it
+  // in the workers
+  setExpandKernel(EXPAND_AUTO);
+
+  // leave a core for the main thread
+  int n = std::thread::hardware_concurrency() - 1;
+  n = (n < 1) ? 1 : ((n > MESH_WORKERS_MAX) ? MESH_WORKERS_MAX : n);
+  for (int i=0; i<n; i++) {
+    mw->mw_threads.push_back(std::thread(mesh_worker, mw));
+  }
+  printf("%d mesh worker threads\n", n);
+  return mw;
+}
+
+static void discard_mesh_job(MeshJob *job)
+{
+  for (int i=0; i<3; i++) {
+    for (int j=0; j<3; j++) {
+      delete job->mj_region[i][j];
+    }
+  }
+  if (job->mj_mesh) {
+    release_accumulator(job->mj_mesh);
+  }
+  for (int level=0; level<TS_COARSE_LEVELS; level++) {
+    if (job->mj_coarse[level]) {
+      release_accumulator(job->mj_coarse[level]);
+    }
+  }
+  delete job;
+}
+
+void stop_mesh_workers(MeshWorkers *mw)
+{
+  {
+    std::lock_guard<std::mutex> lock(mw->mw_lock);
+    mw->mw_stop = true;
+  }
+  mw->mw_wakeup.notify_all();
+  for (size_t i=0; i<mw->mw_threads.size(); i++) {
+    mw->mw_threads[i].join();
+  }
+  for (size_t i=0; i<mw->mw_jobs.size(); i++) {
+    discard_mesh_job(mw->mw_jobs[i]);
+  }
+  MeshJob *job = mw->mw_done.exchange(NULL);
+  while (job) {
+    MeshJob *next = job->mj_next;
+    discard_mesh_job(job);
+    job = next;
+  }
+  delete mw;
+}
+
+// a job with a copy of the region, and (if it's to be meshed in
+// detail) the edges of its neighbors
+static MeshJob *new_mesh_job(UserInterface *ui, ClientRegion *rgn, bool detail)
+{
+  MeshJob *job = new MeshJob();
+  job->mj_posn = rgn->origin;
+  job->mj_neighbors = 0;
+  job->mj_mesh = NULL;
+  job->mj_num_occluders = 0;
+  job->mj_stats.tms_hidden_tops = 0;
+  job->mj_stats.tms_hidden_bottoms = 0;
+  job->mj_stats.tms_hidden_sides = 0;
+  for (int level=0; level<TS_COARSE_LEVELS; level++) {
+    job->mj_coarse[level] = NULL;
+  }
+  job->mj_next = NULL;
+  for (int dy=-1; dy<=1; dy++) {
+    for (int dx=-1; dx<=1; dx++) {
+      Region *r = NULL;
+      if (!dx && !dy) {
+        r = new Region(*rgn);
+      } else if (detail) {
+        ClientRegion *nbr = ui->world->findRegion(Posn(rgn->origin.x + dx * REGION_SIZE,
+                                                       rgn->origin.y + dy * REGION_SIZE));
+        if (nbr) {
+          r = copy_edge(nbr, dx, dy);
+          job->mj_neighbors |= TS_NEIGHBOR_BIT(dx, dy);
         }
-        s.z0 = s.z1;
-        wantbottom = true;
       }
-      if (col_sw) {
-        explosive_merge(rgn, col, *col_sw, ma, rgn->origin.x + x, rgn->origin.y + y, 0);
+      job->mj_region[dy+1][dx+1] = r;
+    }
+  }
+  // picking looks at the region itself, so it can be ready right
+  // away; it's made again each time so its bbox takes in any edits
+  rgn->picker = makeRegionPicker(rgn);
+  job->mj_bbox = rgn->picker->bbox;
+  return job;
+}
+
+static void submit_mesh_job(UserInterface *ui, MeshJob *job)
+{
+  MeshWorkers *mw = ui->meshWorkers;
+  {
+    std::lock_guard<std::mutex> lock(mw->mw_lock);
+    mw->mw_jobs.push_back(job);
+  }
+  mw->mw_wakeup.notify_one();
+}
+
+void queue_region_mesh(UserInterface *ui, ClientRegion *rgn)
+{
+  MeshJob *job = new_mesh_job(ui, rgn, true);
+  job->mj_serial = rgn->meshSerial = ++mesh_serial;
+  job->mj_chunks = TS_ALL_CHUNKS;
+  job->mj_base = 0;
+  submit_mesh_job(ui, job);
+}
+
+void queue_coarse_mesh(UserInterface *ui, ClientRegion *rgn)
+{
+  MeshJob *job = new_mesh_job(ui, rgn, false);
+  job->mj_serial = rgn->meshSerial = ++mesh_serial;
+  job->mj_chunks = 0;
+  job->mj_base = 0;
+  submit_mesh_job(ui, job);
+}
+
+static TerrainSection *find_terrain_section(UserInterface *ui, Posn const& p)
+{
+  for (std::vector<TerrainSection>::iterator i=ui->terrain.begin(); i!=ui->terrain.end(); ++i) {
+    if ((i->ts_posn.x == p.x) && (i->ts_posn.y == p.y)) {
+      return &*i;
+    }
+  }
+  return NULL;
+}
+
+void queue_chunk_mesh(UserInterface *ui, ClientRegion *rgn, unsigned chunks)
+{
+  // there has to be a mesh to patch, and not a newer one coming
+  TerrainSection *s = find_terrain_section(ui, rgn->origin);
+  if ((chunks == TS_ALL_CHUNKS)
+      || !s
+      || !s->ts_ground
+      || (s->ts_serial != rgn->meshSerial)) {
+    queue_region_mesh(ui, rgn);
+    return;
+  }
+  MeshJob *job = new_mesh_job(ui, rgn, true);
+  job->mj_serial = ++mesh_serial;
+  job->mj_chunks = chunks;
+  job->mj_base = rgn->meshSerial;
+  submit_mesh_job(ui, job);
+}
+
+// is there a region next door now that wasn't there when meshed?
+static bool missed_neighbor(ClientWorld *w, ClientRegion *rgn, unsigned had)
+{
+  for (int dy=-1; dy<=1; dy++) {
+    for (int dx=-1; dx<=1; dx++) {
+      if ((dx || dy)
+          && !(had & TS_NEIGHBOR_BIT(dx, dy))
+          && w->findRegion(Posn(rgn->origin.x + dx * REGION_SIZE,
+                                rgn->origin.y + dy * REGION_SIZE))) {
+        return true;
       }
-      if (col_se) {
-        explosive_merge(rgn, col, *col_se, ma, rgn->origin.x + x, rgn->origin.y + y, 1);
+    }
+  }
+  return false;
+}
+
+// give a section the coarse meshes (and bbox and occluders) from a
+// job, unless it already has newer ones
+static void install_coarse(UserInterface *ui, TerrainSection *s, MeshJob *job)
+{
+  if (s->ts_coarse_serial > job->mj_serial) {
+    return;
+  }
+  for (int level=0; level<TS_COARSE_LEVELS; level++) {
+    delete s->ts_coarse[level];
+    s->ts_coarse[level] = make_packed_plain(job->mj_coarse[level], ui->terrainBuffers,
+                                            &ui->terrainShader, job->mj_posn);
+  }
+  s->ts_coarse_serial = job->mj_serial;
+  s->ts_bbox = job->mj_bbox;
+  s->ts_num_occluders = job->mj_num_occluders;
+  for (int i=0; i<job->mj_num_occluders; i++) {
+    s->ts_occluders[i] = job->mj_occluders[i];
+  }
+}
+
+int collect_region_meshes(UserInterface *ui,
+                          void (*install)(UserInterface *ui,
+                                          ClientRegion *rgn,
+                                          TerrainSection const& s))
+{
+  MeshJob *list = ui->meshWorkers->mw_done.exchange(NULL, std::memory_order_acquire);
+
+  // put them back in the order they finished
+  MeshJob *job = NULL;
+  while (list) {
+    MeshJob *next = list->mj_next;
+    list->mj_next = job;
+    job = list;
+    list = next;
+  }
+
+  int n = 0;
+  while (job) {
+    MeshJob *next = job->mj_next;
+    ClientRegion *rgn = ui->world->findRegion(job->mj_posn);
+    if (job->mj_chunks && (job->mj_chunks != TS_ALL_CHUNKS)) {
+      // patch the mesh it was queued against, if that's still the
+      // one we have and no new one is on the way
+      TerrainSection *s = find_terrain_section(ui, job->mj_posn);
+      if (rgn
+          && s
+          && s->ts_ground
+          && (rgn->meshSerial == job->mj_base)
+          && (s->ts_serial == job->mj_base)) {
+        if (patch_packed_terrain(job->mj_mesh, ui->terrainBuffers,
+                                 static_cast<PackedTerrainMesh*>(s->ts_ground),
+                                 static_cast<PackedTerrainMesh*>(s->ts_water),
+                                 job->mj_serial)) {
+          install_coarse(ui, s, job);
+          n++;
+        } else {
+          // it outgrew the room it had
+          queue_region_mesh(ui, rgn);
+        }
       }
-      if (col_e) {
-        explosive_merge(rgn, col, *col_e, ma, rgn->origin.x + x, rgn->origin.y + y, 2);
+    } else if (rgn && (rgn->meshSerial == job->mj_serial)) {
+      // (otherwise, the region has been edited and queued again, or
+      // dropped, since this was queued)
+      MeshAccumulator *ma = job->mj_mesh;
+      TerrainSection s;
+      s.ts_posn = job->mj_posn;
+      s.ts_neighbors = job->mj_neighbors;
+      s.ts_serial = job->mj_serial;
+      s.ts_ground = NULL;
+      s.ts_water = NULL;
+      if (ma) {
+        PackedTerrainMesh *m = make_packed_terrain(ma, ui->terrainBuffers,
+                                                   &ui->terrainShader, job->mj_posn,
+                                                   job->mj_serial);
+        s.ts_ground = m;
+        s.ts_water = m ? make_transparent_packed(ma, ui->terrainBuffers,
+                                                 &ui->waterShader, m) : NULL;
       }
-      if (col_ne) {
-        explosive_merge(rgn, col, *col_ne, ma, rgn->origin.x + x, rgn->origin.y + y, 3);
+      for (int level=0; level<TS_COARSE_LEVELS; level++) {
+        s.ts_coarse[level] = NULL;
       }
-      if (col_nw) {
-        explosive_merge(rgn, col, *col_nw, ma, rgn->origin.x + x, rgn->origin.y + y, 4);
+      s.ts_coarse_serial = 0;
+      install_coarse(ui, &s, job);
+      // report it as slow if it takes longer than 100 ms
+      if (s.ts_ground && ((job->mj_time > 100000) || mesh_build_verbose)) {
+        fprintf(stderr, "%sbuild for region (%d,%d); %d+%d triangles in %.4f sec;"
+                " hidden %u tops, %u bottoms, %u sides\n",
+                (job->mj_time > 100000) ? "warning: slow " : "",
+                rgn->origin.x, rgn->origin.y,
+                s.ts_ground->count, s.ts_water ? s.ts_water->count : 0,
+                job->mj_time * 1.0e-6,
+                job->mj_stats.tms_hidden_tops, job->mj_stats.tms_hidden_bottoms,
+                job->mj_stats.tms_hidden_sides);
       }
-      if (col_w) {
-        explosive_merge(rgn, col, *col_w, ma, rgn->origin.x + x, rgn->origin.y + y, 5);
+      install(ui, rgn, s);
+      n++;
+      // a neighbor may have arrived while this was being meshed
+      if (ma && missed_neighbor(ui->world, rgn, job->mj_neighbors)) {
+        queue_region_mesh(ui, rgn);
       }
     }
+    discard_mesh_job(job);
+    job = next;
   }
+  return n;
+}
 
-  TriangularMesh *m = ma->make_triangular(&ui->terrainShader);
-  Mesh *tm = ma->make_transparent_triangular(&ui->waterShader, m);
-  delete ma;
-  uint64_t t1 = real_time();
-  // report it as slow if it takes longer than 100 ms
-  if ((t1-t0) > 100000) {
-    fprintf(stderr, "warning: slow build for region (%d,%d); %d+%d triangles in %.4f sec\n", 
-            rgn->origin.x, rgn->origin.y,
-            m->count, tm ? tm->count : 0, 
-            (t1-t0) * 1.0e-6);
+void TerrainSection::releaseContents()
+{
+  releaseDetail();
+  for (int level=0; level<TS_COARSE_LEVELS; level++) {
+    if (ts_coarse[level]) {
+      delete ts_coarse[level];
+      ts_coarse[level] = NULL;
+    }
   }
-  rgn->picker = makeRegionPicker(rgn);
-
-  TerrainSection s;
-  s.ts_posn = rgn->origin;
-  s.ts_ground = m;
-  s.ts_water = tm;
-  return s;
 }
 
-void TerrainSection::releaseContents()
+void TerrainSection::releaseDetail()
 {
   if (ts_ground) {
     delete ts_ground;
@@ -782,9 +860,9 @@ void TerrainSection::releaseContents()
 }
 
 struct PlainSuperMesh : SuperMesh {
-  virtual float *render(UserInterface *ui,
-                        glm::mat4 const& model,
-                        float *args);
+  virtual float *enqueue(DrawList *dl, GLuint texture,
+                         glm::mat4 const& model,
+                         float *args);
 };
 
 struct SingleAxisMesh : SuperMesh {
@@ -799,9 +877,9 @@ struct SingleAxisRotationMesh : SingleAxisMesh {
     : SingleAxisMesh(axis) {
   }
 
-  virtual float *render(UserInterface *ui,
-                        glm::mat4 const& model,
-                        float *args);
+  virtual float *enqueue(DrawList *dl, GLuint texture,
+                         glm::mat4 const& model,
+                         float *args);
 };
 
 struct SingleAxisTranslationMesh : SingleAxisMesh {
@@ -809,44 +887,44 @@ struct SingleAxisTranslationMesh : SingleAxisMesh {
     : SingleAxisMesh(axis) {
   }
 
-  virtual float *render(UserInterface *ui,
-                        glm::mat4 const& model,
-                        float *args);
+  virtual float *enqueue(DrawList *dl, GLuint texture,
+                         glm::mat4 const& model,
+                         float *args);
 };
 
 
-float *SingleAxisTranslationMesh::render(UserInterface *ui,
-                                         glm::mat4 const& model,
-                                         float *args)
+float *SingleAxisTranslationMesh::enqueue(DrawList *dl, GLuint texture,
+                                          glm::mat4 const& model,
+                                          float *args)
 {
   //printf("TRANSLATE <%.3f %.3f %3f> * %.3f\n", axis[0], axis[1], axis[2], args[0]);
   float distance = *args++;
   glm::mat4 m = glm::translate(model * matrix, axis*distance);
-  return _render(ui, m, args);
+  return _enqueue(dl, texture, m, args);
 }
 
-float *SingleAxisRotationMesh::render(UserInterface *ui,
-                                         glm::mat4 const& model,
-                                         float *args)
+float *SingleAxisRotationMesh::enqueue(DrawList *dl, GLuint texture,
+                                       glm::mat4 const& model,
+                                       float *args)
 {
   //printf("ROTATE <%.3f %.3f %3f> * %.3f\n", axis[0], axis[1], axis[2], args[0]);
   float angle = *args++;
   glm::mat4 m = glm::rotate(model * matrix, angle, axis);
-  return _render(ui, m, args);
+  return _enqueue(dl, texture, m, args);
 }
 
-float *SuperMesh::_render(UserInterface *ui, glm::mat4 const& model, float *args)
+float *SuperMesh::_enqueue(DrawList *dl, GLuint texture, glm::mat4 const& model, float *args)
 {
-  piece->render(ui, model);
+  draw_list_add(dl, DRAW_PASS_OPAQUE, piece, texture, model);
   for (std::vector<SuperMesh*>::iterator i=sub.begin(); i != sub.end(); ++i) {
-    args = (*i)->render(ui, model, args);
+    args = (*i)->enqueue(dl, texture, model, args);
   }
   return args;
 }
 
-float *PlainSuperMesh::render(UserInterface *ui,
-                              glm::mat4 const& model,
-                              float *args)
+float *PlainSuperMesh::enqueue(DrawList *dl, GLuint texture,
+                               glm::mat4 const& model,
+                               float *args)
 {
 #if 0
   printf("[ [ %5.2f %5.2f %5.2f %5.2f ]   THIS MATRIX<%s>\n"
@@ -875,20 +953,146 @@ float *PlainSuperMesh::render(UserInterface *ui,
   printf("---------------------------------------> (%5.2f %5.2f %5.2f)\n",
          org[0], org[1], org[2]);
   */
-  args = _render(ui, m, args);
+  args = _enqueue(dl, texture, m, args);
   //show_axes(ui, m);
   return args;
 }
 
+// add sm's pieces to *pieces, with chain being how sm's parent is
+// posed; *argn counts the args taken so far
+static bool instanced_walk(SuperMesh *sm, InstancedPiece chain, unsigned *argn,
+                           std::vector<InstancedPiece> *pieces)
+{
+  if (chain.ip_joints == ENTITY_JOINTS) {
+    return false;
+  }
+  unsigned j = chain.ip_joints++;
+  chain.ip_matrix[j] = sm->matrix;
+  SingleAxisMesh *joint = dynamic_cast<SingleAxisMesh*>(sm);
+  if (joint) {
+    if (*argn == ENTITY_ARGS) {
+      return false;
+    }
+    int kind = dynamic_cast<SingleAxisRotationMesh*>(sm) ? JOINT_ROTATE : JOINT_TRANSLATE;
+    chain.ip_axis[j] = glm::vec4(joint->axis, kind);
+    chain.ip_select[j][*argn / 4][*argn % 4] = 1;
+    (*argn)++;
+  }
+  chain.ip_mesh = sm->piece;
+  pieces->push_back(chain);
+  for (std::vector<SuperMesh*>::iterator i=sm->sub.begin(); i != sm->sub.end(); ++i) {
+    if (!instanced_walk(*i, chain, argn, pieces)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+bool instanced_pieces(SuperMesh *sm, std::vector<InstancedPiece> *pieces)
+{
+  InstancedPiece root;
+  root.ip_mesh = NULL;
+  root.ip_joints = 0;
+  for (int j=0; j<ENTITY_JOINTS; j++) {
+    root.ip_matrix[j] = glm::mat4(1);
+    root.ip_axis[j] = glm::vec4(0, 0, 0, JOINT_NONE);
+    root.ip_select[j][0] = glm::vec4(0);
+    root.ip_select[j][1] = glm::vec4(0);
+  }
+  unsigned argn = 0;
+  pieces->clear();
+  if (!instanced_walk(sm, root, &argn, pieces)) {
+    pieces->clear();
+    return false;
+  }
+  return true;
+}
+
+// the attributes of an EntityInstance, as robot.vertex.glsl has them
+// (see load_shader_program())
+#define INSTANCE_LOCATION_ATTRIBUTE     (8)
+#define INSTANCE_ARGS_ATTRIBUTE         (9)     // and 10
+
+void draw_instanced(UserInterface *ui, ShaderRef *shader, GLuint texture,
+                    std::vector<InstancedPiece> const& pieces,
+                    std::vector<EntityInstance> const& instances,
+                    DrawStats *stats)
+{
+  if (instances.empty()) {
+    return;
+  }
+  glBindBuffer(GL_ARRAY_BUFFER, ui->instanceBuffer);
+  glBufferData(GL_ARRAY_BUFFER, instances.size() * sizeof(EntityInstance),
+               instances.data(), GL_STREAM_DRAW);
+
+  glUseProgram(shader->shaderId);
+  prepare_shader(ui, shader);
+  glm::mat4 MVP = ui->projectionMatrix * ui->current_viewpoint.vp_matrix;
+  glUniformMatrix4fv(shader->shaderPgmMVPMatrixIndex, 1, GL_FALSE, &MVP[0][0]);
+  glUniform1i(shader->posedIndex, 1);
+  glBindTexture(GL_TEXTURE_2D, texture);
+  stats->ds_programs++;
+  stats->ds_textures++;
+  stats->ds_matrices++;
+
+  for (size_t i=0; i<pieces.size(); i++) {
+    InstancedPiece const& ip(pieces[i]);
+    glUniformMatrix4fv(shader->jointMatrixIndex, ENTITY_JOINTS, GL_FALSE,
+                       &ip.ip_matrix[0][0][0]);
+    glUniform4fv(shader->jointAxisIndex, ENTITY_JOINTS, &ip.ip_axis[0][0]);
+    glUniform4fv(shader->jointSelectIndex, 2*ENTITY_JOINTS, &ip.ip_select[0][0][0]);
+
+    // the instances are read through the piece's own vertex array
+    glBindVertexArray(ip.ip_mesh->vertexArray);
+    glBindBuffer(GL_ARRAY_BUFFER, ui->instanceBuffer);
+    glEnableVertexAttribArray(INSTANCE_LOCATION_ATTRIBUTE);
+    glVertexAttribPointer(INSTANCE_LOCATION_ATTRIBUTE, 3, GL_FLOAT, GL_FALSE,
+                          sizeof(EntityInstance),
+                          (void*)offsetof(EntityInstance, ei_location));
+    glVertexAttribDivisor(INSTANCE_LOCATION_ATTRIBUTE, 1);
+    for (int k=0; k<2; k++) {
+      glEnableVertexAttribArray(INSTANCE_ARGS_ATTRIBUTE + k);
+      glVertexAttribPointer(INSTANCE_ARGS_ATTRIBUTE + k, 4, GL_FLOAT, GL_FALSE,
+                            sizeof(EntityInstance),
+                            (void*)(offsetof(EntityInstance, ei_args) + 4*k*sizeof(float)));
+      glVertexAttribDivisor(INSTANCE_ARGS_ATTRIBUTE + k, 1);
+    }
+    stats->ds_vertex_arrays++;
+    glDrawElementsInstanced(GL_TRIANGLES, ip.ip_mesh->count*3, GL_UNSIGNED_INT, (void*)0,
+                            instances.size());
+    // the draw list draws the piece's mesh through this vertex array
+    // too, one at a time, so leave it as it was
+    glVertexAttribDivisor(INSTANCE_LOCATION_ATTRIBUTE, 0);
+    glDisableVertexAttribArray(INSTANCE_LOCATION_ATTRIBUTE);
+    for (int k=0; k<2; k++) {
+      glVertexAttribDivisor(INSTANCE_ARGS_ATTRIBUTE + k, 0);
+      glDisableVertexAttribArray(INSTANCE_ARGS_ATTRIBUTE + k);
+    }
+  }
+  stats->ds_items += pieces.size();
+  stats->ds_instances += instances.size();
+
+  // the draw list draws with this shader too, unposed
+  glUniform1i(shader->posedIndex, 0);
+  glBindVertexArray(0);
+}
+
 SuperMesh *internalize_model_mesh(wire::model::Mesh const& mesh,
                                   ShaderRef *shader,
                                   frect *bbox,
                                   glm::mat4 const& parentMatrix)
 {
-  MeshAccumulator *ma = new MeshAccumulator();
+  MeshAccumulator *ma = acquire_accumulator();
   wire::model::Vertices const& vertices = mesh.vertices();
 
   size_t n = vertices.x_size();
+  size_t ntri = 0;
+  for (int i=0; i<mesh.faces_size(); i++) {
+    if (mesh.faces(i).vertex_size() > 2) {
+      ntri += mesh.faces(i).vertex_size() - 2;
+    }
+  }
+  ma->reserve(n, ntri);
   bool has_norm = (vertices.nx_size() == (int)n);
   bool has_texture = (vertices.u_size() == (int)n);
   
@@ -928,11 +1132,11 @@ SuperMesh *internalize_model_mesh(wire::model::Mesh const& mesh,
   }
 
   //
-  Mesh *m = ma->make_triangular(shader);
+  Mesh *m = make_triangular(ma, shader);
   if (bbox) {
     *bbox = ma->bbox(parentMatrix * xform);
   }
-  delete ma;
+  release_accumulator(ma);
 
   SuperMesh *here;
 
@@ -1029,7 +1233,7 @@ struct Mesh *build_mesh(struct UserInterface *ui)
   s1.flags = 0;
   s1.type = 1;
 
-  MeshAccumulator *map = new MeshAccumulator();
+  MeshAccumulator *map = acquire_accumulator();
   MeshAccumulator& ma(*map);
 
   ma.setup(&s0);
@@ -1072,7 +1276,9 @@ struct Mesh *build_mesh(struct UserInterface *ui)
     }
   }
 
-  Mesh *m = ma.make_triangular(&ui->terrainShader);
+  ma.pack(Posn(0, 0));
+  Mesh *m = make_packed_terrain(map, ui->terrainBuffers, &ui->terrainShader, Posn(0, 0), 0);
+  release_accumulator(map);
   return m;
 }
 
@@ -1174,30 +1380,14 @@ void outline_hex_prism(struct UserInterface *ui,
   glEnable(GL_DEPTH_TEST);
 }
 
-void LineMesh::render(UserInterface *ui,
-                      glm::mat4 const& model)
+// a LineMesh has no vertex array of its own, so it sets up its
+// attribute here, in whichever is bound
+void LineMesh::draw(UserInterface *ui)
 {
-  glUseProgram(shader->shaderId);
   //glDisable(GL_DEPTH_TEST);
   glEnable(GL_POLYGON_OFFSET_LINE);
   glPolygonOffset(1, 1);
 
-  //============================================================
-
-  // Model matrix : an identity matrix (model will be at the origin)
-
-  // Our ModelViewProjection : multiplication of our 3 matrices
-  glm::mat4 MVP        = ui->projectionMatrix 
-    * ui->current_viewpoint.vp_matrix 
-    * model;
-
-  ShaderRef const& shader = ui->outlineShader;
-
-  // Send our transformation to the currently bound shader, in the
-  // "MVP" uniform For each model you render, since the MVP will be
-  // different (at least the M part)
-  glUniformMatrix4fv(shader.shaderPgmMVPMatrixIndex, 1, GL_FALSE, &MVP[0][0]);
-
   // First attribute buffer -- vertices
   glEnableVertexAttribArray(0);
   glBindBuffer(GL_ARRAY_BUFFER, vertexBuffer);
@@ -1215,77 +1405,152 @@ void LineMesh::render(UserInterface *ui,
   glDisable(GL_POLYGON_OFFSET_LINE);
 }
 
-void TriangularMesh::render(UserInterface *ui,
-                            glm::mat4 const& model)
+void TriangularMesh::draw(UserInterface *ui)
 {
-  glUseProgram(shader->shaderId);
+  glDrawElements(GL_TRIANGLES, count*3, GL_UNSIGNED_INT, (void*)0);
+}
 
-  // Our ModelViewProjection : multiplication of our 3 matrices
-  glm::mat4 MVP        = ui->projectionMatrix * ui->current_viewpoint.vp_matrix * model;
+void PackedTerrainMesh::draw(UserInterface *ui)
+{
+  glUniform3f(shader->regionOriginIndex, origin.x, origin.y, origin.z);
+  glDrawElements(GL_TRIANGLES, count*3, indexType, (void*)indexRange.br_offset);
+}
 
-  // configure the variable 'theTextureSampler' to use texture unit 0
-  glUniform1i(shader->shaderPgmTextureIndex, 0);
+/**
+ *   With multi-draw-indirect, the packed meshes whose vertices share a
+ *   page, and whose indices share a page (and type), are drawn with a
+ *   single glMultiDrawElementsIndirect().  Each draw's base vertex
+ *   finds its mesh's vertices in the page, and its base instance picks
+ *   its region's origin out of a buffer of them, which the shaders
+ *   read as the per-instance attribute drawOrigin.
+ */
+
+// one draw, as glMultiDrawElementsIndirect() reads it
+struct IndirectCommand {
+  GLuint        count;
+  GLuint        instanceCount;
+  GLuint        firstIndex;
+  GLint         baseVertex;
+  GLuint        baseInstance;
+};
 
-  // Send our transformation to the currently bound shader, in the
-  // "MVP" uniform For each model you render, since the MVP will be
-  // different (at least the M part)
-  glUniformMatrix4fv(shader->shaderPgmMVPMatrixIndex, 1, GL_FALSE, &MVP[0][0]);
+#define DRAW_ORIGIN_ATTRIBUTE   (5)
 
-  if (shader->waterWiggleIndex) {
-    float dx = 0.3 * cos(ui->frameTime * 1.0e-6) / TEXTURE_GRID_WIDTH;
-    float dy = 0.1 * sin(ui->frameTime * 1.0e-6) / TEXTURE_GRID_WIDTH;
-    glUniform2f(shader->waterWiggleIndex, dx, dy);
-  }
-  
-  if (shader->fogColorIndex) {
-    glUniform4f(shader->fogColorIndex, 
-                ui->skyColor.r,
-                ui->skyColor.g,
-                ui->skyColor.b, 
-                1);
-  }
-  if (shader->fogDensityIndex) {
-    glUniform1f(shader->fogDensityIndex, 0.007);
+struct TerrainMultiDraw {
+  GLuint                        tmd_vertex_array;
+  GLuint                        tmd_commands;   // buffers of the IndirectCommands
+  GLuint                        tmd_origins;    // and the origins they pick out
+  std::vector<PackedTerrainMesh*> tmd_meshes;   // to be drawn
+  std::vector<IndirectCommand>  tmd_command_data;
+  std::vector<glm::vec3>        tmd_origin_data;
+};
+
+TerrainMultiDraw *create_terrain_multidraw(void)
+{
+  // base instances are what let each draw have its own origin
+  if (!SDL_GL_ExtensionSupported("GL_ARB_multi_draw_indirect")
+      || !SDL_GL_ExtensionSupported("GL_ARB_base_instance")) {
+    printf("terrain is drawn a mesh at a time\n");
+    return NULL;
   }
+  TerrainMultiDraw *tmd = new TerrainMultiDraw();
+  GLuint ids[2];
+  glGenBuffers(2, ids);
+  tmd->tmd_commands = ids[0];
+  tmd->tmd_origins = ids[1];
+  glGenVertexArrays(1, &tmd->tmd_vertex_array);
+  glBindVertexArray(tmd->tmd_vertex_array);
+  glBindBuffer(GL_ARRAY_BUFFER, tmd->tmd_origins);
+  glEnableVertexAttribArray(DRAW_ORIGIN_ATTRIBUTE);
+  glVertexAttribPointer(DRAW_ORIGIN_ATTRIBUTE, 3, GL_FLOAT, GL_FALSE, 0, (void*)0);
+  glVertexAttribDivisor(DRAW_ORIGIN_ATTRIBUTE, 1);
+  glBindVertexArray(0);
+  printf("terrain is drawn with multi-draw-indirect\n");
+  return tmd;
+}
 
+void terrain_multidraw_add(TerrainMultiDraw *tmd, Mesh *m)
+{
+  // all the meshes of a TerrainSection are packed
+  tmd->tmd_meshes.push_back(static_cast<PackedTerrainMesh*>(m));
+}
 
-  // First attribute buffer -- vertices
-  glEnableVertexAttribArray(0);
-  glBindBuffer(GL_ARRAY_BUFFER, vertexBuffer);
-  glVertexAttribPointer(0,              // attribute 0
-                        3,              // size  len([x,y,z])
-                        GL_FLOAT,       // type
-                        GL_FALSE,       // normalized?
-                        0,              // stride
-                        (void*)0);      // array buffer offset;
+// the order the meshes are drawn in, which puts those that can be
+// drawn together next to each other
+static bool multidraw_order(PackedTerrainMesh const *a, PackedTerrainMesh const *b)
+{
+  if (a->vertexBuffer != b->vertexBuffer) {
+    return a->vertexBuffer < b->vertexBuffer;
+  }
+  if (a->indexBufferId != b->indexBufferId) {
+    return a->indexBufferId < b->indexBufferId;
+  }
+  return a->indexType < b->indexType;
+}
 
+void terrain_multidraw_submit(UserInterface *ui, TerrainMultiDraw *tmd,
+                              ShaderRef *shader, GLuint texture, DrawStats *stats)
+{
+  std::vector<PackedTerrainMesh*>& meshes(tmd->tmd_meshes);
+  size_t n = meshes.size();
+  if (n == 0) {
+    return;
+  }
+  std::sort(meshes.begin(), meshes.end(), multidraw_order);
+  tmd->tmd_command_data.resize(n);
+  tmd->tmd_origin_data.resize(n);
+  for (size_t i=0; i<n; i++) {
+    PackedTerrainMesh *m = meshes[i];
+    IndirectCommand *c = &tmd->tmd_command_data[i];
+    c->count = 3 * m->count;
+    c->instanceCount = 1;
+    c->firstIndex = m->indexRange.br_offset / index_size(m->indexType);
+    c->baseVertex = m->vertexOffset / sizeof(PackedVertex);
+    c->baseInstance = i;
+    tmd->tmd_origin_data[i] = m->origin;
+  }
 
-  // 2nd attribute -- texture UV coordinates
-  glEnableVertexAttribArray(1);
-  glBindBuffer(GL_ARRAY_BUFFER, uvBufferId);
-  glVertexAttribPointer(1,              // attribute 1
-                        2,              // size  len([U,V])
-                        GL_FLOAT,       // type
-                        GL_FALSE,       // normalized?
-                        0,              // stride
-                        (void*)0);      // array buffer offset;
+  glBindVertexArray(tmd->tmd_vertex_array);
+  glBindBuffer(GL_DRAW_INDIRECT_BUFFER, tmd->tmd_commands);
+  glBufferData(GL_DRAW_INDIRECT_BUFFER, n * sizeof(IndirectCommand),
+               tmd->tmd_command_data.data(), GL_STREAM_DRAW);
+  glBindBuffer(GL_ARRAY_BUFFER, tmd->tmd_origins);
+  glBufferData(GL_ARRAY_BUFFER, n * sizeof(glm::vec3),
+               tmd->tmd_origin_data.data(), GL_STREAM_DRAW);
 
-  // 3rd attribute -- surface ambient lighting value
-  glEnableVertexAttribArray(2);
-  glBindBuffer(GL_ARRAY_BUFFER, ambientBufferId);
-  glVertexAttribPointer(2,              // attribute 2
-                        1,              // size  len([A])
-                        GL_FLOAT,       // type
-                        GL_FALSE,       // normalized?
-                        0,              // stride
-                        (void*)0);      // array buffer offset;
+  glUseProgram(shader->shaderId);
+  prepare_shader(ui, shader);
+  glm::mat4 MVP = ui->projectionMatrix * ui->current_viewpoint.vp_matrix;
+  glUniformMatrix4fv(shader->shaderPgmMVPMatrixIndex, 1, GL_FALSE, &MVP[0][0]);
+  glUniform3f(shader->regionOriginIndex, 0, 0, 0);
+  glBindTexture(GL_TEXTURE_2D, texture);
+  stats->ds_programs++;
+  stats->ds_textures++;
+  stats->ds_vertex_arrays++;
+  stats->ds_matrices++;
+
+  size_t first = 0;
+  while (first < n) {
+    PackedTerrainMesh *m = meshes[first];
+    size_t end = first + 1;
+    while ((end < n) && !multidraw_order(m, meshes[end])) {
+      end++;
+    }
+    // the pages can come and go, so they're bound anew each time
+    glBindBuffer(GL_ARRAY_BUFFER, m->vertexBuffer);
+    packed_attributes(0);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, m->indexBufferId);
+    glMultiDrawElementsIndirect(GL_TRIANGLES, m->indexType,
+                                (void*)(first * sizeof(IndirectCommand)),
+                                end - first, 0);
+    stats->ds_multidraws++;
+    first = end;
+  }
+  stats->ds_items += n;
 
-  // Draw the mesh
-  glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, indexBufferId);
-  glDrawElements(GL_TRIANGLES, count*3, GL_UNSIGNED_INT, (void*)0);
-  glDisableVertexAttribArray(0);
-  glDisableVertexAttribArray(1);
-  glDisableVertexAttribArray(2);
+  glBindVertexArray(0);
+  glBindBuffer(GL_DRAW_INDIRECT_BUFFER, 0);
+  meshes.clear();
 }
 
 
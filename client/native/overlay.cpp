@@ -29,6 +29,19 @@ OverlayImage::OverlayImage(Picture *src)
   flush();
 }
 
+OverlayImage::~OverlayImage()
+{
+  glDeleteTextures(1, &textureId);
+  free(pixelBuffer);
+}
+
+void OverlayImage::fill(uint32_t color)
+{
+  for (unsigned i=0; i<width*height; i++) {
+    pixelBuffer[i] = color;
+  }
+}
+
 void OverlayImage::flush()
 {
   printf("flush overlay texture %u\n", textureId);
@@ -25,12 +25,14 @@ struct OverlayImage {
   
   OverlayImage(unsigned w, unsigned h);
   OverlayImage(Picture *src);
+  ~OverlayImage();
 
   /*
    *  Make local changes to the image
    */
   void paint(Picture const& src, int x=0, int y=0);
   void write(Font const& font, std::string const& text, int x, int y);
+  void fill(uint32_t color);
   /*
    *  Flush changes back to OpenGL
    */
@@ -5,6 +5,11 @@ attribute vec2 vertexUV;
 attribute float vertexAmbient;
 // WIP in vec3 vertexNormal;
 
+// when posed, each instance is an entity (see EntityInstance in ui.h)
+attribute vec3 instanceLocation;
+attribute vec4 instanceArgs0;
+attribute vec4 instanceArgs1;
+
 // we are just sending along the color info to the fragment
 // shader; our cardinality is vertices, so to cover the gap
 // from vertices to fragments it gets interpolated (automatically?)
@@ -16,6 +21,15 @@ varying float fragmentAmbient;
 // constant for the entire mesh
 uniform mat4 MVP;
 
+// when posed, MVP is just the view and projection, and the piece is
+// moved into place by the joints from the root of its SuperMesh down
+// (see InstancedPiece in ui.h); otherwise MVP does it all
+#define ENTITY_JOINTS   4
+uniform bool posed;
+uniform mat4 jointMatrix[ENTITY_JOINTS];
+uniform vec4 jointAxis[ENTITY_JOINTS];          // w is the kind of joint
+uniform vec4 jointSelect[2*ENTITY_JOINTS];      // which arg moves it
+
 // WIP...
 /*
 uniform vec4 LightPosition;
@@ -26,10 +40,41 @@ uniform mat4 NormalMatrix;
 uniform mat4 ProjectionMatrix;
 */
 
+// as SingleAxisRotationMesh and SingleAxisTranslationMesh do it
+mat4 joint(int i) {
+  vec4 a = jointAxis[i];
+  float arg = dot(instanceArgs0, jointSelect[2*i]) + dot(instanceArgs1, jointSelect[2*i+1]);
+  if (a.w > 1.5) {
+    mat4 t = mat4(1.0);
+    t[3] = vec4(arg * a.xyz, 1);
+    return jointMatrix[i] * t;
+  } else if (a.w > 0.5) {
+    // glm::rotate(), which takes degrees
+    float c = cos(radians(arg));
+    float s = sin(radians(arg));
+    vec3 n = normalize(a.xyz);
+    vec3 k = (1.0 - c) * n;
+    mat4 r = mat4(c + k.x * n.x, k.x * n.y + s * n.z, k.x * n.z - s * n.y, 0,
+                  k.y * n.x - s * n.z, c + k.y * n.y, k.y * n.z + s * n.x, 0,
+                  k.z * n.x + s * n.y, k.z * n.y - s * n.x, c + k.z * n.z, 0,
+                  0, 0, 0, 1);
+    return jointMatrix[i] * r;
+  }
+  return jointMatrix[i];
+}
+
 void main(void) {
   //vec3 tnorm = normalize(NormalMatrix * VertexNormal);
   
   vec4 v = vec4(vertexPosition_modelspace, 1);  // make it homogenous
+  if (posed) {
+    mat4 pose = mat4(1.0);
+    pose[3] = vec4(instanceLocation, 1);
+    for (int i=0; i<ENTITY_JOINTS; i++) {
+      pose = pose * joint(i);
+    }
+    v = pose * v;
+  }
   gl_Position = MVP * v;
   fragmentUV = vertexUV;
   fragmentAmbient = vertexAmbient;
@@ -3,17 +3,31 @@
 //in vec4 fragmentColor;
 varying vec3 worldPosn;
 varying vec2 fragmentUV;
+varying vec2 fragmentTile;
 varying float fragmentAmbient;
 varying float fragmentFog;
 
 uniform sampler2D theTextureSampler;
 uniform vec4 fogColor;
 
+// look up a texel of a tile, repeating it; where the coordinates
+// wrap around the derivatives jump, which would drop the lookup down
+// to the smallest mipmap, so bias it back to the level of the
+// unwrapped coordinates
+vec4 tileTexel(vec2 uv) {
+  vec2 st = fragmentTile + fract(uv) / 16.0;
+  vec2 dx = dFdx(uv), dy = dFdy(uv);
+  vec2 sx = dFdx(st) * 16.0, sy = dFdy(st) * 16.0;
+  float want = max(dot(dx, dx), dot(dy, dy)) + 1.0e-12;
+  float got = max(dot(sx, sx), dot(sy, sy)) + 1.0e-12;
+  return texture2D(theTextureSampler, st, 0.5 * log2(want / got));
+}
+
 void main(void) {
   //gl_FragColor = vec4(worldPosn.x, worldPosn.y, 0.2, 1);
   //gl_FragColor = fragmentColor;
   gl_FragColor = mix( fogColor, //vec4(1,1,1,1),
-                      texture2D(theTextureSampler, fragmentUV) * fragmentAmbient,
+                      tileTexel(fragmentUV) * fragmentAmbient,
                       fragmentFog );
   
   if (gl_FragColor.a < 0.5) {
@@ -1,32 +1,58 @@
 #version 120            // --*-c-*--
 
+// the packed terrain format (see PackedVertex in mesh.cpp); the
+// position is in grid units relative to the region's origin
 attribute vec3 vertexPosition_modelspace;
 attribute vec2 vertexUV;
 attribute float vertexAmbient;
+attribute float vertexNormalIndex;
+attribute float vertexTile;
+// the region's origin, when drawn along with others (see
+// TerrainMultiDraw in mesh.cpp); otherwise it's left zero and
+// regionOrigin is used
+attribute vec3 drawOrigin;
 
 // we are just sending along the color info to the fragment
 // shader; our cardinality is vertices, so to cover the gap
 // from vertices to fragments it gets interpolated (automatically?)
 //out vec4 fragmentColor; 
 
-varying vec2 fragmentUV;
+varying vec2 fragmentUV;         // within the tile; repeats past 1
+varying vec2 fragmentTile;       // where the tile is in the texture
 varying float fragmentAmbient;
 varying float fragmentFog;
 varying vec3 worldPosn;
+varying vec3 worldNormal;
 
 // constant for the entire mesh
 uniform mat4 MVP;
 uniform float fogDensity;
+uniform vec3 regionOrigin;
+uniform vec3 packScale;
+
+// 0-5 are the sides of the hex (face 0 facing 240 degrees, and so on
+// around by 60); 6 is the top and 7 the bottom
+vec3 hexNormal(float i) {
+  if (i > 6.5) {
+    return vec3(0, 0, -1);
+  } else if (i > 5.5) {
+    return vec3(0, 0, 1);
+  }
+  float t = radians(240.0 + 60.0 * i);
+  return vec3(cos(t), sin(t), 0);
+}
 
 void main(void) {
 
   //const float fogDensity = fogDensity;
   const float LOG2 = 1.442695;
   
-  vec4 v = vec4(vertexPosition_modelspace, 1);  // make it homogenous
-  worldPosn = vertexPosition_modelspace;
+  worldPosn = vertexPosition_modelspace * packScale + regionOrigin + drawOrigin;
+  worldNormal = hexNormal(vertexNormalIndex);
+  vec4 v = vec4(worldPosn, 1);  // make it homogenous
   gl_Position = MVP * v;
-  fragmentUV = vertexUV;
+  fragmentUV = vertexUV / 1024.0;        // PACK_UV_UNIT
+  fragmentTile = vec2(mod(vertexTile, 16.0), floor(vertexTile / 16.0)) / 16.0;
   fragmentAmbient = vertexAmbient;
   
   float atten = 1.0 / (1.0 + 0.001 * dot(gl_Position, gl_Position));
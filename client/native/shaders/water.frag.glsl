@@ -2,6 +2,7 @@
 
 varying vec3 worldPosn;
 varying vec2 fragmentUV;
+varying vec2 fragmentTile;
 varying float fragmentAmbient;
 varying float fragmentFog;
 
@@ -9,8 +10,19 @@ uniform sampler2D theTextureSampler;
 uniform vec4 fogColor;
 uniform vec2 waterWiggle;
 
+// as in terrain.frag.glsl
+vec4 tileTexel(vec2 uv) {
+  vec2 st = fragmentTile + fract(uv) / 16.0;
+  vec2 dx = dFdx(uv), dy = dFdy(uv);
+  vec2 sx = dFdx(st) * 16.0, sy = dFdy(st) * 16.0;
+  float want = max(dot(dx, dx), dot(dy, dy)) + 1.0e-12;
+  float got = max(dot(sx, sx), dot(sy, sy)) + 1.0e-12;
+  return texture2D(theTextureSampler, st, 0.5 * log2(want / got));
+}
+
 void main(void) {
+  // the wiggle is in texture coordinates, and uv in tiles
   gl_FragColor = mix( fogColor, //vec4(1,1,1,1),
-                      texture2D(theTextureSampler, fragmentUV + waterWiggle) * fragmentAmbient,
+                      tileTexel(fragmentUV + waterWiggle * 16.0) * fragmentAmbient,
                       fragmentFog );
 }
@@ -12,6 +12,8 @@
 #include <hexcom/pick.h>
 #include <hexcom/curve.h>
 #include <hexcom/picture.h>
+#include <hexcom/terrainmesh.h>
+#include <hexcom/occlusion.h>
 
 #include "connection.h"
 #include "world.h"
@@ -21,6 +23,8 @@
 #include "skymap.h"
 #include "clientoptions.h"
 #include "overlay.h"
+#include "bufferpool.h"
+#include "drawlist.h"
 
 struct UserInterface;
 
@@ -35,6 +39,12 @@ struct ShaderRef {
   GLuint waterWiggleIndex;
   GLuint sunPositionIndex;
   GLuint starMatrixIndex;
+  GLuint regionOriginIndex;     // for the packed terrain format
+  GLuint packScaleIndex;
+  GLuint posedIndex;            // for drawing entities with instancing
+  GLuint jointMatrixIndex;
+  GLuint jointAxisIndex;
+  GLuint jointSelectIndex;
 };
 
 struct OverlayWindow {
@@ -53,11 +63,14 @@ struct Mesh {
   GLuint uvBufferId;
   GLuint indexBufferId;
   GLuint ambientBufferId;
+  GLuint vertexArray;   // its attribute setup, made along with it
   unsigned count;       // number of *triangles*
   unsigned textureUnit; // which texture unit to use
+  Mesh() : vertexArray(0) { }
   virtual ~Mesh();
-  virtual void render(UserInterface *ui,
-                      glm::mat4 const& model) = 0;
+  // issue the draw call, with the shader (and its MVP), texture and
+  // vertexArray already bound by draw_list_submit()
+  virtual void draw(UserInterface *ui) = 0;
 };
 
 struct SuperMesh {
@@ -73,16 +86,50 @@ struct SuperMesh {
     : has_ref(false) {
   }
     
-  virtual float *render(UserInterface *ui,
-                        glm::mat4 const& model,
-                        float *args) = 0;
+  // put the pieces in a draw list, posed by args
+  virtual float *enqueue(DrawList *dl, GLuint texture,
+                         glm::mat4 const& model,
+                         float *args) = 0;
 protected:
-  float *_render(UserInterface *ui, glm::mat4 const& model, float *args);
+  float *_enqueue(DrawList *dl, GLuint texture, glm::mat4 const& model, float *args);
 };
 
 struct Entity;
+struct EntityHandler;
+struct SimpleEntityHandler;
 
 typedef std::unordered_map<unsigned, Entity*> EntityMap;
+typedef std::unordered_map<std::string,EntityHandler*> EntityHandlerMap;
+
+/**
+ *   All the entities of a type can be drawn at once, with a draw call
+ *   for each piece of their SuperMesh that draws the piece for every
+ *   one of them.  An entity is an EntityInstance: where it is, and the
+ *   args that pose its joints (in the order SuperMesh::enqueue() takes
+ *   them).  Each piece is an InstancedPiece, which has what the robot
+ *   shader needs to pose it: the matrix of each SuperMesh from the
+ *   root down to the piece's, and which arg moves the joint there.
+ */
+
+#define ENTITY_ARGS             (8)
+#define ENTITY_JOINTS           (4)     // the deepest piece that can be posed
+
+#define JOINT_NONE              (0)
+#define JOINT_ROTATE            (1)     // by the arg, in degrees, about the axis
+#define JOINT_TRANSLATE         (2)     // by the arg times the axis
+
+struct EntityInstance {
+  float                 ei_location[3];
+  float                 ei_args[ENTITY_ARGS];
+};
+
+struct InstancedPiece {
+  Mesh                 *ip_mesh;
+  unsigned              ip_joints;
+  glm::mat4             ip_matrix[ENTITY_JOINTS];
+  glm::vec4             ip_axis[ENTITY_JOINTS];         // w is the JOINT_ kind
+  glm::vec4             ip_select[ENTITY_JOINTS][2];    // 1 for the joint's arg
+};
 
 
 struct InputBox {
@@ -100,11 +147,25 @@ struct ViewPoint {
   glm::mat4             vp_matrix;  // resulting view matrix
 };
 
+// the bit in TerrainSection::ts_neighbors for the region (dx,dy) away
+#define TS_NEIGHBOR_BIT(dx,dy)  (1U << (((dy)+1)*3 + ((dx)+1)))
+
+struct MeshWorkers;
+struct TerrainMultiDraw;
+
 struct TerrainSection {
   Posn                  ts_posn;
-  Mesh                 *ts_ground;
+  unsigned              ts_neighbors;   // regions next door when meshed
+  unsigned              ts_serial;      // of the mesh job that built it
+  Mesh                 *ts_ground;      // NULL if only meshed coarsely
   Mesh                 *ts_water;
+  Mesh                 *ts_coarse[TS_COARSE_LEVELS];    // 2x2 and 4x4 columns a cell
+  unsigned              ts_coarse_serial;
+  frect                 ts_bbox;        // of the region, for culling
+  frect                 ts_occluders[REGION_OCCLUDERS]; // solid ground under it
+  int                   ts_num_occluders;
   void releaseContents();
+  void releaseDetail();         // keeping the coarse meshes
 };
 
 /***
@@ -119,6 +180,7 @@ struct UserInterface {
 
   EntityMap     entities;
   EntityTypeMap etypes;
+  EntityHandlerMap entityHandlers;      // one for each type and subtype
   float mouseScale;
   float walkSpeed;
   Span spanOnTopOf;             // the span we are above
@@ -132,6 +194,7 @@ struct UserInterface {
   int toolHeight;
   int placeToolType;
   glm::vec3 skyColor;
+  float fogDensity;
   SkyView       skyView;
 
   SDL_Window *window;
@@ -181,6 +244,19 @@ struct UserInterface {
   Mesh *outlineMesh;
 
   ViewPoint current_viewpoint;
+  Frustum frustum;              // of current_viewpoint, this frame
+  OcclusionBuffer *occlusion;   // the nearby ground, this frame
+  bool occlusionCulling;        // use it (see the "occlusion" command)
+  struct {
+    unsigned sections_drawn, sections_culled, sections_occluded;
+    unsigned entities_drawn, entities_culled;
+  } cullStats;                  // in the last frame drawn
+  DrawList      drawList;       // the terrain and entities, as they're visited
+  // the entity handlers with instances to draw, as they're visited;
+  // emptied when they're drawn, right after the draw list
+  std::vector<SimpleEntityHandler*> instancedHandlers;
+  DrawStats     drawStats;      // in the last frame drawn
+  OverlayImage *statsOverlay;   // NULL unless showing the "stats"
   struct {
     Curve      *anim;
     long        start_time;
@@ -192,6 +268,12 @@ struct UserInterface {
 
   Connection *cnx;
   ClientWorld *world;
+  MeshWorkers *meshWorkers;
+  TerrainBuffers *terrainBuffers;       // where the terrain meshes live
+  TerrainMultiDraw *terrainMultiDraw;   // NULL if the context can't
+  bool          multiDraw;              // use it (see the "multidraw" command)
+  GLuint        instanceBuffer;         // 0 if the context can't instance
+  bool          instancing;             // use it (see the "instancing" command)
 
   struct {
     bool enable;
@@ -215,8 +297,52 @@ struct UserInterface {
 
 struct Mesh *build_mesh(struct UserInterface *ui);
 struct Mesh *build_cursor_mesh(struct UserInterface *ui);
-TerrainSection build_section_from_region(UserInterface *ui,
-                                         ClientRegion *rgn);
+
+/**
+ *  Regions are meshed in the background: queue_region_mesh() takes a
+ *  copy of the region (and the edges of its neighbors) for a worker
+ *  thread to mesh, and collect_region_meshes(), called once a frame,
+ *  uploads the finished meshes and passes each one still wanted to
+ *  install(), or patches it into the mesh it is part of (see
+ *  queue_chunk_mesh()).  Returns the number installed or patched
+ */
+MeshWorkers *start_mesh_workers(void);
+void stop_mesh_workers(MeshWorkers *mw);
+void queue_region_mesh(UserInterface *ui, ClientRegion *rgn);
+// just the coarse meshes, for a region too far away to draw in detail
+void queue_coarse_mesh(UserInterface *ui, ClientRegion *rgn);
+/**
+ *  Re-mesh just some chunks of a region (a mask of TS_CHUNK_BITs),
+ *  patching them into its mesh in place; if it has no mesh, or one is
+ *  already on the way, the whole region is queued instead
+ */
+void queue_chunk_mesh(UserInterface *ui, ClientRegion *rgn, unsigned chunks);
+int collect_region_meshes(UserInterface *ui,
+                          void (*install)(UserInterface *ui,
+                                          ClientRegion *rgn,
+                                          TerrainSection const& s));
+// if set, log every region built, not just the slow ones
+extern bool mesh_build_verbose;
+
+/**
+ *  Where the context has multi-draw-indirect (GL 4.3, or the ARB
+ *  extensions), the terrain meshes can be drawn a few calls a frame
+ *  rather than one apiece; create_terrain_multidraw() returns NULL if
+ *  it doesn't, and they go through the DrawList instead.  Add the
+ *  meshes of TerrainSections to draw, and then submit them with the
+ *  shader and texture they all use
+ */
+TerrainMultiDraw *create_terrain_multidraw(void);
+void terrain_multidraw_add(TerrainMultiDraw *tmd, Mesh *m);
+void terrain_multidraw_submit(UserInterface *ui, TerrainMultiDraw *tmd,
+                              ShaderRef *shader, GLuint texture, DrawStats *stats);
+
+// false if the SuperMesh is too deep, or takes too many args
+bool instanced_pieces(SuperMesh *sm, std::vector<InstancedPiece> *pieces);
+void draw_instanced(UserInterface *ui, ShaderRef *shader, GLuint texture,
+                    std::vector<InstancedPiece> const& pieces,
+                    std::vector<EntityInstance> const& instances,
+                    DrawStats *stats);
 
 void draw_mesh(struct UserInterface *ui, 
                ShaderRef const& shader, 
@@ -1,4 +1,7 @@
 #include <SDL.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
 #include "world.h"
 #include "connection.h"
 #include "wire/terrain.pb.h"
@@ -22,6 +25,8 @@ ClientWorld *create_client_world(ClientOptions const& opt)
 {
   ClientWorld *w = new ClientWorld();
   w->username = opt.username;
+  w->coldDistance = COLD_REGION_DISTANCE;
+  w->regionBudget = (size_t)opt.region_budget_mb << 20;
   return w;
 }
 
@@ -92,6 +97,26 @@ SpanInfo ClientWorld::getSpanAdjacent(SpanInfo from, float dir)
   return getSpan(si);
 }
 
+/**
+ *  Find the topmost solid span below the k'th one in a column, where
+ *  z is the bottom of the k'th span.  If there is none, si comes back
+ *  as it was.
+ */
+static SpanInfo topmost_solid_below(SpanColumn const& col, int k, int z,
+                                    SpanInfo si)
+{
+  while (k > 0) {
+    k--;
+    z -= col[k].height;
+    if (col[k].type != 0) {
+      si.span = &col[k];
+      si.z = z;
+      break;
+    }
+  }
+  return si;
+}
+
 SpanInfo ClientWorld::getSpan(SpanInfo si)
 {
   // now find the *top* of that column, starting at the current
@@ -100,42 +125,33 @@ SpanInfo ClientWorld::getSpan(SpanInfo si)
   Posn p(si.x & ~(REGION_SIZE-1),
          si.y & ~(REGION_SIZE-1));
 
-  regionCacheType::iterator i = state.regionCache.find(p);
-  if (i == state.regionCache.end()) {
+  ClientRegion *rgn = lookupRegion(p);
+  if (!rgn) {
     printf("  no region cached for %d,%d\n", p.x, p.y);
     return si;
   }
-  ClientRegion *rgn = i->second;
   si.region = rgn;
 
   int dy = si.y - p.y;
   int dx = si.x - p.x;
   assert((dx >= 0) && (dx < REGION_SIZE));
   assert((dy >= 0) && (dy < REGION_SIZE));
-  std::vector<Span>& col = rgn->columns[dy][dx];
-  int iz = si.z - rgn->basement;
-  int atz = rgn->basement;
-
-  bool nextnonspace = false;
-  for (std::vector<Span>::iterator s=col.begin(); s<col.end(); ++s) {
-    if (iz <= 0) {
-      if (s->type == 0) {
-        return si;
-      }
-      nextnonspace = true;
-    }
-    int h = s->height;
-    if (s->type != 0) {
-      si.span = &(*s);
-      si.z = atz;
-      if (nextnonspace) {
-        return si;
-      }
-    }
-    iz -= h;
-    atz += h;
+  SpanColumn col(rgn->column(dx, dy));
+
+  // find the first span starting at or above our z; if it's solid,
+  // that's the one, otherwise it's the topmost solid one below it
+  int atz;
+  int k = spanAtZ(rgn, dx, dy, si.z, &atz);
+  if ((k < (int)col.size()) && (atz < si.z)) {
+    atz += col[k].height;
+    k++;
   }
-  return si;
+  if ((k < (int)col.size()) && (col[k].type != 0)) {
+    si.span = &col[k];
+    si.z = atz;
+    return si;
+  }
+  return topmost_solid_below(col, k, atz, si);
 }
 
 SpanInfo ClientWorld::getSpanBelow(glm::vec3 const& loc)
@@ -156,49 +172,136 @@ SpanInfo ClientWorld::getSpanBelow(glm::vec3 const& loc)
   si.y = iy;
   si.z = iz;
 
-  regionCacheType::iterator i = state.regionCache.find(p);
-  if (i == state.regionCache.end()) {
+  ClientRegion *rgn = lookupRegion(p);
+  if (!rgn) {
     printf("  no region cached for %d,%d\n", p.x, p.y);
     return si;
   }
-  ClientRegion *rgn = i->second;
   assert((dx >= 0) && (dx < REGION_SIZE));
   assert((dy >= 0) && (dy < REGION_SIZE));
 
-  std::vector<Span>& col = rgn->columns[dy][dx];
-  iz -= rgn->basement;
-  int atz = rgn->basement;
+  SpanColumn col(rgn->column(dx, dy));
   si.region = rgn;
 
-  for (std::vector<Span>::iterator s=col.begin(); s<col.end(); ++s) {
-    if (iz <= 0) {
-      return si;
-    }
-    int h = s->height;
-    if (s->type != 0) {
-      si.span = &(*s);
-      si.z = atz;
-    }
-    iz -= h;
-    atz += h;
+  // the span we want is the topmost solid one starting below iz
+  int atz;
+  int k = spanAtZ(rgn, dx, dy, iz, &atz);
+  if ((k < (int)col.size()) && (atz < iz)) {
+    atz += col[k].height;
+    k++;
   }
-  return si;
+  return topmost_solid_below(col, k, atz, si);
 }
 
-SpanVector *ClientWorld::getColumn(int ix, int iy, ClientRegion **p)
+SpanColumn ClientWorld::getColumn(int ix, int iy, ClientRegion **p)
 {
   Posn posn(ix & ~(REGION_SIZE-1),
             iy & ~(REGION_SIZE-1));
 
   int dy = iy - posn.y;
   int dx = ix - posn.x;
-  regionCacheType::iterator i = state.regionCache.find(posn);
+  *p = lookupRegion(posn);
+  if (!*p) {
+    return SpanColumn();
+  }
+  return (*p)->column(dx, dy);
+}
 
+ClientRegion *ClientWorld::lookupRegion(Posn const& p)
+{
+  ClientRegion *rgn;
+  if (state.window.get(p, &rgn)) {
+    if (!rgn) {
+      state.stats.rcs_misses++;
+      return NULL;
+    }
+    state.stats.rcs_hits++;
+    touchRegion(rgn);
+    return rgn;
+  }
+  regionCacheType::iterator i = state.regionCache.find(p);
   if (i == state.regionCache.end()) {
+    state.stats.rcs_misses++;
     return NULL;
   }
-  *p = i->second;
-  return &i->second->columns[dy][dx];
+  state.stats.rcs_hits++;
+  touchRegion(i->second);
+  return i->second;
+}
+
+ClientRegion *ClientWorld::findRegion(Posn const& p)
+{
+  ClientRegion *rgn;
+  if (state.window.get(p, &rgn)) {
+    return rgn;
+  }
+  regionCacheType::iterator i = state.regionCache.find(p);
+  return (i == state.regionCache.end()) ? NULL : i->second;
+}
+
+void ClientWorld::insertRegion(ClientRegion *rgn)
+{
+  touchRegion(rgn);
+  state.regionCache.insert(regionCacheType::value_type(rgn->origin, rgn));
+  state.window.put(rgn);
+}
+
+regionCacheType::iterator ClientWorld::removeRegion(regionCacheType::iterator i)
+{
+  state.window.drop(i->second);
+  return state.regionCache.erase(i);
+}
+
+// (centered on the region at the origin, where we have nothing yet)
+RegionWindow::RegionWindow()
+  : rw_x0(-REGION_WINDOW/2),
+    rw_y0(-REGION_WINDOW/2)
+{
+  memset(rw_slot, 0, sizeof(rw_slot));
+}
+
+void RegionWindow::put(ClientRegion *rgn)
+{
+  int rx = rgn->origin.x >> REGION_SIZE_BITS;
+  int ry = rgn->origin.y >> REGION_SIZE_BITS;
+  if (((unsigned)(rx - rw_x0) < REGION_WINDOW) && ((unsigned)(ry - rw_y0) < REGION_WINDOW)) {
+    rw_slot[ry & (REGION_WINDOW-1)][rx & (REGION_WINDOW-1)] = rgn;
+  }
+}
+
+void RegionWindow::drop(ClientRegion *rgn)
+{
+  int rx = rgn->origin.x >> REGION_SIZE_BITS;
+  int ry = rgn->origin.y >> REGION_SIZE_BITS;
+  if (((unsigned)(rx - rw_x0) < REGION_WINDOW) && ((unsigned)(ry - rw_y0) < REGION_WINDOW)) {
+    ClientRegion *&slot(rw_slot[ry & (REGION_WINDOW-1)][rx & (REGION_WINDOW-1)]);
+    if (slot == rgn) {
+      slot = NULL;
+    }
+  }
+}
+
+void RegionWindow::recenter(Posn const& p, regionCacheType& cache)
+{
+  int x0 = (p.x >> REGION_SIZE_BITS) - REGION_WINDOW/2;
+  int y0 = (p.y >> REGION_SIZE_BITS) - REGION_WINDOW/2;
+  int old_x0 = rw_x0;
+  int old_y0 = rw_y0;
+  rw_x0 = x0;
+  rw_y0 = y0;
+  // the slots of regions that were in the old window as well still
+  // hold them; the rest are refilled from the cache
+  for (int ry=y0; ry<y0+REGION_WINDOW; ry++) {
+    bool kept_row = ((unsigned)(ry - old_y0) < REGION_WINDOW);
+    for (int rx=x0; rx<x0+REGION_WINDOW; rx++) {
+      if (kept_row && ((unsigned)(rx - old_x0) < REGION_WINDOW)) {
+        continue;
+      }
+      regionCacheType::iterator i = cache.find(Posn(rx * REGION_SIZE, ry * REGION_SIZE));
+      rw_slot[ry & (REGION_WINDOW-1)][rx & (REGION_WINDOW-1)]
+        = (i == cache.end()) ? NULL : i->second;
+    }
+  }
 }
 
 
@@ -213,3 +316,174 @@ void ClientWorld::requestRegionIfNotPresent(Connection *cnx, Posn const& p)
   cnx->request_view(p.x, p.y);
   pendingRequests.insert(std::unordered_map<Posn, bool, Posn::hash, Posn::cmp>::value_type(p,true));
 }
+
+void ClientWorld::freezeDistantRegions(Posn const& center,
+                                       std::vector<Posn> *frozen)
+{
+  regionCacheType::iterator i = state.regionCache.begin();
+  while (i != state.regionCache.end()) {
+    ClientRegion *rgn = i->second;
+    int dx = abs(rgn->origin.x - center.x) >> REGION_SIZE_BITS;
+    int dy = abs(rgn->origin.y - center.y) >> REGION_SIZE_BITS;
+    if ((dx <= coldDistance) && (dy <= coldDistance)) {
+      ++i;
+      continue;
+    }
+    dropColdRegion(rgn->origin);
+    ColdRegion *cold = new ColdRegion();
+    cold->cr_last_use = rgn->lastUse;
+    cold->cr_basement = rgn->basement;
+    encodeSpanArray(rgn, &cold->cr_spans);
+    state.coldCache.insert(coldRegionCacheType::value_type(rgn->origin, cold));
+
+    frozen->push_back(rgn->origin);
+    i = removeRegion(i);
+    delete rgn;
+  }
+}
+
+ClientRegion *ClientWorld::thawRegion(Posn const& p)
+{
+  coldRegionCacheType::iterator i = state.coldCache.find(p);
+  if (i == state.coldCache.end()) {
+    return NULL;
+  }
+  ColdRegion *cold = i->second;
+  state.coldCache.erase(i);
+
+  ClientRegion *rgn = NULL;
+  if (state.regionCache.find(p) == state.regionCache.end()) {
+    rgn = new ClientRegion();
+    rgn->origin = p;
+    rgn->basement = cold->cr_basement;
+    if (decodeSpanArray(rgn, cold->cr_spans.data(), cold->cr_spans.size())) {
+      insertRegion(rgn);
+    } else {
+      fprintf(stderr, "warning: could not thaw region (%d,%d)\n", p.x, p.y);
+      delete rgn;
+      rgn = NULL;
+    }
+  }
+  delete cold;
+  return rgn;
+}
+
+void ClientWorld::dropColdRegion(Posn const& p)
+{
+  coldRegionCacheType::iterator i = state.coldCache.find(p);
+  if (i != state.coldCache.end()) {
+    delete i->second;
+    state.coldCache.erase(i);
+  }
+}
+
+// a region's picker is a RegionPicker (see regionpicker.cpp), which
+// is a Picker and a pointer back to the region, held in a shared_ptr
+// with a control block of two counts and its vtable
+#define REGION_PICKER_BYTES     (sizeof(Picker) + sizeof(Region*) + 2*sizeof(long) + sizeof(void*))
+
+static size_t hot_region_bytes(ClientRegion *rgn)
+{
+  size_t n = sizeof(ClientRegion) - sizeof(ColumnStore) + rgn->columns.bytes();
+  if (rgn->picker) {
+    n += REGION_PICKER_BYTES;
+  }
+  return n;
+}
+
+static size_t cold_region_bytes(ColdRegion *cold)
+{
+  return sizeof(ColdRegion) + cold->cr_spans.capacity();
+}
+
+// distance in regions, in the same sense as coldDistance
+static int region_distance(Posn const& a, Posn const& b)
+{
+  int dx = abs(a.x - b.x) >> REGION_SIZE_BITS;
+  int dy = abs(a.y - b.y) >> REGION_SIZE_BITS;
+  return (dx > dy) ? dx : dy;
+}
+
+size_t ClientWorld::residentBytes()
+{
+  size_t n = 0;
+  for (regionCacheType::iterator i=state.regionCache.begin(); i!=state.regionCache.end(); ++i) {
+    n += hot_region_bytes(i->second);
+  }
+  for (coldRegionCacheType::iterator i=state.coldCache.begin(); i!=state.coldCache.end(); ++i) {
+    n += cold_region_bytes(i->second);
+  }
+  return n;
+}
+
+struct EvictionCandidate {
+  int           distance;
+  unsigned long last_use;
+  Posn          posn;
+  bool          cold;
+
+  // farthest first, then least recently used
+  bool operator<(EvictionCandidate const& b) const {
+    if (distance != b.distance) {
+      return distance > b.distance;
+    }
+    return last_use < b.last_use;
+  }
+};
+
+int ClientWorld::evictToBudget(Posn const& center, std::vector<Posn> *evicted)
+{
+  size_t resident = residentBytes();
+  if (resident <= regionBudget) {
+    return 0;
+  }
+
+  std::vector<EvictionCandidate> candidates;
+  for (regionCacheType::iterator i=state.regionCache.begin(); i!=state.regionCache.end(); ++i) {
+    EvictionCandidate c;
+    c.distance = region_distance(i->first, center);
+    if (c.distance <= 1) {
+      continue;
+    }
+    c.last_use = i->second->lastUse;
+    c.posn = i->first;
+    c.cold = false;
+    candidates.push_back(c);
+  }
+  for (coldRegionCacheType::iterator i=state.coldCache.begin(); i!=state.coldCache.end(); ++i) {
+    EvictionCandidate c;
+    c.distance = region_distance(i->first, center);
+    c.last_use = i->second->cr_last_use;
+    c.posn = i->first;
+    c.cold = true;
+    candidates.push_back(c);
+  }
+  std::sort(candidates.begin(), candidates.end());
+
+  int count = 0;
+  for (std::vector<EvictionCandidate>::iterator c=candidates.begin();
+       (c != candidates.end()) && (resident > regionBudget);
+       ++c) {
+    if (c->cold) {
+      coldRegionCacheType::iterator i = state.coldCache.find(c->posn);
+      resident -= cold_region_bytes(i->second);
+      delete i->second;
+      state.coldCache.erase(i);
+    } else {
+      regionCacheType::iterator i = state.regionCache.find(c->posn);
+      ClientRegion *rgn = i->second;
+      resident -= hot_region_bytes(rgn);
+      removeRegion(i);
+      delete rgn;
+      evicted->push_back(c->posn);
+    }
+    // so that it gets asked for again if we come back
+    pendingRequests.erase(c->posn);
+    state.stats.rcs_evictions++;
+    count++;
+  }
+  if (resident > regionBudget) {
+    printf("warning: region cache still over budget at %zu bytes\n", resident);
+  }
+  return count;
+}
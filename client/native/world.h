@@ -3,17 +3,11 @@
 
 #include "clientoptions.h"
 #include <vector>
+#include <string.h>
 #include <hexcom/pick.h>
 
-struct Slab {
-  int x, y;             // location of column
-  short z0;             // bottom
-  short z1;             // top
-  unsigned char type;
-  unsigned char flags;
-};
-
 #include <hexcom/region.h>
+#include <hexcom/regiontable.h>
 
 struct Connection;
 
@@ -24,13 +18,89 @@ struct SpanInfo {
 };
 
 struct ClientRegion : Region {
+  ClientRegion() : lastUse(0), meshSerial(0) { }
   PickerPtr     picker;
+  unsigned long lastUse;        // World::useClock when last looked at
+  unsigned      meshSerial;     // of the mesh we are waiting for
+};
+
+typedef RegionTable<ClientRegion*> regionCacheType;
+
+/**
+ *   A region that is far from the player, kept in the compact wire
+ *   encoding (see encodeSpanArray()) until the player comes back
+ */
+
+struct ColdRegion {
+  unsigned long                 cr_last_use;
+  short                         cr_basement;
+  std::vector<unsigned char>    cr_spans;
 };
 
-typedef std::unordered_map<Posn, ClientRegion*, Posn::hash, Posn::cmp> regionCacheType;
+typedef RegionTable<ColdRegion*> coldRegionCacheType;
+
+// how far away (in regions) a region has to be before it goes cold
+#define COLD_REGION_DISTANCE    (4)
+
+/**
+ *   Between the two tiers, the regions are held to a memory budget;
+ *   when it is exceeded, regions are evicted farthest from the player
+ *   first, and least recently used first among those equally far.
+ *   The regions adjacent to the player are never evicted.  A hot
+ *   region counts against it its spans and its picker; a cold one its
+ *   packed spans.
+ */
+
+struct RegionCacheStats {
+  unsigned long rcs_hits;
+  unsigned long rcs_misses;
+  unsigned long rcs_evictions;
+};
+
+/**
+ *   A REGION_WINDOW x REGION_WINDOW grid of the hot regions around
+ *   the player, so that finding the region for a column near the
+ *   player is just index arithmetic.  It is toroidal: the region with
+ *   index (rx,ry) lives in slot [ry % REGION_WINDOW][rx % REGION_WINDOW],
+ *   so moving the window over by a region only refills the slots of
+ *   the row or column that came into view.  It is kept in step with
+ *   the regionCache, which is still where regions outside it are found.
+ */
+
+#define REGION_WINDOW_BITS      (4)
+#define REGION_WINDOW           (1<<REGION_WINDOW_BITS)
+
+struct RegionWindow {
+  RegionWindow();
+
+  // is the region at p inside the window?  If so, *rgnp is it (or
+  // NULL if we don't have it)
+  bool get(Posn const& p, ClientRegion **rgnp) const {
+    int rx = (p.x >> REGION_SIZE_BITS) - rw_x0;
+    int ry = (p.y >> REGION_SIZE_BITS) - rw_y0;
+    if (((unsigned)rx >= REGION_WINDOW) || ((unsigned)ry >= REGION_WINDOW)) {
+      return false;
+    }
+    *rgnp = rw_slot[(ry + rw_y0) & (REGION_WINDOW-1)][(rx + rw_x0) & (REGION_WINDOW-1)];
+    return true;
+  }
+  // a region has been added to or removed from the regionCache
+  void put(ClientRegion *rgn);
+  void drop(ClientRegion *rgn);
+  // center the window on the region with origin p
+  void recenter(Posn const& p, regionCacheType& cache);
+
+  int           rw_x0, rw_y0;   // region index of the window's lower left
+  ClientRegion *rw_slot[REGION_WINDOW][REGION_WINDOW];
+};
 
 struct World {
+  World() : useClock(0) { memset(&stats, 0, sizeof(stats)); }
   regionCacheType regionCache;
+  coldRegionCacheType coldCache;
+  RegionWindow window;
+  unsigned long useClock;
+  RegionCacheStats stats;
 };
 
 struct ClientWorld {
@@ -48,9 +118,47 @@ struct ClientWorld {
    */
   SpanInfo getSpanAdjacentByFace(SpanInfo from, int exit_face);
   SpanInfo getSpan(SpanInfo from);
-  SpanVector *getColumn(int ix, int iy, ClientRegion **rgnp);
+  SpanColumn getColumn(int ix, int iy, ClientRegion **rgnp);
+  // find a cached region (counting the hit or miss); NULL if it's not here
+  ClientRegion *lookupRegion(Posn const& p);
+  // the same, for bookkeeping: it neither counts nor marks the region used
+  ClientRegion *findRegion(Posn const& p);
+  // add a region to the cache (and the window); there must not
+  // already be one there
+  void insertRegion(ClientRegion *rgn);
+  // take a region out of the cache (and the window), but don't delete it
+  regionCacheType::iterator removeRegion(regionCacheType::iterator i);
+  // mark a region as just used
+  void touchRegion(ClientRegion *rgn) {
+    rgn->lastUse = ++state.useClock;
+  }
 
   void requestRegionIfNotPresent(Connection *cnx, Posn const& p);
+
+  /*
+   *  Move the regions more than coldDistance regions away from the
+   *  one at center into the cold tier; the positions of the ones
+   *  moved are added to frozen, so the caller can drop their meshes
+   */
+  void freezeDistantRegions(Posn const& center, std::vector<Posn> *frozen);
+  /*
+   *  Bring a region back from the cold tier, if it's there.  Returns
+   *  NULL if it's not; otherwise it is back in the regionCache, and
+   *  the caller needs to build its mesh
+   */
+  ClientRegion *thawRegion(Posn const& p);
+  // forget any cold copy of a region, e.g., when a fresh one arrives
+  void dropColdRegion(Posn const& p);
+  /*
+   *  Evict regions until the cache fits in regionBudget bytes; the
+   *  positions of any hot regions evicted are added to evicted, so the
+   *  caller can drop their meshes.  Returns the number evicted
+   */
+  int evictToBudget(Posn const& center, std::vector<Posn> *evicted);
+  // number of bytes held by the hot and cold tiers together
+  size_t residentBytes();
+  int           coldDistance;
+  size_t        regionBudget;
   std::unordered_map<Posn, bool, Posn::hash, Posn::cmp> pendingRequests;
 };
 
@@ -0,0 +1,261 @@
+/*
+ *  Benchmark for the terrain mesher, which needs no GPU; build with
+ *  "make bench_mesher" and run
+ *
+ *     ./bench_mesher [-n regions] [-r recorded-regions-file]
+ *
+ *  Without -r, it meshes n (default 100) synthetic regions.  A file of
+ *  recorded regions comes from the client's "saveregions" command; a
+ *  region in it is meshed with whichever of its neighbors are in the
+ *  file too.  The checksum covers the vertices and triangles of every
+ *  mesh, so a change to the mesher that shouldn't change its output
+ *  can be checked against it.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include <algorithm>
+#include <unordered_map>
+#include "region.h"
+#include "terrainmesh.h"
+#include "SimplexNoise.h"
+
+long real_time(void)    // real time in microseconds
+{
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+typedef std::unordered_map<Posn, Region*, Posn::hash, Posn::cmp> RegionMap;
+
+/**
+ *  A column of synthetic terrain at world (wx,wy): rock, dirt and
+ *  grass rolling with the noise, water in the hollows, and now and
+ *  then a tree or an overhang
+ */
+static void synthetic_column(SimplexNoise *noise, Region *rgn, int x, int y)
+{
+  int wx = rgn->origin.x + x;
+  int wy = rgn->origin.y + y;
+  unsigned h = (unsigned)(wx * 7919 + wy * 104729);
+  int ground = (int)(120 * noise->noise2(wx * 0.02, wy * 0.02));
+  Span s;
+  s.flags = 0;
+  s.type = 3;
+  s.height = ground - 8 - rgn->basement;
+  rgn->columns.push_back(x, y, s);
+  s.type = 1;
+  s.height = 8;
+  s.flags = (wx ^ wy) & DEEP_SHADOW;
+  rgn->columns.push_back(x, y, s);
+  s.flags = 0;
+  if (ground < 0) {
+    s.type = 240;
+    s.height = -ground;
+    rgn->columns.push_back(x, y, s);
+  } else if (h % 37 == 0) {
+    s.type = 2;
+    s.height = 30;
+    rgn->columns.push_back(x, y, s);
+  } else if (h % 23 == 0) {
+    s.type = 0;
+    s.height = 15;
+    rgn->columns.push_back(x, y, s);
+    s.type = 3;
+    s.height = 5;
+    rgn->columns.push_back(x, y, s);
+  }
+}
+
+// a square of synthetic regions big enough to give n of them all
+// their neighbors; the ones to mesh go in *subjects
+static void synthetic_regions(int n, RegionMap *world, std::vector<Region*> *subjects)
+{
+  SimplexNoise noise(1);
+  int side = 3;
+  while ((side-2) * (side-2) < n) {
+    side++;
+  }
+  for (int ry=0; ry<side; ry++) {
+    for (int rx=0; rx<side; rx++) {
+      Region *r = new Region();
+      r->origin = Posn(rx * REGION_SIZE, ry * REGION_SIZE);
+      r->basement = -1000;
+      for (int y=0; y<REGION_SIZE; y++) {
+        for (int x=0; x<REGION_SIZE; x++) {
+          synthetic_column(&noise, r, x, y);
+        }
+      }
+      (*world)[r->origin] = r;
+    }
+  }
+  for (int i=0; i<n; i++) {
+    Posn p((1 + i % (side-2)) * REGION_SIZE, (1 + i / (side-2)) * REGION_SIZE);
+    subjects->push_back((*world)[p]);
+  }
+}
+
+static bool recorded_regions(const char *path, RegionMap *world, std::vector<Region*> *subjects)
+{
+  FILE *f = fopen(path, "rb");
+  if (!f) {
+    perror(path);
+    return false;
+  }
+  Region *r;
+  while ((r = readRegionRecord(f)) != NULL) {
+    RegionMap::iterator i = world->find(r->origin);
+    if (i != world->end()) {
+      delete r;         // recorded twice; keep the first
+      continue;
+    }
+    (*world)[r->origin] = r;
+    subjects->push_back(r);
+  }
+  fclose(f);
+  return true;
+}
+
+static uint64_t checksum(uint64_t h, void const *data, size_t len)
+{
+  unsigned char const *p = (unsigned char const *)data;
+  for (size_t i=0; i<len; i++) {
+    h = (h ^ p[i]) * 0x100000001b3ULL;  // FNV-1a
+  }
+  return h;
+}
+
+// bytes the packed mesh in ma takes on the GPU, with 16-bit indices
+// if there are few enough vertices
+static size_t mesh_bytes(MeshAccumulator *ma)
+{
+  size_t index = (ma->packed.size() <= 65536) ? 2 : 4;
+  return ma->packed.size() * sizeof(PackedVertex)
+    + 3 * (ma->size() + ma->num_transparent) * index;
+}
+
+static uint64_t mesh_checksum(uint64_t h, MeshAccumulator *ma)
+{
+  h = checksum(h, ma->packed.data(), ma->packed.size() * sizeof(PackedVertex));
+  h = checksum(h, ma->index.data(), 3 * ma->size() * sizeof(uint32_t));
+  h = checksum(h, ma->transparent_index.data(), 3 * ma->num_transparent * sizeof(uint32_t));
+  return h;
+}
+
+static void report(const char *what, std::vector<long>& latency,
+                   unsigned long triangles, unsigned long bytes)
+{
+  size_t n = latency.size();
+  long total = 0;
+  for (size_t i=0; i<n; i++) {
+    total += latency[i];
+  }
+  std::sort(latency.begin(), latency.end());
+  printf("  %-6s %8.0f triangles/sec  %7.1f KiB/region  %7lu triangles/region\n",
+         what,
+         total ? triangles * 1.0e6 / total : 0.0,
+         bytes / 1024.0 / n,
+         triangles / n);
+  printf("         latency ms: p50 %.3f  p90 %.3f  p99 %.3f  max %.3f\n",
+         latency[n/2] * 1.0e-3,
+         latency[n*9/10] * 1.0e-3,
+         latency[n*99/100] * 1.0e-3,
+         latency[n-1] * 1.0e-3);
+}
+
+int main(int argc, char *argv[])
+{
+  int n = 100;
+  const char *recorded = NULL;
+
+  while (1) {
+    int c = getopt(argc, argv, "n:r:");
+    if (c == -1) {
+      break;
+    }
+    switch (c) {
+    case 'n':
+      n = atoi(optarg);
+      break;
+    case 'r':
+      recorded = optarg;
+      break;
+    default:
+      fprintf(stderr, "usage: %s [-n regions] [-r recorded-regions-file]\n", argv[0]);
+      return 1;
+    }
+  }
+
+  RegionMap world;
+  std::vector<Region*> subjects;
+  if (recorded) {
+    if (!recorded_regions(recorded, &world, &subjects)) {
+      return 1;
+    }
+  } else {
+    synthetic_regions(n, &world, &subjects);
+  }
+  if (subjects.empty()) {
+    fprintf(stderr, "no regions to mesh\n");
+    return 1;
+  }
+
+  std::vector<long> detail_latency, coarse_latency;
+  unsigned long detail_triangles = 0, detail_bytes = 0;
+  unsigned long coarse_triangles = 0, coarse_bytes = 0;
+  TerrainMeshStats stats;
+  memset(&stats, 0, sizeof(stats));
+  uint64_t h = 0xcbf29ce484222325ULL;
+
+  for (size_t i=0; i<subjects.size(); i++) {
+    Region *rgns[3][3];
+    for (int dy=-1; dy<=1; dy++) {
+      for (int dx=-1; dx<=1; dx++) {
+        Posn p(subjects[i]->origin.x + dx * REGION_SIZE,
+               subjects[i]->origin.y + dy * REGION_SIZE);
+        RegionMap::iterator j = world.find(p);
+        rgns[dy+1][dx+1] = (j == world.end()) ? NULL : j->second;
+      }
+    }
+
+    MeshAccumulator *ma = acquire_accumulator();
+    long t0 = real_time();
+    mesh_detail(rgns, TS_ALL_CHUNKS, ma, &stats);
+    long t1 = real_time();
+    detail_latency.push_back(t1 - t0);
+    detail_triangles += ma->size() + ma->num_transparent;
+    detail_bytes += mesh_bytes(ma);
+    h = mesh_checksum(h, ma);
+    release_accumulator(ma);
+
+    long t = 0;
+    for (int level=0; level<TS_COARSE_LEVELS; level++) {
+      ma = acquire_accumulator();
+      long t2 = real_time();
+      mesh_coarse(subjects[i], level, ma);
+      t += real_time() - t2;
+      coarse_triangles += ma->size();
+      coarse_bytes += mesh_bytes(ma);
+      h = mesh_checksum(h, ma);
+      release_accumulator(ma);
+    }
+    coarse_latency.push_back(t);
+  }
+
+  printf("meshed %zu %s regions:\n",
+         subjects.size(), recorded ? "recorded" : "synthetic");
+  report("detail", detail_latency, detail_triangles, detail_bytes);
+  report("coarse", coarse_latency, coarse_triangles, coarse_bytes);
+  printf("  hidden faces: %u tops, %u bottoms, %u sides\n",
+         stats.tms_hidden_tops, stats.tms_hidden_bottoms, stats.tms_hidden_sides);
+  printf("  checksum %016llx\n", (unsigned long long)h);
+
+  for (RegionMap::iterator i=world.begin(); i!=world.end(); ++i) {
+    delete i->second;
+  }
+  return 0;
+}
@@ -0,0 +1,274 @@
+/*
+ *  Scripted flythrough for the occlusion culling, which needs no GPU;
+ *  build with "make bench_occlusion" and run
+ *
+ *     ./bench_occlusion [-n frames] [-s side] [-r recorded-regions-file]
+ *
+ *  The camera flies a closed loop at eye height over the terrain:
+ *  side by side (default 16 by 16) regions of synthetic hills, or the
+ *  regions in a file from the client's "saveregions" command.  In
+ *  each of n frames (default 600) the regions are culled as the
+ *  client culls them: out to VIEW_DISTANCE, then by the frustum,
+ *  then by the occluders.  It reports how many sections were drawn
+ *  against how many each stage skipped, and how long the culling
+ *  took.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include <algorithm>
+#include <unordered_map>
+#include <glm/glm.hpp>
+#include <glm/ext.hpp>
+#include "hex.h"
+#include "region.h"
+#include "occlusion.h"
+#include "SimplexNoise.h"
+
+// as in the client (see client/native/main.cpp)
+#define VIEW_DISTANCE           (10*REGION_SIZE)
+#define FAR_PLANE               ((float)(VIEW_DISTANCE + REGION_SIZE))
+#define EYE_HEIGHT              (18 * z_scale)
+
+long real_time(void)    // real time in microseconds
+{
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+struct Section {
+  Region       *s_region;
+  frect         s_bbox;
+  frect         s_occluders[REGION_OCCLUDERS];
+  int           s_num_occluders;
+};
+
+typedef std::unordered_map<Posn, Region*, Posn::hash, Posn::cmp> RegionMap;
+
+// rolling hills, with valleys deep enough to hide what's behind them
+static void synthetic_column(SimplexNoise *noise, Region *rgn, int x, int y)
+{
+  int wx = rgn->origin.x + x;
+  int wy = rgn->origin.y + y;
+  int ground = (int)(400 * noise->noise2(wx * 0.015, wy * 0.015)
+                     + 60 * noise->noise2(wx * 0.08, wy * 0.08));
+  Span s;
+  s.flags = 0;
+  s.type = 3;
+  s.height = ground - 4 - rgn->basement;
+  rgn->columns.push_back(x, y, s);
+  s.type = 1;
+  s.height = 4;
+  rgn->columns.push_back(x, y, s);
+  if (ground < 0) {
+    s.type = 240;
+    s.height = -ground;
+    rgn->columns.push_back(x, y, s);
+  }
+}
+
+static void synthetic_regions(int side, RegionMap *world)
+{
+  SimplexNoise noise(1);
+  for (int ry=0; ry<side; ry++) {
+    for (int rx=0; rx<side; rx++) {
+      Region *r = new Region();
+      r->origin = Posn(rx * REGION_SIZE, ry * REGION_SIZE);
+      r->basement = -1000;
+      for (int y=0; y<REGION_SIZE; y++) {
+        for (int x=0; x<REGION_SIZE; x++) {
+          synthetic_column(&noise, r, x, y);
+        }
+      }
+      (*world)[r->origin] = r;
+    }
+  }
+}
+
+static bool recorded_regions(const char *path, RegionMap *world)
+{
+  FILE *f = fopen(path, "rb");
+  if (!f) {
+    perror(path);
+    return false;
+  }
+  Region *r;
+  while ((r = readRegionRecord(f)) != NULL) {
+    RegionMap::iterator i = world->find(r->origin);
+    if (i != world->end()) {
+      delete r;         // recorded twice; keep the first
+      continue;
+    }
+    (*world)[r->origin] = r;
+  }
+  fclose(f);
+  return true;
+}
+
+// the top of the column under (x,y), or 0 if there is no region
+// there
+static double ground_height(RegionMap& world, double x, double y)
+{
+  int ix, iy;
+  convert_xy_to_hex(x, y, &ix, &iy);
+  RegionMap::iterator i = world.find(Posn(ix & ~(REGION_SIZE-1), iy & ~(REGION_SIZE-1)));
+  if (i == world.end()) {
+    return 0;
+  }
+  Region *rgn = i->second;
+  SpanColumn col(rgn->column(ix - rgn->origin.x, iy - rgn->origin.y));
+  int h = 0;
+  for (SpanColumn::const_iterator j=col.begin(); j!=col.end(); ++j) {
+    h += j->height;
+  }
+  return (rgn->basement + h) * z_scale;
+}
+
+static void report(const char *what, double count, double total)
+{
+  printf("  %-22s %8.1f  (%4.1f%%)\n", what, count, total ? 100.0 * count / total : 0.0);
+}
+
+int main(int argc, char *argv[])
+{
+  int frames = 600;
+  int side = 16;
+  const char *recorded = NULL;
+
+  while (1) {
+    int c = getopt(argc, argv, "n:s:r:");
+    if (c == -1) {
+      break;
+    }
+    switch (c) {
+    case 'n':
+      frames = atoi(optarg);
+      break;
+    case 's':
+      side = atoi(optarg);
+      break;
+    case 'r':
+      recorded = optarg;
+      break;
+    default:
+      fprintf(stderr, "usage: %s [-n frames] [-s side] [-r recorded-regions-file]\n", argv[0]);
+      return 1;
+    }
+  }
+
+  RegionMap world;
+  if (recorded) {
+    if (!recorded_regions(recorded, &world)) {
+      return 1;
+    }
+  } else {
+    synthetic_regions(side, &world);
+  }
+  if (world.empty() || (frames <= 0)) {
+    fprintf(stderr, "no regions to fly over\n");
+    return 1;
+  }
+
+  std::vector<Section> sections;
+  for (RegionMap::iterator i=world.begin(); i!=world.end(); ++i) {
+    Section s;
+    s.s_region = i->second;
+    s.s_bbox = makeRegionPicker(i->second)->bbox;
+    s.s_num_occluders = region_occluders(i->second, s.s_occluders);
+    sections.push_back(s);
+  }
+  frect area = sections[0].s_bbox;
+  for (size_t i=1; i<sections.size(); i++) {
+    area.union_box(sections[i].s_bbox);
+  }
+
+  // an ellipse over the middle of the area, looking ahead and a
+  // little down, as if walking
+  double cx = (area.x0 + area.x1) / 2;
+  double cy = (area.y0 + area.y1) / 2;
+  double rx = (area.x1 - area.x0) * 0.35;
+  double ry = (area.y1 - area.y0) * 0.25;
+  glm::mat4 projection = glm::perspective(45.0f, 4.0f / 3.0f, 0.1f, FAR_PLANE);
+
+  OcclusionBuffer *ob = new OcclusionBuffer();
+  std::vector<Section*> candidates;
+  std::vector<long> latency;
+  unsigned long in_range = 0, outside = 0, occluded = 0, drawn = 0;
+  unsigned long occluders = 0;
+
+  for (int f=0; f<frames; f++) {
+    double t = 2 * PI * f / frames;
+    glm::vec3 eye(cx + rx * cos(t), cy + ry * sin(t), 0);
+    eye.z = ground_height(world, eye.x, eye.y) + EYE_HEIGHT;
+    glm::vec3 looking = glm::normalize(glm::vec3(-rx * sin(t), ry * cos(t), 0));
+    looking.z = -0.1;
+    glm::mat4 vp = projection * glm::lookAt(eye, eye + looking, glm::vec3(0, 0, 1));
+    int here_x, here_y;
+    convert_xy_to_hex(eye.x, eye.y, &here_x, &here_y);
+    Posn here(here_x & ~(REGION_SIZE-1), here_y & ~(REGION_SIZE-1));
+
+    Frustum frustum;
+    frustum.extract(vp);
+    candidates.clear();
+    long t0 = real_time();
+    occlusion_begin(ob, vp);
+    for (std::vector<Section>::iterator s=sections.begin(); s!=sections.end(); ++s) {
+      Posn p(s->s_region->origin);
+      glm::vec2 center(hex_center_x(p.x + REGION_SIZE/2, p.y + REGION_SIZE/2),
+                       hex_center_y(p.x + REGION_SIZE/2, p.y + REGION_SIZE/2));
+      if (glm::distance(center, glm::vec2(eye.x, eye.y)) >= VIEW_DISTANCE) {
+        continue;
+      }
+      in_range++;
+      if (!frustum.visible(s->s_bbox)) {
+        outside++;
+        continue;
+      }
+      candidates.push_back(&*s);
+      int dx = abs(p.x - here.x) >> REGION_SIZE_BITS;
+      int dy = abs(p.y - here.y) >> REGION_SIZE_BITS;
+      if (std::max(dx, dy) <= OCCLUDER_REGIONS) {
+        for (int i=0; i<s->s_num_occluders; i++) {
+          occlusion_add_occluder(ob, s->s_occluders[i]);
+        }
+      }
+    }
+    occlusion_end(ob);
+    occluders += ob->ob_occluders;
+    for (size_t i=0; i<candidates.size(); i++) {
+      if (occlusion_visible(ob, candidates[i]->s_bbox)) {
+        drawn++;
+      } else {
+        occluded++;
+      }
+    }
+    latency.push_back(real_time() - t0);
+  }
+
+  printf("flew %d frames over %zu %s regions; sections a frame:\n",
+         frames, sections.size(), recorded ? "recorded" : "synthetic");
+  report("in range", in_range / (double)frames, in_range / (double)frames);
+  report("outside the frustum", outside / (double)frames, in_range / (double)frames);
+  report("occluded", occluded / (double)frames, in_range / (double)frames);
+  report("drawn", drawn / (double)frames, in_range / (double)frames);
+  printf("  occlusion skipped %.1f%% of what the frustum left, with %.1f occluders a frame\n",
+         (occluded + drawn) ? 100.0 * occluded / (occluded + drawn) : 0.0,
+         occluders / (double)frames);
+  std::sort(latency.begin(), latency.end());
+  size_t n = latency.size();
+  printf("  culling ms a frame: p50 %.3f  p90 %.3f  p99 %.3f  max %.3f\n",
+         latency[n/2] * 1.0e-3,
+         latency[n*9/10] * 1.0e-3,
+         latency[n*99/100] * 1.0e-3,
+         latency[n-1] * 1.0e-3);
+
+  delete ob;
+  for (RegionMap::iterator i=world.begin(); i!=world.end(); ++i) {
+    delete i->second;
+  }
+  return 0;
+}
@@ -0,0 +1,733 @@
+/*
+ *  Microbenchmarks for the region data structures; build with
+ *  "make benchregion" and run "./benchregion [test]"
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <unordered_map>
+#include "region.h"
+#include "regiontable.h"
+#include "misc.h"
+
+#define NUM_REGIONS     (4096)
+
+long real_time(void)    // real time in microseconds
+{
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+static long resident_bytes(void)
+{
+  long pages = 0, rss = 0;
+  FILE *f = fopen("/proc/self/statm", "r");
+  if (f) {
+    if (fscanf(f, "%ld %ld", &pages, &rss) != 2) {
+      rss = 0;
+    }
+    fclose(f);
+  }
+  return rss * sysconf(_SC_PAGESIZE);
+}
+
+/**
+ *  Produce a plausible column: some rock, some dirt, the occasional
+ *  overhang or tree, and sometimes water on top
+ */
+static void synthetic_column(SpanVector *vec)
+{
+  vec->clear();
+  Span s;
+  s.flags = 0;
+  s.type = 3;
+  s.height = 900 + random() % 100;
+  vec->push_back(s);
+  int extra = random() % 8;
+  for (int i=0; i<extra; i++) {
+    s.type = (i & 1) ? 0 : (1 + random() % 5);
+    s.height = 1 + random() % 20;
+    s.flags = random() & DEEP_SHADOW;
+    vec->push_back(s);
+  }
+  if (vec->back().type == 0) {
+    vec->back().type = 240;
+  }
+}
+
+// the way regions used to be stored, for comparison
+struct VectorRegion {
+  SpanVector columns[REGION_SIZE][REGION_SIZE];
+};
+
+static void run_child(void (*fn)(void))
+{
+  fflush(stdout);
+  pid_t pid = fork();
+  if (pid == 0) {
+    fn();
+    fflush(stdout);
+    _exit(0);
+  }
+  int status;
+  waitpid(pid, &status, 0);
+}
+
+static long walk(SpanColumn const& col)
+{
+  long h = 0;
+  for (SpanColumn::const_iterator i=col.begin(); i!=col.end(); ++i) {
+    h += i->height + i->type;
+  }
+  return h;
+}
+
+static long walk(SpanVector const& col)
+{
+  long h = 0;
+  for (SpanVector::const_iterator i=col.begin(); i!=col.end(); ++i) {
+    h += i->height + i->type;
+  }
+  return h;
+}
+
+static void bench_vector_columns(void)
+{
+  srandom(1);
+  long rss0 = resident_bytes();
+  std::vector<VectorRegion*> rgns;
+  SpanVector tmp;
+  for (int i=0; i<NUM_REGIONS; i++) {
+    VectorRegion *r = new VectorRegion();
+    for (int y=0; y<REGION_SIZE; y++) {
+      for (int x=0; x<REGION_SIZE; x++) {
+        synthetic_column(&tmp);
+        for (SpanVector::iterator j=tmp.begin(); j!=tmp.end(); ++j) {
+          r->columns[y][x].push_back(*j);
+        }
+      }
+    }
+    rgns.push_back(r);
+  }
+  long rss1 = resident_bytes();
+
+  long t0 = real_time();
+  long sum = 0;
+  for (int i=0; i<NUM_REGIONS; i++) {
+    VectorRegion *r = rgns[(i * 2039) % NUM_REGIONS];
+    for (int y=0; y<REGION_SIZE; y++) {
+      for (int x=0; x<REGION_SIZE; x++) {
+        sum += walk(r->columns[y][x]);
+      }
+    }
+  }
+  long t1 = real_time();
+  printf("  vector columns: %8.1f KiB/region  walk %6.2f ns/column  (%ld)\n",
+         (rss1 - rss0) / 1024.0 / NUM_REGIONS,
+         (t1 - t0) * 1.0e3 / (NUM_REGIONS * REGION_SIZE * REGION_SIZE),
+         sum);
+}
+
+static void bench_store_columns(void)
+{
+  srandom(1);
+  long rss0 = resident_bytes();
+  std::vector<Region*> rgns;
+  SpanVector tmp;
+  for (int i=0; i<NUM_REGIONS; i++) {
+    Region *r = new Region();
+    for (int y=0; y<REGION_SIZE; y++) {
+      for (int x=0; x<REGION_SIZE; x++) {
+        synthetic_column(&tmp);
+        for (SpanVector::iterator j=tmp.begin(); j!=tmp.end(); ++j) {
+          r->columns.push_back(x, y, *j);
+        }
+      }
+    }
+    r->columns.compact();
+    rgns.push_back(r);
+  }
+  long rss1 = resident_bytes();
+
+  long t0 = real_time();
+  long sum = 0;
+  for (int i=0; i<NUM_REGIONS; i++) {
+    Region *r = rgns[(i * 2039) % NUM_REGIONS];
+    for (int y=0; y<REGION_SIZE; y++) {
+      for (int x=0; x<REGION_SIZE; x++) {
+        sum += walk(r->column(x, y));
+      }
+    }
+  }
+  long t1 = real_time();
+  printf("   store columns: %8.1f KiB/region  walk %6.2f ns/column  (%ld)\n",
+         (rss1 - rss0) / 1024.0 / NUM_REGIONS,
+         (t1 - t0) * 1.0e3 / (NUM_REGIONS * REGION_SIZE * REGION_SIZE),
+         sum);
+}
+
+static void bench_columns(void)
+{
+  printf("column storage, %d regions:\n", NUM_REGIONS);
+  run_child(bench_vector_columns);
+  run_child(bench_store_columns);
+}
+
+/**
+ *  Expand every column of a region along with six of its neighbors,
+ *  the way the mesher does; either one column at a time with
+ *  expandSpan() or in batches with expandColumns()
+ */
+#define EXPAND_REGIONS  (64)
+#define EXPAND_PASSES   (4)
+
+static Region *expand_regions[EXPAND_REGIONS];
+
+static void neighbors(Region *r, int x, int y, SpanColumn *batch)
+{
+  static const int dx[6] = { -1, 0, 1, 1, 0, -1 };
+  static const int dy[6] = { -1, -1, 0, 1, 1, 0 };
+  batch[0] = r->column(x, y);
+  for (int k=0; k<6; k++) {
+    batch[k+1] = r->column((x + dx[k]) & (REGION_SIZE-1),
+                           (y + dy[k]) & (REGION_SIZE-1));
+  }
+}
+
+static void time_expand(const char *label, int kernel, int z_base, int h)
+{
+  int stride = h + EXPAND_SLOP;
+  std::vector<unsigned char> types(7 * stride);
+  std::vector<unsigned char> flags(7 * stride);
+  SpanColumn batch[7];
+  long check = 0;
+
+  if (kernel) {
+    // report what we actually got, which may not be what we asked for
+    label = setExpandKernel(kernel);
+  }
+  long t0 = real_time();
+  for (int pass=0; pass<EXPAND_PASSES; pass++) {
+    for (int i=0; i<EXPAND_REGIONS; i++) {
+      Region *r = expand_regions[i];
+      for (int y=0; y<REGION_SIZE; y++) {
+        for (int x=0; x<REGION_SIZE; x++) {
+          neighbors(r, x, y, batch);
+          if (kernel) {
+            expandColumns(r, batch, 7, z_base, h, stride, &types[0], &flags[0]);
+          } else {
+            for (int k=0; k<7; k++) {
+              expandSpan(r, batch[k], z_base, h,
+                         &types[k * stride], &flags[k * stride]);
+            }
+          }
+          check += types[h-1] + types[stride + h/2] + flags[6 * stride];
+        }
+      }
+    }
+  }
+  long t1 = real_time();
+  printf("  %-14s %8.1f ns/column+neighbors  (%ld)\n",
+         label,
+         (t1 - t0) * 1.0e3 / (EXPAND_PASSES * EXPAND_REGIONS * REGION_SIZE * REGION_SIZE),
+         check);
+}
+
+// make sure every kernel agrees with expandSpan() before timing them
+static void check_expand(int kernel, int z_base, int h)
+{
+  int stride = h + EXPAND_SLOP;
+  std::vector<unsigned char> types(7 * stride), flags(7 * stride);
+  std::vector<unsigned char> want_types(h), want_flags(h);
+  SpanColumn batch[7];
+
+  setExpandKernel(kernel);
+  Region *r = expand_regions[0];
+  for (int y=0; y<REGION_SIZE; y++) {
+    for (int x=0; x<REGION_SIZE; x++) {
+      neighbors(r, x, y, batch);
+      expandColumns(r, batch, 7, z_base, h, stride, &types[0], &flags[0]);
+      for (int k=0; k<7; k++) {
+        expandSpan(r, batch[k], z_base, h, &want_types[0], &want_flags[0]);
+        if (memcmp(&types[k * stride], &want_types[0], h)
+            || memcmp(&flags[k * stride], &want_flags[0], h)) {
+          printf("  %s expansion of (%d,%d)[%d] is wrong!\n",
+                 setExpandKernel(kernel), x, y, k);
+          exit(1);
+        }
+      }
+    }
+  }
+}
+
+static void bench_expand(void)
+{
+  srandom(2);
+  SpanVector tmp;
+  for (int i=0; i<EXPAND_REGIONS; i++) {
+    Region *r = new Region();
+    r->basement = -1000;
+    for (int y=0; y<REGION_SIZE; y++) {
+      for (int x=0; x<REGION_SIZE; x++) {
+        synthetic_column(&tmp);
+        r->columns.assign(x, y, tmp);
+      }
+    }
+    expand_regions[i] = r;
+  }
+
+  for (int kernel=EXPAND_SCALAR; kernel<=EXPAND_AVX2; kernel++) {
+    check_expand(kernel, -1000, 1024);
+    check_expand(kernel, -80, 64);
+    check_expand(kernel, -1200, 100);
+  }
+
+  printf("expand whole columns (mesher):\n");
+  time_expand("memset", 0, -1000, 1024);
+  time_expand("scalar", EXPAND_SCALAR, -1000, 1024);
+  time_expand("sse2", EXPAND_SSE2, -1000, 1024);
+  time_expand("avx2", EXPAND_AVX2, -1000, 1024);
+
+  printf("expand 64 around the surface (walker):\n");
+  time_expand("memset", 0, -80, 64);
+  time_expand("scalar", EXPAND_SCALAR, -80, 64);
+  time_expand("sse2", EXPAND_SSE2, -80, 64);
+  time_expand("avx2", EXPAND_AVX2, -80, 64);
+
+  printf("(the client's expandColumns() uses %s here)\n", setExpandKernel(EXPAND_AUTO));
+}
+
+/**
+ *  Look up the span at random heights in built-up columns, the
+ *  old way (walking up the column) and with spanAtZ()
+ */
+#define LOOKUPS         (1000000)
+
+static int linear_span_at(Region *r, int x, int y, int z, int *bottom)
+{
+  SpanColumn col(r->column(x, y));
+  int b = r->basement;
+  int k = 0;
+  for (SpanColumn::const_iterator i=col.begin(); i!=col.end(); ++i, ++k) {
+    if (z < b + i->height) {
+      break;
+    }
+    b += i->height;
+  }
+  *bottom = b;
+  return k;
+}
+
+static void time_lookup(int depth)
+{
+  srandom(3);
+  Region *r = new Region();
+  r->basement = -100;
+  int top = 0;
+  for (int y=0; y<REGION_SIZE; y++) {
+    for (int x=0; x<REGION_SIZE; x++) {
+      int h = 0;
+      for (int k=0; k<depth; k++) {
+        Span s;
+        s.type = (k & 1) ? 0 : 1 + random() % 5;
+        s.flags = 0;
+        s.height = 1 + random() % 8;
+        r->columns.push_back(x, y, s);
+        h += s.height;
+      }
+      if (h > top) {
+        top = h;
+      }
+    }
+  }
+  r->columns.compact();
+
+  std::vector<int> qx(LOOKUPS), qy(LOOKUPS), qz(LOOKUPS);
+  for (int i=0; i<LOOKUPS; i++) {
+    qx[i] = random() % REGION_SIZE;
+    qy[i] = random() % REGION_SIZE;
+    qz[i] = r->basement + random() % top;
+  }
+
+  // the two had better agree
+  for (int i=0; i<LOOKUPS; i+=97) {
+    int b0, b1;
+    int k0 = linear_span_at(r, qx[i], qy[i], qz[i], &b0);
+    int k1 = spanAtZ(r, qx[i], qy[i], qz[i], &b1);
+    if ((k0 != k1) || (b0 != b1)) {
+      printf("  spanAtZ(%d,%d,%d) => %d@%d, should be %d@%d\n",
+             qx[i], qy[i], qz[i], k1, b1, k0, b0);
+      exit(1);
+    }
+  }
+
+  long sum0 = 0, sum1 = 0;
+  long t0 = real_time();
+  for (int i=0; i<LOOKUPS; i++) {
+    int b;
+    sum0 += linear_span_at(r, qx[i], qy[i], qz[i], &b) + b;
+  }
+  long t1 = real_time();
+  for (int i=0; i<LOOKUPS; i++) {
+    int b;
+    sum1 += spanAtZ(r, qx[i], qy[i], qz[i], &b) + b;
+  }
+  long t2 = real_time();
+  printf("  %4d spans/column:  linear %7.1f ns   spanAtZ %7.1f ns   (%ld %ld)\n",
+         depth,
+         (t1 - t0) * 1.0e3 / LOOKUPS,
+         (t2 - t1) * 1.0e3 / LOOKUPS,
+         sum0, sum1);
+  delete r;
+}
+
+static void bench_lookup(void)
+{
+  printf("span lookup by z:\n");
+  time_lookup(4);
+  time_lookup(16);
+  time_lookup(64);
+  time_lookup(256);
+  time_lookup(1024);
+}
+
+/**
+ *  Blow a crater in a region, the kind of edit that touches lots of
+ *  columns many times each: one unit-high edit at a time through
+ *  Region::set(), and all at once through Region::apply()
+ */
+static void make_edit_region(Region *r)
+{
+  srandom(4);
+  r->origin = Posn(0, 0);
+  r->basement = -1000;
+  SpanVector tmp;
+  for (int y=0; y<REGION_SIZE; y++) {
+    for (int x=0; x<REGION_SIZE; x++) {
+      synthetic_column(&tmp);
+      r->columns.assign(x, y, tmp);
+    }
+  }
+}
+
+static void time_edit(const char *label,
+                      void (*make)(Region *),
+                      std::vector<SpanEdit> const& edits)
+{
+  Region *one = new Region();
+  Region *batch = new Region();
+  make(one);
+  make(batch);
+
+  long t0 = real_time();
+  for (unsigned i=0; i<edits.size(); i++) {
+    SpanEdit const& e(edits[i]);
+    one->set(e.x, e.y, e.z, e.height, e.type, e.flags);
+  }
+  long t1 = real_time();
+  batch->apply(&edits[0], edits.size());
+  long t2 = real_time();
+
+  unsigned char a[2048 + EXPAND_SLOP], b[2048 + EXPAND_SLOP];
+  for (int y=0; y<REGION_SIZE; y++) {
+    for (int x=0; x<REGION_SIZE; x++) {
+      SpanColumn ca(one->column(x, y));
+      SpanColumn cb(batch->column(x, y));
+      expandColumns(one, &ca, 1, -1000, 2048, sizeof(a), &a[0], NULL);
+      expandColumns(batch, &cb, 1, -1000, 2048, sizeof(b), &b[0], NULL);
+      if (memcmp(a, b, 2048) != 0) {
+        printf("  column (%d,%d) differs!\n", x, y);
+        exit(1);
+      }
+    }
+  }
+  printf("%s, %zu edits:\n", label, edits.size());
+  printf("  Region::set     %8.3f ms\n", (t1 - t0) * 1.0e-3);
+  printf("  Region::apply   %8.3f ms\n", (t2 - t1) * 1.0e-3);
+  delete one;
+  delete batch;
+}
+
+// a city of towers with floors every other unit
+static void make_tower_region(Region *r)
+{
+  r->origin = Posn(0, 0);
+  r->basement = -1000;
+  Span s;
+  s.flags = 0;
+  for (int y=0; y<REGION_SIZE; y++) {
+    for (int x=0; x<REGION_SIZE; x++) {
+      s.type = 3;
+      s.height = 1000;
+      r->columns.push_back(x, y, s);
+      for (int k=0; k<400; k++) {
+        s.type = (k & 1) ? 1 : 0;
+        s.height = 1;
+        r->columns.push_back(x, y, s);
+      }
+    }
+  }
+  r->columns.compact();
+}
+
+static void bench_edit(void)
+{
+  std::vector<SpanEdit> edits;
+  for (int y=0; y<REGION_SIZE; y++) {
+    for (int x=0; x<REGION_SIZE; x++) {
+      int d2 = (x-16)*(x-16) + (y-16)*(y-16);
+      if (d2 >= 15*15) {
+        continue;
+      }
+      // carve out a bowl and line it with something
+      int depth = 30 - d2 / 8;
+      for (int z=-120; z<-120+depth; z++) {
+        SpanEdit e;
+        e.x = x;
+        e.y = y;
+        e.z = z;
+        e.height = 1;
+        e.type = (z == -120) ? 4 : 0;
+        e.flags = (z == -120) ? LIGHT_SHADOW : 0;
+        edits.push_back(e);
+      }
+    }
+  }
+
+  time_edit("crater", make_edit_region, edits);
+
+  // fill in every floor of the towers, from the top down
+  edits.clear();
+  for (int y=0; y<REGION_SIZE; y++) {
+    for (int x=0; x<REGION_SIZE; x++) {
+      for (int z=400; z>0; z-=2) {
+        SpanEdit e;
+        e.x = x;
+        e.y = y;
+        e.z = z;
+        e.height = 1;
+        e.type = 2;
+        e.flags = 0;
+        edits.push_back(e);
+      }
+    }
+  }
+  time_edit("towers", make_tower_region, edits);
+}
+
+/**
+ *  What it costs to put a region into the cold tier (the wire
+ *  encoding) and to bring it back
+ */
+static void bench_spanarray(void)
+{
+  srandom(5);
+  Region *r = new Region();
+  SpanVector tmp;
+  for (int y=0; y<REGION_SIZE; y++) {
+    for (int x=0; x<REGION_SIZE; x++) {
+      synthetic_column(&tmp);
+      r->columns.assign(x, y, tmp);
+    }
+  }
+  r->columns.compact();
+
+  const int passes = 1000;
+  std::vector<unsigned char> buf;
+  long t0 = real_time();
+  for (int i=0; i<passes; i++) {
+    encodeSpanArray(r, &buf);
+  }
+  long t1 = real_time();
+  Region *back = NULL;
+  for (int i=0; i<passes; i++) {
+    delete back;
+    back = new Region();
+    decodeSpanArray(back, buf.data(), buf.size());
+  }
+  long t2 = real_time();
+
+  for (int y=0; y<REGION_SIZE; y++) {
+    for (int x=0; x<REGION_SIZE; x++) {
+      SpanColumn a(r->column(x, y)), b(back->column(x, y));
+      if ((a.size() != b.size())
+          || memcmp(a.begin(), b.begin(), a.size() * sizeof(Span))) {
+        printf("  column (%d,%d) did not survive!\n", x, y);
+        exit(1);
+      }
+    }
+  }
+  printf("cold tier:\n");
+  printf("  hot   %6zu bytes/region\n", r->columns.bytes());
+  printf("  cold  %6zu bytes/region\n", buf.size());
+  printf("  encode %6.1f us   decode %6.1f us\n",
+         (t1 - t0) * 1.0 / passes,
+         (t2 - t1) * 1.0 / passes);
+}
+
+/**
+ *  Region table lookups, for the old Posn::hash in an unordered_map,
+ *  the new hash in an unordered_map, and the open-addressing table;
+ *  both for a random walk (which mostly stays in one region) and for
+ *  scattered lookups, a tenth of which miss
+ */
+#define TABLE_SIDE      (40)
+#define TABLE_LOOKUPS   (4000000)
+
+struct OldPosnHash {
+  unsigned operator()(Posn const& a) const {
+    return (a.x>>REGION_SIZE_BITS)
+      + (a.y>>REGION_SIZE_BITS)
+      + (0xFACE ^ (a.x >> 16))
+      + (0xCAFE ^ (((a.x|1) * (a.y|1)) >> 16));
+  }
+};
+
+template <typename Table>
+static long time_table(Table *t, std::vector<Posn> const& q, long *sum)
+{
+  long s = 0;
+  long t0 = real_time();
+  for (size_t i=0; i<q.size(); i++) {
+    typename Table::iterator j = t->find(q[i]);
+    if (j != t->end()) {
+      s += j->second->basement;
+    }
+  }
+  *sum = s;
+  return real_time() - t0;
+}
+
+template <typename Table>
+static void fill_table(Table *t, std::vector<Region*> const& regions)
+{
+  for (size_t i=0; i<regions.size(); i++) {
+    t->insert(typename Table::value_type(regions[i]->origin, regions[i]));
+  }
+}
+
+static void time_tables(const char *label,
+                        std::vector<Region*> const& regions,
+                        std::vector<Posn> const& q)
+{
+  std::unordered_map<Posn, Region*, OldPosnHash, Posn::cmp> old_map;
+  std::unordered_map<Posn, Region*, Posn::hash, Posn::cmp> new_map;
+  RegionTable<Region*> table;
+  fill_table(&old_map, regions);
+  fill_table(&new_map, regions);
+  fill_table(&table, regions);
+
+  long s0, s1, s2;
+  long t0 = time_table(&old_map, q, &s0);
+  long t1 = time_table(&new_map, q, &s1);
+  long t2 = time_table(&table, q, &s2);
+  if ((s0 != s1) || (s0 != s2)) {
+    printf("  tables disagree! %ld %ld %ld\n", s0, s1, s2);
+    exit(1);
+  }
+  printf("  %-8s  old hash %6.1f ns   new hash %6.1f ns   table %6.1f ns\n",
+         label,
+         t0 * 1.0e3 / q.size(),
+         t1 * 1.0e3 / q.size(),
+         t2 * 1.0e3 / q.size());
+}
+
+static void bench_table(void)
+{
+  srandom(7);
+  std::vector<Region*> regions;
+  for (int ry=-TABLE_SIDE/2; ry<TABLE_SIDE/2; ry++) {
+    for (int rx=-TABLE_SIDE/2; rx<TABLE_SIDE/2; rx++) {
+      Region *r = new Region();
+      r->origin = Posn(rx * REGION_SIZE, ry * REGION_SIZE);
+      r->basement = random() % 100;
+      regions.push_back(r);
+    }
+  }
+
+  // the table has to behave like a map through erases and reinserts
+  RegionTable<Region*> t;
+  std::unordered_map<Posn, Region*, Posn::hash, Posn::cmp> m;
+  for (int i=0; i<200000; i++) {
+    Region *r = regions[random() % regions.size()];
+    switch (random() % 3) {
+    case 0:
+      t.insert(RegionTable<Region*>::value_type(r->origin, r));
+      m.insert(std::make_pair(r->origin, r));
+      break;
+    case 1:
+      t.erase(r->origin);
+      m.erase(r->origin);
+      break;
+    case 2:
+      if ((t.find(r->origin) == t.end()) != (m.find(r->origin) == m.end())) {
+        printf("  table lost track of (%d,%d)\n", r->origin.x, r->origin.y);
+        exit(1);
+      }
+      break;
+    }
+  }
+  size_t n = 0;
+  for (RegionTable<Region*>::iterator i=t.begin(); i!=t.end(); ++i) {
+    n++;
+  }
+  if ((n != m.size()) || (t.size() != m.size())) {
+    printf("  table has %zu (iterates %zu), should have %zu\n",
+           t.size(), n, m.size());
+    exit(1);
+  }
+
+  int lo = -TABLE_SIDE/2 * REGION_SIZE;
+  int span = TABLE_SIDE * REGION_SIZE;
+  std::vector<Posn> walk(TABLE_LOOKUPS), scatter(TABLE_LOOKUPS);
+  int x = 0, y = 0;
+  for (int i=0; i<TABLE_LOOKUPS; i++) {
+    x += (random() % 3) - 1;
+    y += (random() % 3) - 1;
+    x = (x < lo) ? lo : ((x >= lo + span) ? lo + span - 1 : x);
+    y = (y < lo) ? lo : ((y >= lo + span) ? lo + span - 1 : y);
+    walk[i] = Posn(x & ~(REGION_SIZE-1), y & ~(REGION_SIZE-1));
+
+    // widen the range by a tenth to get the misses
+    int sx = lo + random() % (span + span/10);
+    int sy = lo + random() % span;
+    scatter[i] = Posn(sx & ~(REGION_SIZE-1), sy & ~(REGION_SIZE-1));
+  }
+
+  printf("region table, %zu regions:\n", regions.size());
+  time_tables("walk", regions, walk);
+  time_tables("scatter", regions, scatter);
+  for (size_t i=0; i<regions.size(); i++) {
+    delete regions[i];
+  }
+}
+
+struct Benchmark {
+  const char   *name;
+  void        (*fn)(void);
+};
+
+static const Benchmark benchmarks[] = {
+  { "columns", bench_columns },
+  { "expand", bench_expand },
+  { "lookup", bench_lookup },
+  { "edit", bench_edit },
+  { "spanarray", bench_spanarray },
+  { "table", bench_table },
+  { NULL, NULL }
+};
+
+int main(int argc, char *argv[])
+{
+  for (const Benchmark *b=&benchmarks[0]; b->name; b++) {
+    if ((argc < 2) || (strcmp(argv[1], b->name) == 0)) {
+      b->fn();
+    }
+  }
+  return 0;
+}
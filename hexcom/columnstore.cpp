@@ -0,0 +1,175 @@
+#include <string.h>
+#include <assert.h>
+#include <algorithm>
+#include "region.h"
+
+// how much room to leave for growth when a column gets relocated
+#define COLUMN_HEADROOM         (2)
+
+// columns shorter than this are faster to walk than to index
+#define SPAN_INDEX_MIN          (128)
+
+ColumnStore::ColumnStore()
+  : cs_garbage(0)
+{
+  memset(&cs_slot[0][0], 0, sizeof(cs_slot));
+  memset(&cs_indexed[0], 0, sizeof(cs_indexed));
+}
+
+void ColumnStore::relocate(Slot *s, unsigned need)
+{
+  unsigned cap = need + COLUMN_HEADROOM;
+  assert(cap <= 0xFFFF);
+  size_t at = cs_arena.size();
+  cs_arena.resize(at + cap);
+  if (s->count) {
+    memcpy(&cs_arena[at], &cs_arena[s->offset], s->count * sizeof(Span));
+  }
+  cs_garbage += s->capacity;
+  s->offset = at;
+  s->capacity = cap;
+}
+
+void ColumnStore::push_back(int x, int y, Span const& span)
+{
+  Slot *s = &cs_slot[y][x];
+
+  invalidate(x, y);
+  assert(s->count < 0xFFFF);
+  if (s->count < s->capacity) {
+    cs_arena[s->offset + s->count++] = span;
+    return;
+  }
+  if (s->capacity == 0) {
+    s->offset = cs_arena.size();
+  } else if (s->offset + s->capacity != cs_arena.size()) {
+    // full, and not at the end of the arena; it has to move
+    relocate(s, s->count + 1);
+    cs_arena[s->offset + s->count++] = span;
+    return;
+  }
+  // we're at the end of the arena, so we can grow in place
+  cs_arena.push_back(span);
+  s->count++;
+  s->capacity++;
+}
+
+void ColumnStore::assign(int x, int y, Span const *spans, unsigned n)
+{
+  Slot *s = &cs_slot[y][x];
+
+  invalidate(x, y);
+  if (n > s->capacity) {
+    Span const *arena0 = cs_arena.data();
+    if ((spans >= arena0) && (spans < arena0 + cs_arena.size())) {
+      // the source is in the arena, which may get reallocated
+      SpanVector tmp(spans, spans + n);
+      assign(x, y, tmp);
+      return;
+    }
+    if (s->capacity && (s->offset + s->capacity == cs_arena.size())) {
+      // at the end of the arena, so we can grow in place
+      cs_arena.resize(s->offset + n);
+      s->capacity = n;
+    } else {
+      s->count = 0;
+      relocate(s, n);
+    }
+  }
+  if (n) {
+    memmove(&cs_arena[s->offset], spans, n * sizeof(Span));
+  }
+  s->count = n;
+
+  if (cs_garbage > cs_arena.size() / 2) {
+    compact();
+  }
+}
+
+void ColumnStore::compact()
+{
+  size_t n = 0;
+  for (int y=0; y<REGION_SIZE; y++) {
+    for (int x=0; x<REGION_SIZE; x++) {
+      n += cs_slot[y][x].count;
+    }
+  }
+
+  std::vector<Span> fresh;
+  fresh.reserve(n);
+  for (int y=0; y<REGION_SIZE; y++) {
+    for (int x=0; x<REGION_SIZE; x++) {
+      Slot *s = &cs_slot[y][x];
+      size_t at = fresh.size();
+      fresh.insert(fresh.end(),
+                   cs_arena.begin() + s->offset,
+                   cs_arena.begin() + s->offset + s->count);
+      s->offset = at;
+      s->capacity = s->count;
+    }
+  }
+  cs_arena.swap(fresh);
+  cs_garbage = 0;
+  // the indexes are cheap to rebuild on demand
+  memset(&cs_indexed[0], 0, sizeof(cs_indexed));
+  std::vector<uint32_t>().swap(cs_prefix);
+}
+
+int ColumnStore::find(int x, int y, int z, int *bottom)
+{
+  Slot *s = &cs_slot[y][x];
+  Span const *col = cs_arena.data() + s->offset;
+
+  if (z < 0) {
+    *bottom = 0;
+    return 0;
+  }
+  if (s->count < SPAN_INDEX_MIN) {
+    int b = 0;
+    for (int i=0; i<s->count; i++) {
+      int t = b + col[i].height;
+      if (z < t) {
+        *bottom = b;
+        return i;
+      }
+      b = t;
+    }
+    *bottom = b;
+    return s->count;
+  }
+
+  if (!(cs_indexed[y] & (1U << x))) {
+    if (cs_prefix.size() < cs_arena.size()) {
+      cs_prefix.resize(cs_arena.size());
+    }
+    uint32_t t = 0;
+    for (int i=0; i<s->count; i++) {
+      t += col[i].height;
+      cs_prefix[s->offset + i] = t;
+    }
+    cs_indexed[y] |= (1U << x);
+  }
+
+  // the first span whose top is above z is the one containing it
+  uint32_t const *top = cs_prefix.data() + s->offset;
+  int i = std::upper_bound(top, top + s->count, (uint32_t)z) - top;
+  *bottom = i ? top[i-1] : 0;
+  return i;
+}
+
+size_t ColumnStore::bytes() const
+{
+  return sizeof(*this)
+    + cs_arena.capacity() * sizeof(Span)
+    + cs_prefix.capacity() * sizeof(uint32_t);
+}
+
+int spanAtZ(Region *rgn, int x, int y, int z, int *bottom)
+{
+  int b;
+  int i = rgn->columns.find(x, y, z - rgn->basement, &b);
+  if (bottom) {
+    *bottom = b + rgn->basement;
+  }
+  return i;
+}
@@ -0,0 +1,193 @@
+#include <string.h>
+#include <stdio.h>
+#include <assert.h>
+#include "region.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define HAVE_X86_KERNELS        (1)
+#endif
+
+/**
+ *   The expansion is a sequence of constant-byte fills, one per span.
+ *   Spans are usually only a few units tall, so instead of a memset()
+ *   per span the vector kernels just splat whole registers and let the
+ *   next span overwrite the excess (hence EXPAND_SLOP)
+ */
+
+// past this, memset() is as good as it gets
+#define FILL_BIG        (128)
+
+struct ScalarFill {
+  static inline void fill(unsigned char *p, unsigned char v, int n) {
+    memset(p, v, n);
+  }
+};
+
+#if HAVE_X86_KERNELS
+struct SSE2Fill {
+  static inline __attribute__((target("sse2")))
+  void fill(unsigned char *p, unsigned char v, int n) {
+    if (n > FILL_BIG) {
+      memset(p, v, n);
+      return;
+    }
+    __m128i x = _mm_set1_epi8(v);
+    _mm_storeu_si128((__m128i *)p, x);
+    for (int i=16; i<n; i+=16) {
+      _mm_storeu_si128((__m128i *)(p + i), x);
+    }
+  }
+};
+
+struct AVX2Fill {
+  static inline __attribute__((target("avx2")))
+  void fill(unsigned char *p, unsigned char v, int n) {
+    if (n > FILL_BIG) {
+      memset(p, v, n);
+      return;
+    }
+    __m256i x = _mm256_set1_epi8(v);
+    _mm256_storeu_si256((__m256i *)p, x);
+    for (int i=32; i<n; i+=32) {
+      _mm256_storeu_si256((__m256i *)(p + i), x);
+    }
+  }
+};
+#endif
+
+template <typename Fill>
+static inline void expand_batch(int basement,
+                                SpanColumn const *cols, int ncols,
+                                int z_base, int h, int stride,
+                                unsigned char *types,
+                                unsigned char *flags)
+{
+  for (int k=0; k<ncols; k++, types += stride) {
+    // spans are contiguous from the basement up, so every byte
+    // of [0,h) gets written exactly once, in order
+    int at = 0;
+    int z = basement - z_base;
+    if (z > 0) {
+      at = (z < h) ? z : h;
+      Fill::fill(types, 0, at);
+      if (flags) {
+        Fill::fill(flags, 0, at);
+      }
+    }
+    for (SpanColumn::const_iterator i=cols[k].begin();
+         (i != cols[k].end()) && (at < h);
+         ++i) {
+      z += i->height;
+      if (z > at) {
+        int n = ((z < h) ? z : h) - at;
+        Fill::fill(&types[at], i->type, n);
+        if (flags) {
+          Fill::fill(&flags[at], i->flags, n);
+        }
+        at += n;
+      }
+    }
+    if (at < h) {
+      Fill::fill(&types[at], 0, h - at);
+      if (flags) {
+        Fill::fill(&flags[at], 0, h - at);
+      }
+    }
+    if (flags) {
+      flags += stride;
+    }
+  }
+}
+
+typedef void ExpandFn(int basement,
+                      SpanColumn const *cols, int ncols,
+                      int z_base, int h, int stride,
+                      unsigned char *types,
+                      unsigned char *flags);
+
+static void expand_scalar(int basement,
+                          SpanColumn const *cols, int ncols,
+                          int z_base, int h, int stride,
+                          unsigned char *types,
+                          unsigned char *flags)
+{
+  expand_batch<ScalarFill>(basement, cols, ncols, z_base, h, stride, types, flags);
+}
+
+#if HAVE_X86_KERNELS
+// flatten pulls the fills inline despite their target attributes
+__attribute__((target("sse2"), flatten))
+static void expand_sse2(int basement,
+                        SpanColumn const *cols, int ncols,
+                        int z_base, int h, int stride,
+                        unsigned char *types,
+                        unsigned char *flags)
+{
+  expand_batch<SSE2Fill>(basement, cols, ncols, z_base, h, stride, types, flags);
+}
+
+__attribute__((target("avx2"), flatten))
+static void expand_avx2(int basement,
+                        SpanColumn const *cols, int ncols,
+                        int z_base, int h, int stride,
+                        unsigned char *types,
+                        unsigned char *flags)
+{
+  expand_batch<AVX2Fill>(basement, cols, ncols, z_base, h, stride, types, flags);
+}
+#endif
+
+static ExpandFn *expand_kernel = NULL;
+static const char *expand_kernel_name = NULL;
+
+const char *setExpandKernel(int which)
+{
+  // never hand out a kernel this CPU can't run
+  int best = EXPAND_SCALAR;
+#if HAVE_X86_KERNELS
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) {
+    best = EXPAND_AVX2;
+  } else if (__builtin_cpu_supports("sse2")) {
+    best = EXPAND_SSE2;
+  }
+#endif
+  if (which == EXPAND_AUTO) {
+    // (built -O2, the sse2 kernel is no faster than the scalar one;
+    // see "benchregion expand")
+    which = (best == EXPAND_AVX2) ? EXPAND_AVX2 : EXPAND_SCALAR;
+  } else if (which > best) {
+    which = best;
+  }
+
+  switch (which) {
+#if HAVE_X86_KERNELS
+  case EXPAND_SSE2:
+    expand_kernel = expand_sse2;
+    expand_kernel_name = "sse2";
+    break;
+  case EXPAND_AVX2:
+    expand_kernel = expand_avx2;
+    expand_kernel_name = "avx2";
+    break;
+#endif
+  default:
+    expand_kernel = expand_scalar;
+    expand_kernel_name = "scalar";
+    break;
+  }
+  return expand_kernel_name;
+}
+
+void expandColumns(Region *rgn, SpanColumn const *cols, int ncols,
+                   int z_base, int h, int stride,
+                   unsigned char *types,
+                   unsigned char *flags)
+{
+  if (!expand_kernel) {
+    setExpandKernel(EXPAND_AUTO);
+  }
+  assert(stride >= h + EXPAND_SLOP);
+  expand_kernel(rgn->basement, cols, ncols, z_base, h, stride, types, flags);
+}
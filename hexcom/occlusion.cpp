@@ -0,0 +1,313 @@
+#include <math.h>
+#include <float.h>
+#include <algorithm>
+#include "hex.h"
+#include "occlusion.h"
+
+/**
+ *  The planes come from the rows of the matrix (after Gribb and
+ *  Hartmann): a point is inside if it is inside -w <= x,y,z <= w in
+ *  clip space, and each of those is a plane in world space
+ */
+void Frustum::extract(glm::mat4 const& vp)
+{
+  glm::vec4 row[4];
+  for (int i=0; i<4; i++) {
+    row[i] = glm::vec4(vp[0][i], vp[1][i], vp[2][i], vp[3][i]);
+  }
+  planes[0] = row[3] + row[0];  // left
+  planes[1] = row[3] - row[0];  // right
+  planes[2] = row[3] + row[1];  // bottom
+  planes[3] = row[3] - row[1];  // top
+  planes[4] = row[3] + row[2];  // near
+  planes[5] = row[3] - row[2];  // far
+}
+
+bool Frustum::visible(frect const& box) const
+{
+  for (int i=0; i<6; i++) {
+    glm::vec4 const& p(planes[i]);
+    // the corner of the box furthest along the plane's normal
+    float x = (p.x > 0) ? box.x1 : box.x0;
+    float y = (p.y > 0) ? box.y1 : box.y0;
+    float z = (p.z > 0) ? box.z1 : box.z0;
+    if (p.x * x + p.y * y + p.z * z + p.w < 0) {
+      return false;
+    }
+  }
+  return true;
+}
+
+void occlusion_begin(OcclusionBuffer *ob, glm::mat4 const& vp)
+{
+  ob->ob_vp = vp;
+  ob->ob_frustum.extract(vp);
+  ob->ob_occluders = 0;
+  for (int y=0; y<OCCLUSION_H; y++) {
+    for (int x=0; x<OCCLUSION_W; x++) {
+      ob->ob_depth[y][x] = FLT_MAX;
+    }
+  }
+}
+
+// a vertex on the screen: x and y in pixels, z in NDC
+struct ScreenPoint {
+  float x, y, z;
+};
+
+static ScreenPoint to_screen(glm::vec4 const& c)
+{
+  ScreenPoint s;
+  s.x = (c.x / c.w * 0.5f + 0.5f) * OCCLUSION_W;
+  s.y = (c.y / c.w * 0.5f + 0.5f) * OCCLUSION_H;
+  s.z = c.z / c.w;
+  return s;
+}
+
+// the corner of the box picked out by the low three bits of i
+static glm::vec4 box_corner(frect const& box, int i)
+{
+  return glm::vec4((i & 1) ? box.x1 : box.x0,
+                   (i & 2) ? box.y1 : box.y0,
+                   (i & 4) ? box.z1 : box.z0,
+                   1);
+}
+
+/**
+ *  Draw a convex polygon, if it faces us: every pixel with its center
+ *  inside gets the polygon's farthest depth across the pixel, unless
+ *  something nearer is there already
+ */
+static void draw_polygon(OcclusionBuffer *ob, ScreenPoint const *p, int n)
+{
+  // find the widest triangle in it (from p[0]) to take the plane of
+  // the depth from
+  float area = 0;
+  float best = 0;
+  int k = 0;
+  for (int i=1; i+1<n; i++) {
+    float t = (p[i].x - p[0].x) * (p[i+1].y - p[0].y)
+      - (p[i].y - p[0].y) * (p[i+1].x - p[0].x);
+    area += t;
+    if (t > best) {
+      best = t;
+      k = i;
+    }
+  }
+  if ((area <= 0) || (best < 1.0e-6f)) {
+    return;             // facing away, or edge on
+  }
+
+  ScreenPoint const& a(p[0]);
+  ScreenPoint const& b(p[k]);
+  ScreenPoint const& c(p[k+1]);
+  float dzdx = ((b.z - a.z) * (c.y - a.y) - (c.z - a.z) * (b.y - a.y)) / best;
+  float dzdy = ((c.z - a.z) * (b.x - a.x) - (b.z - a.z) * (c.x - a.x)) / best;
+
+  float x0 = p[0].x, x1 = p[0].x, y0 = p[0].y, y1 = p[0].y;
+  for (int i=1; i<n; i++) {
+    x0 = std::min(x0, p[i].x);
+    x1 = std::max(x1, p[i].x);
+    y0 = std::min(y0, p[i].y);
+    y1 = std::max(y1, p[i].y);
+  }
+  // the pixels with centers in the bounds
+  int px0 = std::max((int)ceilf(x0 - 0.5f), 0);
+  int px1 = std::min((int)floorf(x1 - 0.5f), OCCLUSION_W - 1);
+  int py0 = std::max((int)ceilf(y0 - 0.5f), 0);
+  int py1 = std::min((int)floorf(y1 - 0.5f), OCCLUSION_H - 1);
+
+  for (int py=py0; py<=py1; py++) {
+    float cy = py + 0.5f;
+    for (int px=px0; px<=px1; px++) {
+      float cx = px + 0.5f;
+      bool inside = true;
+      for (int i=0; inside && (i<n); i++) {
+        ScreenPoint const& u(p[i]);
+        ScreenPoint const& v(p[(i+1) % n]);
+        inside = ((v.x - u.x) * (cy - u.y) - (v.y - u.y) * (cx - u.x) >= 0);
+      }
+      if (!inside) {
+        continue;
+      }
+      float z = a.z
+        + dzdx * (px + ((dzdx > 0) ? 1 : 0) - a.x)
+        + dzdy * (py + ((dzdy > 0) ? 1 : 0) - a.y);
+      if (z < ob->ob_depth[py][px]) {
+        ob->ob_depth[py][px] = z;
+      }
+    }
+  }
+}
+
+// the corners of each face of a box, as box_corner() indices, going
+// counterclockwise seen from outside
+static const int box_faces[6][4] = {
+  { 0, 2, 3, 1 },       // bottom
+  { 4, 5, 7, 6 },       // top
+  { 0, 1, 5, 4 },       // south
+  { 2, 6, 7, 3 },       // north
+  { 0, 4, 6, 2 },       // west
+  { 1, 3, 7, 5 },       // east
+};
+
+void occlusion_add_occluder(OcclusionBuffer *ob, frect const& box)
+{
+  if (!ob->ob_frustum.visible(box)) {
+    return;
+  }
+  glm::vec4 clip[8];
+  for (int i=0; i<8; i++) {
+    clip[i] = ob->ob_vp * box_corner(box, i);
+  }
+  for (int f=0; f<6; f++) {
+    // clip the face to the near plane (z >= -w), which can add a
+    // corner to it
+    ScreenPoint p[5];
+    int n = 0;
+    for (int i=0; i<4; i++) {
+      glm::vec4 const& u(clip[box_faces[f][i]]);
+      glm::vec4 const& v(clip[box_faces[f][(i+1) % 4]]);
+      float du = u.z + u.w;
+      float dv = v.z + v.w;
+      if (du >= 0) {
+        p[n++] = to_screen(u);
+      }
+      if ((du >= 0) != (dv >= 0)) {
+        p[n++] = to_screen(u + (v - u) * (du / (du - dv)));
+      }
+    }
+    if (n >= 3) {
+      draw_polygon(ob, p, n);
+    }
+  }
+  ob->ob_occluders++;
+}
+
+void occlusion_end(OcclusionBuffer *ob)
+{
+  for (int ty=0; ty<OCCLUSION_TILES_H; ty++) {
+    for (int tx=0; tx<OCCLUSION_TILES_W; tx++) {
+      float z = -FLT_MAX;
+      for (int y=ty*OCCLUSION_TILE; y<(ty+1)*OCCLUSION_TILE; y++) {
+        for (int x=tx*OCCLUSION_TILE; x<(tx+1)*OCCLUSION_TILE; x++) {
+          z = std::max(z, ob->ob_depth[y][x]);
+        }
+      }
+      ob->ob_tile[ty][tx] = z;
+    }
+  }
+}
+
+bool occlusion_visible(OcclusionBuffer const *ob, frect const& box)
+{
+  if (!ob->ob_occluders) {
+    return true;
+  }
+  float x0 = FLT_MAX, x1 = -FLT_MAX, y0 = FLT_MAX, y1 = -FLT_MAX;
+  float z0 = FLT_MAX;
+  for (int i=0; i<8; i++) {
+    glm::vec4 c = ob->ob_vp * box_corner(box, i);
+    if (c.z + c.w < 0) {
+      return true;      // reaching past the near plane, so not behind anything
+    }
+    ScreenPoint s = to_screen(c);
+    x0 = std::min(x0, s.x);
+    x1 = std::max(x1, s.x);
+    y0 = std::min(y0, s.y);
+    y1 = std::max(y1, s.y);
+    z0 = std::min(z0, s.z);
+  }
+  // every pixel the box touches at all
+  int px0 = std::max((int)floorf(x0), 0);
+  int px1 = std::min((int)ceilf(x1), OCCLUSION_W);
+  int py0 = std::max((int)floorf(y0), 0);
+  int py1 = std::min((int)ceilf(y1), OCCLUSION_H);
+  if ((px0 >= px1) || (py0 >= py1)) {
+    return true;        // off the screen; that's for the frustum to say
+  }
+
+  // only look at the pixels of tiles that aren't entirely nearer
+  for (int ty=py0/OCCLUSION_TILE; ty<=(py1-1)/OCCLUSION_TILE; ty++) {
+    for (int tx=px0/OCCLUSION_TILE; tx<=(px1-1)/OCCLUSION_TILE; tx++) {
+      if (ob->ob_tile[ty][tx] < z0) {
+        continue;
+      }
+      int ya = std::max(py0, ty*OCCLUSION_TILE);
+      int yb = std::min(py1, (ty+1)*OCCLUSION_TILE);
+      int xa = std::max(px0, tx*OCCLUSION_TILE);
+      int xb = std::min(px1, (tx+1)*OCCLUSION_TILE);
+      for (int y=ya; y<yb; y++) {
+        for (int x=xa; x<xb; x++) {
+          if (ob->ob_depth[y][x] >= z0) {
+            return true;
+          }
+        }
+      }
+    }
+  }
+  return false;
+}
+
+// is this span solid ground (see is_solid() in terrainmesh.cpp)?
+static inline bool solid_span(Span const& s)
+{
+  return (s.type != 0) && (s.type != 240);
+}
+
+int region_occluders(Region *rgn, frect *boxes)
+{
+  // the lowest any column gets before it stops being solid, in each
+  // cell of the grid and in the columns around it (whose hexes reach
+  // a little way into the cell)
+  const int n = REGION_SIZE / OCCLUDER_CELL;
+  int solid[REGION_SIZE / OCCLUDER_CELL][REGION_SIZE / OCCLUDER_CELL];
+  for (int j=0; j<n; j++) {
+    for (int i=0; i<n; i++) {
+      solid[j][i] = -1;
+    }
+  }
+  for (int y=0; y<REGION_SIZE; y++) {
+    for (int x=0; x<REGION_SIZE; x++) {
+      SpanColumn col(rgn->column(x, y));
+      int h = 0;
+      for (SpanColumn::const_iterator j=col.begin(); (j!=col.end()) && solid_span(*j); ++j) {
+        h += j->height;
+      }
+      int j0 = std::max((y - 1) / OCCLUDER_CELL, 0);
+      int j1 = std::min((y + 1) / OCCLUDER_CELL, n - 1);
+      int i0 = std::max((x - 1) / OCCLUDER_CELL, 0);
+      int i1 = std::min((x + 1) / OCCLUDER_CELL, n - 1);
+      for (int j=j0; j<=j1; j++) {
+        for (int i=i0; i<=i1; i++) {
+          if ((solid[j][i] < 0) || (h < solid[j][i])) {
+            solid[j][i] = h;
+          }
+        }
+      }
+    }
+  }
+
+  // the cells tile the plane with those of the regions next door,
+  // taking the hexes along the region's jagged edges half and half;
+  // so the ones along the edges reach a little way (less than half a
+  // hex) over columns of the regions next door
+  double x0 = hex_x(rgn->origin.x, rgn->origin.y) + x_stride / 4;
+  double y0 = hex_y(rgn->origin.x, rgn->origin.y) - a / 2;
+  int k = 0;
+  for (int j=0; j<n; j++) {
+    for (int i=0; i<n; i++) {
+      if (solid[j][i] <= 0) {
+        continue;
+      }
+      frect& box(boxes[k++]);
+      box.x0 = x0 + i * OCCLUDER_CELL * x_stride;
+      box.x1 = x0 + (i + 1) * OCCLUDER_CELL * x_stride;
+      box.y0 = y0 + j * OCCLUDER_CELL * y_stride;
+      box.y1 = y0 + (j + 1) * OCCLUDER_CELL * y_stride;
+      box.z0 = rgn->basement * z_scale;
+      box.z1 = (rgn->basement + solid[j][i]) * z_scale;
+    }
+  }
+  return k;
+}
@@ -0,0 +1,75 @@
+#ifndef _H_HEXCOM_OCCLUSION
+#define _H_HEXCOM_OCCLUSION
+
+#include <glm/glm.hpp>
+#include "region.h"
+#include "pick.h"
+
+/**
+ *   The six planes bounding what the camera sees, each as a normal
+ *   pointing inward and a distance, taken from the view-projection
+ *   matrix once a frame
+ */
+struct Frustum {
+  glm::vec4             planes[6];
+  void extract(glm::mat4 const& vp);
+  // false if the box is entirely outside
+  bool visible(frect const& box) const;
+};
+
+/**
+ *   Occlusion culling on the CPU, of what the frustum leaves.  A
+ *   coarse depth buffer covering the screen is filled in from a few
+ *   nearby occluders (boxes known to be solid all the way through),
+ *   and then a region's bounding box is hidden if every pixel it
+ *   could cover is already nearer than the nearest point of the box.
+ *   An occluder covers the pixels whose centers it covers, with the
+ *   farthest depth it has across each one, so it's conservative but
+ *   for part of a pixel along the edges of the occluders.
+ *
+ *   Over the depth buffer there is a second level of tiles, each
+ *   holding the farthest depth of its pixels, so most boxes can be
+ *   found hidden (or not) without looking at the pixels themselves.
+ *   None of this touches GL, so it runs in bench_occlusion as well as
+ *   in the client.
+ */
+
+#define OCCLUSION_W             (128)
+#define OCCLUSION_H             (64)
+#define OCCLUSION_TILE          (8)     // pixels on a side of a tile
+#define OCCLUSION_TILES_W       (OCCLUSION_W / OCCLUSION_TILE)
+#define OCCLUSION_TILES_H       (OCCLUSION_H / OCCLUSION_TILE)
+// regions this close to the camera's (in regions, along x or y
+// whichever is farther) are drawn as occluders
+#define OCCLUDER_REGIONS        (1)
+
+struct OcclusionBuffer {
+  glm::mat4     ob_vp;                  // view-projection it's drawn with
+  Frustum       ob_frustum;             // of ob_vp
+  unsigned      ob_occluders;           // drawn since occlusion_begin()
+  float         ob_depth[OCCLUSION_H][OCCLUSION_W];     // NDC z
+  float         ob_tile[OCCLUSION_TILES_H][OCCLUSION_TILES_W];  // farthest in each
+};
+
+// start a frame seen through vp, with nothing hidden
+void occlusion_begin(OcclusionBuffer *ob, glm::mat4 const& vp);
+// draw a solid box into the depth buffer (unless it's out of sight)
+void occlusion_add_occluder(OcclusionBuffer *ob, frect const& box);
+// build the tiles; do it after the last occluder and before testing
+void occlusion_end(OcclusionBuffer *ob);
+// false if the box is entirely behind the occluders
+bool occlusion_visible(OcclusionBuffer const *ob, frect const& box);
+
+/**
+ *   The boxes of ground under a region that are solid throughout, one
+ *   for each OCCLUDER_CELL by OCCLUDER_CELL columns: from the basement
+ *   up to where the first column in the cell stops being solid.  A
+ *   cell with no such ground (as when a column is empty, or starts
+ *   with water) has no box.  Fills in boxes[] and returns how many.
+ */
+#define OCCLUDER_CELL           (8)
+#define REGION_OCCLUDERS        ((REGION_SIZE / OCCLUDER_CELL) * (REGION_SIZE / OCCLUDER_CELL))
+
+int region_occluders(Region *rgn, frect *boxes);
+
+#endif /* _H_HEXCOM_OCCLUSION */
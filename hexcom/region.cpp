@@ -1,9 +1,10 @@
 #include <string.h>
+#include <algorithm>
 #include "region.h"
 
 #include "spanvec.cpp"
 
-void expandSpan(Region *rgn, SpanVector const& vec, int z_start, int h,
+void expandSpan(Region *rgn, SpanColumn const& col, int z_start, int h,
                 unsigned char *types,
                 unsigned char *flags)
 {
@@ -15,8 +16,8 @@ void expandSpan(Region *rgn, SpanVector const& vec, int z_start, int h,
   if (flags) {
     memset(flags, 0, h);
   }
-  for (SpanVector::const_iterator i = vec.begin();
-       i != vec.end();
+  for (SpanColumn::const_iterator i = col.begin();
+       i != col.end();
        ++i) {
     int z1 = z0 + i->height;
     if ((z0 < z_limit) && (z1 > z_start)) {
@@ -63,32 +64,42 @@ static inline char blocktypechar(uint8_t t)
   }
 }
 
+bool region_edit_verbose = false;
+
+static void dump_column(const char *label, Region *rgn, int ix, int iy, int z)
+{
+  unsigned char buf[64 + EXPAND_SLOP];
+  SpanColumn col(rgn->column(ix, iy));
+  expandColumns(rgn, &col, 1, z-32, 64, sizeof(buf), &buf[0], NULL);
+
+  printf("%s: ", label);
+  for (int i=0; i<64; i++) {
+    putchar(blocktypechar(buf[i]));
+  }
+  printf("\n");
+}
+
 int Region::set(int x, int y, int z, int height, int type, int flags)
 {
   int ix = x - origin.x;
   int iy = y - origin.y;
   int iz = z - basement;
 
-  printf("dset(%d,%d) at %d for %d to %d (flags %d)\n",
-         ix, iy, iz, height, type, flags);
+  if (region_edit_verbose) {
+    printf("dset(%d,%d) at %d for %d to %d (flags %d)\n",
+           ix, iy, iz, height, type, flags);
+  }
   if ((ix < 0) || (ix >= REGION_SIZE) || (iy < 0) || (iy >= REGION_SIZE)) {
     return -1;
   }
 
-  {
-    unsigned char buf[64];
-    expandSpan(this, columns[iy][ix], z-32, 64, &buf[0], NULL);
-
+  if (region_edit_verbose) {
     printf("        ");
     for (int i=0; i<64; i++) {
       putchar((i==32) ? '|' : ' ');
     }
     printf("\n");
-    printf("BEFORE: ");
-    for (int i=0; i<64; i++) {
-      putchar(blocktypechar(buf[i]));
-    }
-    printf("\n");
+    dump_column("BEFORE", this, ix, iy, z);
   }
 
   Span s;
@@ -96,18 +107,82 @@ int Region::set(int x, int y, int z, int height, int type, int flags)
   s.type = type;
   s.flags = flags;
 
-  insert_span(&columns[iy][ix], iz, s);
+  // edit a private copy and then store it back
+  SpanColumn col(column(ix, iy));
+  SpanVector vec(col.begin(), col.end());
+  insert_span(&vec, iz, s);
+  columns.assign(ix, iy, vec);
 
-  {
-    unsigned char buf[64];
-    expandSpan(this, columns[iy][ix], z-32, 64, &buf[0], NULL);
+  if (region_edit_verbose) {
+    dump_column(" AFTER", this, ix, iy, z);
+  }
+  return 0;
+}
 
-    printf(" AFTER: ");
-    for (int i=0; i<64; i++) {
-      putchar(blocktypechar(buf[i]));
+int Region::apply(SpanEdit const *edits, unsigned n)
+{
+  // bucket the edits by column; a counting sort keeps them in
+  // their original order within each column
+  unsigned start[REGION_SIZE*REGION_SIZE + 1];
+  memset(&start[0], 0, sizeof(start));
+  for (unsigned i=0; i<n; i++) {
+    unsigned ix = edits[i].x - origin.x;
+    unsigned iy = edits[i].y - origin.y;
+    if ((ix < REGION_SIZE) && (iy < REGION_SIZE)) {
+      start[iy*REGION_SIZE + ix + 1]++;
     }
-    printf("\n");
   }
+  for (int c=0; c<REGION_SIZE*REGION_SIZE; c++) {
+    start[c+1] += start[c];
+  }
+  unsigned count = start[REGION_SIZE*REGION_SIZE];
 
-  return 0;
+  std::vector<SpanInsert> ins(count);
+  unsigned fill[REGION_SIZE*REGION_SIZE];
+  memcpy(&fill[0], &start[0], sizeof(fill));
+  for (unsigned i=0; i<n; i++) {
+    unsigned ix = edits[i].x - origin.x;
+    unsigned iy = edits[i].y - origin.y;
+    if ((ix < REGION_SIZE) && (iy < REGION_SIZE)) {
+      SpanInsert *si = &ins[fill[iy*REGION_SIZE + ix]++];
+      si->bottom = edits[i].z - basement;
+      si->span.height = edits[i].height;
+      si->span.type = edits[i].type;
+      si->span.flags = edits[i].flags;
+    }
+  }
+
+  SpanVector vec;
+  for (int c=0; c<REGION_SIZE*REGION_SIZE; c++) {
+    if (start[c] == start[c+1]) {
+      continue;
+    }
+    int ix = c % REGION_SIZE;
+    int iy = c / REGION_SIZE;
+    SpanColumn col(column(ix, iy));
+    vec.assign(col.begin(), col.end());
+    insert_spans(&vec, &ins[start[c]], start[c+1] - start[c]);
+    columns.assign(ix, iy, vec);
+  }
+  return count;
+}
+
+int diffRegions(Region *a, Region *b, uint32_t *changed)
+{
+  bool all = (a->basement != b->basement);
+  int n = 0;
+  for (int y=0; y<REGION_SIZE; y++) {
+    changed[y] = 0;
+    for (int x=0; x<REGION_SIZE; x++) {
+      SpanColumn ca(a->column(x, y));
+      SpanColumn cb(b->column(x, y));
+      if (all
+          || (ca.size() != cb.size())
+          || memcmp(ca.begin(), cb.begin(), ca.size() * sizeof(Span))) {
+        changed[y] |= 1U << x;
+        n++;
+      }
+    }
+  }
+  return n;
 }
@@ -1,8 +1,10 @@
 #ifndef _H_HEXCOM_REGION
 #define _H_HEXCOM_REGION
 
+#include <stdio.h>
 #include <unordered_map>
 #include <vector>
+#include <stdint.h>
 #include "pick.h"
 
 /* flags */
@@ -37,12 +39,19 @@ struct Posn {
 
   int x;
   int y;
+  // region origins are multiples of REGION_SIZE, so hash the region
+  // index; the two halves go through murmur3's finalizer so that
+  // every bit of the result depends on every bit of both
   struct hash {
     unsigned operator()(Posn const& a) const {
-      return (a.x>>REGION_SIZE_BITS)
-        + (a.y>>REGION_SIZE_BITS)
-        + (0xFACE ^ (a.x >> 16))
-        + (0xCAFE ^ (((a.x|1) * (a.y|1)) >> 16));
+      uint64_t k = ((uint64_t)(uint32_t)(a.x >> REGION_SIZE_BITS) << 32)
+        | (uint32_t)(a.y >> REGION_SIZE_BITS);
+      k ^= k >> 33;
+      k *= 0xff51afd7ed558ccdULL;
+      k ^= k >> 33;
+      k *= 0xc4ceb9fe1a85ec53ULL;
+      k ^= k >> 33;
+      return (unsigned)k;
     }
   };
   struct cmp {
@@ -59,28 +68,205 @@ struct Posn {
 struct Region;
 typedef std::vector<Span> SpanVector;
 
+/**
+ *   A window onto the spans of one column in a ColumnStore.  It
+ *   iterates like a SpanVector, but it does not own anything; it is
+ *   good until the next edit of *any* column in the same region,
+ *   since an edit may move the underlying storage.
+ */
+
+struct SpanColumn {
+  typedef Span *iterator;
+  typedef Span const *const_iterator;
+
+  SpanColumn() : sc_begin(NULL), sc_end(NULL) { }
+  SpanColumn(Span *b, unsigned n) : sc_begin(b), sc_end(b+n) { }
+
+  Span *begin() const { return sc_begin; }
+  Span *end() const { return sc_end; }
+  size_t size() const { return sc_end - sc_begin; }
+  bool empty() const { return sc_begin == sc_end; }
+  Span& operator[](size_t i) const { return sc_begin[i]; }
+  Span& back() const { return sc_end[-1]; }
+
+  Span         *sc_begin;
+  Span         *sc_end;
+};
+
+/**
+ *   Span storage for all the columns of a region.  Rather than a
+ *   separate heap vector per column, all the spans live in one
+ *   contiguous arena in column order, and each column has a slot
+ *   giving its offset, length and capacity within the arena.
+ *
+ *   Edits are copy-on-write: a column which outgrows its capacity
+ *   is copied to the end of the arena, leaving a hole behind.  When
+ *   the holes add up to more than half the arena, it is compacted.
+ *
+ *   Deep columns also get an index of cumulative span heights, built
+ *   the first time somebody asks find() about them and thrown away by
+ *   any edit, so that looking up the span at a given z is a binary
+ *   search instead of a walk up the column.
+ */
+
+struct ColumnStore {
+  ColumnStore();
+
+  SpanColumn get(int x, int y) {
+    Slot const& s(cs_slot[y][x]);
+    return SpanColumn(cs_arena.data() + s.offset, s.count);
+  }
+
+  // add a span to the top of a column; decoding a region in column
+  // order this way just appends to the arena
+  void push_back(int x, int y, Span const& span);
+  // replace the contents of a column
+  void assign(int x, int y, Span const *spans, unsigned n);
+  void assign(int x, int y, SpanVector const& vec) {
+    assign(x, y, vec.data(), vec.size());
+  }
+  // find the span containing z (relative to the basement) and the
+  // z of its bottom; returns the column size if z is above the top
+  int find(int x, int y, int z, int *bottom);
+  // squeeze out the holes left behind by edits
+  void compact();
+  // approximate number of bytes of memory in use
+  size_t bytes() const;
+
+private:
+  struct Slot {
+    uint32_t    offset;
+    uint16_t    count;
+    uint16_t    capacity;
+  };
+  void relocate(Slot *s, unsigned need);
+  void invalidate(int x, int y) {
+    cs_indexed[y] &= ~(1U << x);
+  }
+
+  std::vector<Span>     cs_arena;
+  Slot                  cs_slot[REGION_SIZE][REGION_SIZE];
+  unsigned              cs_garbage;     // number of arena entries in holes
+  std::vector<uint32_t> cs_prefix;      // top of each span, parallel to cs_arena
+  uint32_t              cs_indexed[REGION_SIZE];  // which columns have cs_prefix built
+};
+
+/**
+ *   One edit in a batch for Region::apply(); like the arguments
+ *   to Region::set(), these are in world coordinates
+ */
+
+struct SpanEdit {
+  int x, y, z;
+  unsigned short height;
+  unsigned char type;
+  unsigned char flags;
+};
+
 struct Region {
   Posn origin;          // coordinate of lower left (from top) column
   short basement;       // z0 for start of spans
-  // columns[Y][X]
-  SpanVector columns[REGION_SIZE][REGION_SIZE];
+  ColumnStore columns;
+  SpanColumn column(int x, int y) {
+    return columns.get(x, y);
+  }
   // the x,y,z given here are in world [integer] coordinates;
   // i.e., z=0 is sea level, and (x,y) better start within the region's origin
   // returns -1 on error
   int set(int x, int y, int z, int height, int type, int flags);
+  // apply a batch of edits, rebuilding each column they touch just
+  // once; edits to the same column take effect in the order given.
+  // returns the number of edits that landed in this region
+  int apply(SpanEdit const *edits, unsigned n);
 };
 
+// if set, Region::set() prints each edit and the column around it
+extern bool region_edit_verbose;
+
+/**
+ *   Compare two versions of a region column by column, setting bit x
+ *   of changed[y] (which has REGION_SIZE entries) for each column (x,y)
+ *   that differs; a change of basement changes every column.  Returns
+ *   the number of columns that differ.
+ */
+
+int diffRegions(Region *a, Region *b, uint32_t *changed);
+
 /**
- *   Expand a SpanVector in a given vertical region, starting at z_base
+ *   Expand a column in a given vertical region, starting at z_base
  *   and for distance h, into a flat vector of types and flags.  The flags
  *   may be NULL if that information is not sought.
  *   z_base is in absolute coordinates (i.e., 0=sea level)
  */
 
-void expandSpan(Region *rgn, SpanVector const& vec, int z_base, int h,
+void expandSpan(Region *rgn, SpanColumn const& col, int z_base, int h,
                 unsigned char *types,
                 unsigned char *flags);
 
+/**
+ *   Find the span in column (x,y) of a region (relative to the region's
+ *   origin) that contains the absolute height z, i.e., the one whose
+ *   bottom <= z < top.  Returns its index in the column, and the
+ *   absolute z of its bottom in *bottom (if not NULL).  A z below the
+ *   basement finds the first span; a z at or above the top of the column
+ *   returns the column's size, with *bottom being the top.
+ */
+
+int spanAtZ(Region *rgn, int x, int y, int z, int *bottom);
+
+/**
+ *   Expand a batch of columns (e.g., a column and its six neighbors)
+ *   over the same vertical region, in one pass.  Column k of the batch
+ *   lands at types[k*stride] (and flags[k*stride], if flags is not NULL).
+ *   The kernels write with wide stores that run past the end of each
+ *   column, so stride must be at least h + EXPAND_SLOP.  An empty
+ *   SpanColumn in the batch expands as all space.
+ */
+
+#define EXPAND_SLOP             (32)
+
+void expandColumns(Region *rgn, SpanColumn const *cols, int ncols,
+                   int z_base, int h, int stride,
+                   unsigned char *types,
+                   unsigned char *flags);
+
+/**
+ *   Select the kernel used by expandColumns(); EXPAND_AUTO picks avx2
+ *   if this CPU supports it and scalar otherwise, and asking for one
+ *   the CPU doesn't support gets the next best.  Returns the name of
+ *   the one selected.
+ */
+
+#define EXPAND_AUTO             (0)
+#define EXPAND_SCALAR           (1)
+#define EXPAND_SSE2             (2)
+#define EXPAND_AVX2             (3)
+
+const char *setExpandKernel(int which);
+
+/**
+ *   Read and write the spans of a region in the compact encoding used
+ *   for the spanarray of a wire::terrain::Terrain message: for each
+ *   column, in row order, a run of (height, type, flags) triples ended
+ *   by a zero byte.  A height byte of 0x7F means the real height
+ *   follows as two big-endian bytes.  Decoding appends to the region's
+ *   (presumably empty) columns, and fails if the array is truncated.
+ */
+
+bool decodeSpanArray(Region *rgn, unsigned char const *p, size_t len);
+void encodeSpanArray(Region *rgn, std::vector<unsigned char> *out);
+
+/**
+ *   Save a region to a file, and read it back, as a small header (its
+ *   origin, basement and the length of what follows) and its span
+ *   array; for recording regions to replay later (see bench_mesher).
+ *   Reading returns NULL at the end of the file, or if the record is
+ *   truncated.
+ */
+
+bool writeRegionRecord(FILE *f, Region *rgn);
+Region *readRegionRecord(FILE *f);
+
 PickerPtr makeRegionPicker(Region *rgn);
 
 /**
@@ -170,7 +170,7 @@ int RegionPicker::pick(glm::vec3 const& origin,
              cp[i].enter_range, cp[i].exit_range, 
              cp[i].dx, cp[i].dy);
     }
-    SpanVector const& sv(rp_region->columns[cp[i].dy][cp[i].dx]);
+    SpanColumn sv(rp_region->column(cp[i].dx, cp[i].dy));
     float z0, z1;
     int ze = cp[i].enter_z / z_scale - rp_region->basement;
     if (cp[i].enter_z > cp[i].exit_z) {
@@ -185,13 +185,26 @@ int RegionPicker::pick(glm::vec3 const& origin,
       printf("   checking %.3f - %.3f   ze=%d\n", z0, z1, ze);
     }
 
-    int span_bottom = 0;
-    unsigned jx = 0;
+    // skip straight to the spans that might overlap [z0,z1]; back up
+    // one in case the ray just grazes the top of the one below z0
+    int span_bottom;
+    unsigned jx = spanAtZ(rp_region, cp[i].dx, cp[i].dy,
+                          (int)floor(z0) + rp_region->basement,
+                          &span_bottom);
+    span_bottom -= rp_region->basement;
+    if (jx > 0) {
+      jx--;
+      span_bottom -= sv[jx].height;
+    }
     double best_range = 1e9;
     uint64_t best_index = 0;
     bool any_hit = false;
 
-    for (SpanVector::const_iterator j=sv.begin(); j!=sv.end(); ++j, ++jx) {
+    for (SpanColumn::const_iterator j=sv.begin()+jx; j!=sv.end(); ++j, ++jx) {
+      if (span_bottom > z1) {
+        // this and everything above it is out of reach
+        break;
+      }
       int span_top = span_bottom + j->height;
       if (verbose) {
         printf("   span (%d - %d) type=%d\n", 
@@ -286,9 +299,9 @@ RegionPicker::RegionPicker(Region *rgn)
   int max_z = 0;
   for (int y=0; y<REGION_SIZE; y++) {
     for (int x=0; x<REGION_SIZE; x++) {
-      SpanVector const& vec(rgn->columns[y][x]);
+      SpanColumn col(rgn->column(x, y));
       int h = 0;
-      for (SpanVector::const_iterator j=vec.begin(); j!=vec.end(); ++j) {
+      for (SpanColumn::const_iterator j=col.begin(); j!=col.end(); ++j) {
         h += j->height;
       }
       if (h > max_z) {
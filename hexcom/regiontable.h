@@ -0,0 +1,162 @@
+#ifndef _H_HEXCOM_REGIONTABLE
+#define _H_HEXCOM_REGIONTABLE
+
+#include <vector>
+#include <utility>
+#include "region.h"
+
+/**
+ *   A hash table of regions by origin, with open addressing (linear
+ *   probing) over a power-of-two array of slots, in place of a
+ *   node-based std::unordered_map.  It offers just enough of the
+ *   unordered_map interface for the region caches.
+ *
+ *   Erasing leaves a tombstone in the slot, so iterators other than
+ *   the one erased stay good, and the usual erase-while-iterating loop
+ *   works.  Inserting may rehash, which invalidates all iterators.
+ *
+ *   Lookups tend to come in runs for the same region (e.g., walking
+ *   the columns of one region), so the slot of the last region found
+ *   is remembered and checked before hashing.
+ */
+
+template <typename V>
+struct RegionTable {
+  typedef std::pair<Posn, V> value_type;
+
+  RegionTable()
+    : rt_used(0),
+      rt_count(0),
+      rt_last(0) {
+    rehash(16);
+  }
+
+  struct iterator {
+    iterator() : it_table(NULL), it_slot(0) { }
+    iterator(RegionTable *t, unsigned i) : it_table(t), it_slot(i) { }
+
+    value_type& operator*() const { return it_table->rt_entries[it_slot]; }
+    value_type *operator->() const { return &it_table->rt_entries[it_slot]; }
+    iterator& operator++() {
+      it_slot = it_table->next_full(it_slot + 1);
+      return *this;
+    }
+    bool operator==(iterator const& b) const { return it_slot == b.it_slot; }
+    bool operator!=(iterator const& b) const { return it_slot != b.it_slot; }
+
+    RegionTable        *it_table;
+    unsigned            it_slot;
+  };
+
+  iterator begin() { return iterator(this, next_full(0)); }
+  iterator end() { return iterator(this, rt_state.size()); }
+  size_t size() const { return rt_count; }
+  bool empty() const { return rt_count == 0; }
+
+  iterator find(Posn const& p) {
+    if ((rt_state[rt_last] == SLOT_FULL) && same(rt_entries[rt_last].first, p)) {
+      return iterator(this, rt_last);
+    }
+    unsigned mask = rt_state.size() - 1;
+    for (unsigned i=Posn::hash()(p) & mask; rt_state[i] != SLOT_EMPTY; i=(i+1) & mask) {
+      if ((rt_state[i] == SLOT_FULL) && same(rt_entries[i].first, p)) {
+        rt_last = i;
+        return iterator(this, i);
+      }
+    }
+    return end();
+  }
+
+  // like unordered_map, this does nothing if the key is already present
+  std::pair<iterator,bool> insert(value_type const& v) {
+    iterator i = find(v.first);
+    if (i != end()) {
+      return std::pair<iterator,bool>(i, false);
+    }
+    // keep the load (counting tombstones) under 3/4
+    if ((rt_used + 1) * 4 > rt_state.size() * 3) {
+      rehash((rt_count + 1) * 4 > rt_state.size() * 2
+             ? rt_state.size() * 2
+             : rt_state.size());
+    }
+    unsigned mask = rt_state.size() - 1;
+    unsigned k = Posn::hash()(v.first) & mask;
+    while (rt_state[k] == SLOT_FULL) {
+      k = (k+1) & mask;
+    }
+    if (rt_state[k] == SLOT_EMPTY) {
+      rt_used++;
+    }
+    rt_state[k] = SLOT_FULL;
+    rt_entries[k] = v;
+    rt_count++;
+    rt_last = k;
+    return std::pair<iterator,bool>(iterator(this, k), true);
+  }
+
+  // returns an iterator to the next entry
+  iterator erase(iterator i) {
+    rt_state[i.it_slot] = SLOT_DEAD;
+    rt_entries[i.it_slot] = value_type();
+    rt_count--;
+    return iterator(this, next_full(i.it_slot + 1));
+  }
+
+  size_t erase(Posn const& p) {
+    iterator i = find(p);
+    if (i == end()) {
+      return 0;
+    }
+    erase(i);
+    return 1;
+  }
+
+private:
+  enum {
+    SLOT_EMPTY = 0,
+    SLOT_FULL = 1,
+    SLOT_DEAD = 2
+  };
+
+  static bool same(Posn const& a, Posn const& b) {
+    return (a.x == b.x) && (a.y == b.y);
+  }
+
+  unsigned next_full(unsigned i) const {
+    while ((i < rt_state.size()) && (rt_state[i] != SLOT_FULL)) {
+      i++;
+    }
+    return i;
+  }
+
+  void rehash(size_t n) {
+    std::vector<unsigned char> old_state;
+    std::vector<value_type> old_entries;
+    old_state.swap(rt_state);
+    old_entries.swap(rt_entries);
+
+    rt_state.assign(n, SLOT_EMPTY);
+    rt_entries.resize(n);
+    rt_used = rt_count;
+    rt_last = 0;
+    unsigned mask = n - 1;
+    for (size_t i=0; i<old_state.size(); i++) {
+      if (old_state[i] == SLOT_FULL) {
+        unsigned k = Posn::hash()(old_entries[i].first) & mask;
+        while (rt_state[k] != SLOT_EMPTY) {
+          k = (k+1) & mask;
+        }
+        rt_state[k] = SLOT_FULL;
+        rt_entries[k] = old_entries[i];
+      }
+    }
+  }
+
+  std::vector<unsigned char>    rt_state;
+  std::vector<value_type>       rt_entries;
+  size_t                        rt_used;        // slots full or dead
+  size_t                        rt_count;       // slots full
+  unsigned                      rt_last;        // slot of the last find()
+};
+
+#endif /* _H_HEXCOM_REGIONTABLE */
@@ -0,0 +1,121 @@
+#include "region.h"
+
+// heights this big (or zero) are escaped, and sent as two bytes
+#define SPANARRAY_ESCAPE        (0x7F)
+
+bool decodeSpanArray(Region *rgn, unsigned char const *p, size_t len)
+{
+  unsigned char const *end = p + len;
+
+  for (int y=0; y<REGION_SIZE; y++) {
+    for (int x=0; x<REGION_SIZE; x++) {
+      while (1) {
+        if (p >= end) {
+          return false;
+        }
+        unsigned h = *p++;
+        if (h == 0) {
+          break;
+        }
+        if (h == SPANARRAY_ESCAPE) {
+          if ((end - p) < 2) {
+            return false;
+          }
+          h = ((unsigned)p[0] << 8) + p[1];
+          p += 2;
+        }
+        if ((end - p) < 2) {
+          return false;
+        }
+        Span s;
+        s.height = h;
+        s.type = p[0];
+        s.flags = p[1];
+        p += 2;
+        rgn->columns.push_back(x, y, s);
+      }
+    }
+  }
+  // drop the slack left over from growing the arena
+  rgn->columns.compact();
+  return true;
+}
+
+void encodeSpanArray(Region *rgn, std::vector<unsigned char> *out)
+{
+  out->clear();
+  for (int y=0; y<REGION_SIZE; y++) {
+    for (int x=0; x<REGION_SIZE; x++) {
+      SpanColumn col(rgn->column(x, y));
+      for (SpanColumn::const_iterator i=col.begin(); i!=col.end(); ++i) {
+        if ((i->height == 0) || (i->height >= SPANARRAY_ESCAPE)) {
+          out->push_back(SPANARRAY_ESCAPE);
+          out->push_back(i->height >> 8);
+          out->push_back(i->height & 0xFF);
+        } else {
+          out->push_back(i->height);
+        }
+        out->push_back(i->type);
+        out->push_back(i->flags);
+      }
+      out->push_back(0);
+    }
+  }
+}
+
+// the header of a region record: origin x, origin y, basement and the
+// length of the span array, each as four big-endian bytes
+#define REGION_RECORD_HEADER    (16)
+// and no sane span array is longer than this
+#define REGION_RECORD_MAX       (16 << 20)
+
+static void put32(unsigned char *p, int32_t v)
+{
+  p[0] = (uint32_t)v >> 24;
+  p[1] = (uint32_t)v >> 16;
+  p[2] = (uint32_t)v >> 8;
+  p[3] = (uint32_t)v;
+}
+
+static int32_t get32(unsigned char const *p)
+{
+  return (int32_t)(((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16)
+                   | ((uint32_t)p[2] << 8) | p[3]);
+}
+
+bool writeRegionRecord(FILE *f, Region *rgn)
+{
+  std::vector<unsigned char> spans;
+  encodeSpanArray(rgn, &spans);
+  unsigned char hdr[REGION_RECORD_HEADER];
+  put32(&hdr[0], rgn->origin.x);
+  put32(&hdr[4], rgn->origin.y);
+  put32(&hdr[8], rgn->basement);
+  put32(&hdr[12], spans.size());
+  return (fwrite(hdr, sizeof(hdr), 1, f) == 1)
+    && (fwrite(spans.data(), spans.size(), 1, f) == 1);
+}
+
+Region *readRegionRecord(FILE *f)
+{
+  unsigned char hdr[REGION_RECORD_HEADER];
+  if (fread(hdr, sizeof(hdr), 1, f) != 1) {
+    return NULL;
+  }
+  uint32_t len = get32(&hdr[12]);
+  if ((len == 0) || (len > REGION_RECORD_MAX)) {
+    return NULL;
+  }
+  std::vector<unsigned char> spans(len);
+  if (fread(spans.data(), len, 1, f) != 1) {
+    return NULL;
+  }
+  Region *rgn = new Region();
+  rgn->origin = Posn(get32(&hdr[0]), get32(&hdr[4]));
+  rgn->basement = get32(&hdr[8]);
+  if (!decodeSpanArray(rgn, spans.data(), spans.size())) {
+    delete rgn;
+    return NULL;
+  }
+  return rgn;
+}
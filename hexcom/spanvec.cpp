@@ -1,7 +1,10 @@
 #ifdef UNIT_TEST
 #include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
 #include <string.h>
 #include <vector>
+#include <algorithm>
 #include <assert.h>
 
 struct Span {
@@ -119,7 +122,9 @@ void insert_span(SpanVector *vec, unsigned short bottom, Span const& span)
 #if SPAN_INSERT_DEBUG
             printf("case 2c/1 %d\n", remain);
 #endif
-            assert(bottom > 0);
+            // (bottom may be 0 here, when the new span started at the
+            // bottom of OLD and so took its place as i1; there's no
+            // OLD' then, but that changes nothing below)
             j->height = remain;
             span_merge(vec, vec->erase(i1+1, j)-1);
             goto done;
@@ -187,6 +192,120 @@ void insert_span(SpanVector *vec, unsigned short bottom, Span const& span)
   }
 }
 
+/**
+ *  Apply a whole batch of inserts to a column, in order, in one pass.
+ *  Rather than splitting and merging the span vector once per insert,
+ *  paint the column and then each new span into a flat array of
+ *  (type,flags) cells and run-length encode the result back into
+ *  spans.  The outcome is the same as calling insert_span() for each,
+ *  but the cost is proportional to the height of the column instead
+ *  of the number of inserts times the number of spans.
+ */
+
+struct SpanInsert {
+  int           bottom;         // relative to the bottom of the column
+  Span          span;
+};
+
+static inline uint16_t span_cell(unsigned char type, unsigned char flags)
+{
+  return type + (flags << 8);
+}
+
+void insert_spans(SpanVector *vec, SpanInsert const *ins, unsigned n)
+{
+  if (n == 0) {
+    return;
+  }
+  // only the part of the column from the lowest insert up gets
+  // repainted; the spans entirely below that stay as they are
+  int lo = ins[0].bottom;
+  int h = 0;
+  for (unsigned k=0; k<n; k++) {
+    if (ins[k].bottom < lo) {
+      lo = ins[k].bottom;
+    }
+    if (ins[k].bottom + ins[k].span.height > h) {
+      h = ins[k].bottom + ins[k].span.height;
+    }
+  }
+  if (lo < 0) {
+    lo = 0;
+  }
+  int base = 0;
+  SpanVector::iterator keep = vec->begin();
+  while ((keep != vec->end()) && (base + keep->height <= lo)) {
+    base += keep->height;
+    ++keep;
+  }
+  int top = base;
+  for (SpanVector::iterator i=keep; i!=vec->end(); ++i) {
+    top += i->height;
+  }
+  if (top > h) {
+    h = top;
+  }
+  if (top < lo) {
+    // everything is above the top of the column
+    base = lo = top;
+  }
+
+  std::vector<uint16_t> cell(h - lo, span_cell(0, 0));
+  int z = base - lo;
+  for (SpanVector::iterator i=keep; i!=vec->end(); ++i) {
+    int z0 = (z < 0) ? 0 : z;
+    z += i->height;
+    std::fill(cell.begin() + z0, cell.begin() + z, span_cell(i->type, i->flags));
+  }
+  if (lo > base) {
+    // split the span that straddles the lowest insert
+    keep->height = lo - base;
+    ++keep;
+  }
+  base = lo;
+  for (unsigned k=0; k<n; k++) {
+    int z0 = ins[k].bottom - base;
+    int z1 = z0 + ins[k].span.height;
+    if (z0 < 0) {
+      z0 = 0;
+    }
+    if (z1 > z0) {
+      std::fill(cell.begin() + z0, cell.begin() + z1,
+                span_cell(ins[k].span.type, ins[k].span.flags));
+    }
+  }
+
+  vec->erase(keep, vec->end());
+  for (z=0; z<(int)cell.size(); ) {
+    int z0 = z;
+    while ((z < (int)cell.size()) && (cell[z] == cell[z0])) {
+      z++;
+    }
+    Span s;
+    s.type = cell[z0] & 0xFF;
+    s.flags = cell[z0] >> 8;
+    int run = z - z0;
+    if (!vec->empty()
+        && (vec->back().type == s.type)
+        && (vec->back().flags == s.flags)
+        && (vec->back().height + run <= 0xFFFF)) {
+      // continues the last span we kept
+      vec->back().height += run;
+      continue;
+    }
+    while (run > 0) {
+      s.height = (run > 0xFFFF) ? 0xFFFF : run;
+      vec->push_back(s);
+      run -= s.height;
+    }
+  }
+
+  // space on the top of the column is stripped off
+  while (!vec->empty() && (vec->back().type == 0)) {
+    vec->pop_back();
+  }
+}
+
 ////////////////////////////////////////////////////////////////////////
 
 #ifdef UNIT_TEST
@@ -303,6 +422,76 @@ void test_supermerge()
   PRINT_RESULT(vec);
 }
 
+static int column_top(SpanVector const& v)
+{
+  int z = 0;
+  for (SpanVector::const_iterator i=v.begin(); i!=v.end(); ++i) {
+    z += i->height;
+  }
+  return z;
+}
+
+static std::vector<uint16_t> expand_cells(SpanVector const& v)
+{
+  std::vector<uint16_t> cells;
+  for (SpanVector::const_iterator i=v.begin(); i!=v.end(); ++i) {
+    cells.insert(cells.end(), i->height, span_cell(i->type, i->flags));
+  }
+  return cells;
+}
+
+// the batch should come out just like the inserts done one at a time
+void test_batch()
+{
+  srandom(1);
+  for (int trial=0; trial<1000; trial++) {
+    SpanVector one, batch;
+    std::vector<SpanInsert> ins;
+    int n = 1 + random() % 40;
+    for (int k=0; k<n; k++) {
+      SpanInsert si;
+      si.bottom = random() % 60;
+      si.span.height = 1 + random() % 10;
+      si.span.type = random() % 4;
+      si.span.flags = si.span.type ? random() % 2 : 0;
+      if ((si.span.type == 0) && (si.bottom + si.span.height >= column_top(one))) {
+        // insert_span() doesn't care for space hanging off the top
+        si.span.type = 1;
+      }
+      insert_span(&one, si.bottom, si.span);
+      ins.push_back(si);
+    }
+    insert_spans(&batch, &ins[0], ins.size());
+
+    // and again on top of what's already there
+    SpanVector again = batch;
+    for (unsigned k=0; k<ins.size(); k++) {
+      ins[k].bottom = (ins[k].bottom * 7) % 70;
+      if ((ins[k].span.type == 0)
+          && (ins[k].bottom + ins[k].span.height >= column_top(one))) {
+        ins[k].span.type = 2;
+      }
+      insert_span(&one, ins[k].bottom, ins[k].span);
+    }
+    insert_spans(&again, &ins[0], ins.size());
+
+    // insert_span() doesn't always merge everything it could, so
+    // compare what's in the columns rather than how it's split up
+    bool same = (expand_cells(one) == expand_cells(again));
+    for (unsigned k=1; same && (k<again.size()); k++) {
+      same = ((again[k].type != again[k-1].type)
+              || (again[k].flags != again[k-1].flags));
+    }
+    if (!same) {
+      printf("batch trial %d differs\n", trial);
+      PRINT_RESULT(one);
+      PRINT_RESULT(again);
+      abort();
+    }
+  }
+  printf("batch ok\n");
+}
+
 int main()
 {
   printf("---------------------------------\n");
@@ -313,5 +502,7 @@ int main()
   test_overhang();
   printf("---------------------------------\n");
   test_supermerge();
+  printf("---------------------------------\n");
+  test_batch();
 }
 #endif /* UNIT_TEST */
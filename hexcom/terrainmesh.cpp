@@ -0,0 +1,825 @@
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <mutex>
+#include <algorithm>
+#include "terrainmesh.h"
+#include "hex.h"
+
+enum TextureIds {
+  GRASSY_DIRT_TOP,
+  GRASSY_DIRT_BOTTOM = GRASSY_DIRT_TOP,
+  GRASSY_DIRT_SIDE_FIRST,
+  GRASSY_DIRT_SIDE_REST,
+
+  OAK_TREE_TOP,
+  OAK_TREE_BOTTOM = OAK_TREE_TOP,
+  OAK_TREE_SIDE_FIRST,
+  OAK_TREE_SIDE_REST,
+
+  ROCK_TOP = 16,
+  ROCK_BOTTOM = ROCK_TOP,
+  ROCK_SIDE_FIRST = ROCK_TOP,
+  ROCK_SIDE_REST = ROCK_TOP,
+
+  SAND_TOP = 18,
+  SAND_BOTTOM = SAND_TOP,
+  SAND_SIDE_FIRST = SAND_TOP,
+  SAND_SIDE_REST = SAND_TOP,
+
+  RAILWAY_1_TOP = (10*16)+8,
+  WATER_PHASE_1 = (12*16)+13
+};
+
+/**
+ *   The texture tiles for each type of block, as a specialization of
+ *   BlockTextures for each type there is; any other type looks like
+ *   rock.  They are gathered at compile time into block_textures[],
+ *   indexed by type, so that setting up a slab is a table lookup
+ */
+template <int TYPE> struct BlockTextures {
+  enum { TOP = ROCK_TOP, BOTTOM = ROCK_BOTTOM,
+         SIDE_FIRST = ROCK_SIDE_FIRST, SIDE_REST = ROCK_SIDE_REST };
+};
+template <> struct BlockTextures<1> {
+  enum { TOP = GRASSY_DIRT_TOP, BOTTOM = GRASSY_DIRT_BOTTOM,
+         SIDE_FIRST = GRASSY_DIRT_SIDE_FIRST, SIDE_REST = GRASSY_DIRT_SIDE_REST };
+};
+template <> struct BlockTextures<2> {
+  enum { TOP = OAK_TREE_TOP, BOTTOM = OAK_TREE_BOTTOM,
+         SIDE_FIRST = OAK_TREE_SIDE_FIRST, SIDE_REST = OAK_TREE_SIDE_REST };
+};
+template <> struct BlockTextures<4> {
+  enum { TOP = SAND_TOP, BOTTOM = SAND_BOTTOM,
+         SIDE_FIRST = SAND_SIDE_FIRST, SIDE_REST = SAND_SIDE_REST };
+};
+template <> struct BlockTextures<5> {
+  enum { TOP = RAILWAY_1_TOP, BOTTOM = ROCK_BOTTOM,
+         SIDE_FIRST = ROCK_SIDE_FIRST, SIDE_REST = ROCK_SIDE_REST };
+};
+template <> struct BlockTextures<240> {
+  enum { TOP = WATER_PHASE_1, BOTTOM = WATER_PHASE_1,
+         SIDE_FIRST = WATER_PHASE_1, SIDE_REST = WATER_PHASE_1 };
+};
+
+struct TextureSet {
+  uint8_t       ts_top;
+  uint8_t       ts_bottom;
+  uint8_t       ts_side1;       // the top SIDE_TEXTURE_HEIGHT of a side
+  uint8_t       ts_side2;       // and the rest of it
+};
+
+#define BT1(t)  { BlockTextures<t>::TOP, BlockTextures<t>::BOTTOM, \
+                  BlockTextures<t>::SIDE_FIRST, BlockTextures<t>::SIDE_REST }
+#define BT4(t)  BT1(t), BT1(t+1), BT1(t+2), BT1(t+3)
+#define BT16(t) BT4(t), BT4(t+4), BT4(t+8), BT4(t+12)
+#define BT64(t) BT16(t), BT16(t+16), BT16(t+32), BT16(t+48)
+
+static constexpr TextureSet block_textures[256] = {
+  BT64(0), BT64(64), BT64(128), BT64(192)
+};
+
+#undef BT1
+#undef BT4
+#undef BT16
+#undef BT64
+
+/*
+ *
+ *       4
+ *       /\
+ *      /  \
+ *    5/    \
+ *    |      |3
+ *    |      |
+ *    |      |
+ *    0\    /2
+ *      \  /
+ *       \/
+ *        1
+ *
+ *
+ *
+ *
+ *
+ *
+ *
+ */
+
+/**
+ *   The corners of a hex relative to its origin (see hex_x() and
+ *   hex_y()), and the outward normals of its sides, numbered as
+ *   above; side i runs from corner i to corner i+1.  These are
+ *   x_stride, a and edge from hex.h, spelled out so that they are
+ *   compile-time constants
+ */
+#define HEX_A           (0.28867513459481288225)        // 1/sqrt(12)
+#define HEX_EDGE        (2*HEX_A)
+#define SIN_60          (0.86602540378443864676)
+
+static constexpr double hex_corner[6][2] = {
+  { 0.0, 0.0 },
+  { 0.5, -HEX_A },
+  { 1.0, 0.0 },
+  { 1.0, HEX_EDGE },
+  { 0.5, HEX_EDGE + HEX_A },
+  { 0.0, HEX_EDGE }
+};
+
+static constexpr float hex_normal[6][2] = {
+  { -0.5f, -SIN_60 },           // 240 degrees
+  {  0.5f, -SIN_60 },           // 300
+  {  1.0f,  0.0f },             // 0
+  {  0.5f,  SIN_60 },           // 60
+  { -0.5f,  SIN_60 },           // 120
+  { -1.0f,  0.0f }              // 180
+};
+
+void MeshAccumulator::setup(Slab *slab)
+{
+  current = slab;
+  double x0 = slab->x * x_stride;
+  if (slab->y & 1) {
+    x0 += x_stride / 2;
+  }
+  double y0 = slab->y * y_stride;
+  z0 = slab->z0 * z_scale;
+  z1 = slab->z1 * z_scale;
+
+  for (int i=0; i<6; i++) {
+    hex[i][0] = x0 + hex_corner[i][0];
+    hex[i][1] = y0 + hex_corner[i][1];
+  }
+  textures = &block_textures[slab->type];
+}
+
+void MeshAccumulator::water_top()
+{
+  tile = textures->ts_top;
+  double u0 = 0;
+  double v0 = 0;
+  const double t_s = 1.0/(4*a);
+  const double v_a = a * t_s;
+  const double v_e = edge * t_s;
+  const double u_w = x_stride * t_s;
+
+  v0 += v_a;
+  float ambient = 1.0;
+  float nx = 0, ny = 0, nz = 1;
+  unsigned k0 = vertex(hex[0][0], hex[0][1], z1, u0, v0, ambient, nx, ny, nz);
+  unsigned k1 = vertex(hex[1][0], hex[1][1], z1, u0 + u_w/2, v0 - v_a, ambient, nx, ny, nz);
+  unsigned k2 = vertex(hex[2][0], hex[2][1], z1, u0 + u_w, v0, ambient, nx, ny, nz);
+  unsigned k3 = vertex(hex[3][0], hex[3][1], z1, u0 + u_w, v0 + v_e, ambient, nx, ny, nz);
+  unsigned k4 = vertex(hex[4][0], hex[4][1], z1, u0 + u_w/2, v0 + (v_a+v_e), ambient, nx, ny, nz);
+  unsigned k5 = vertex(hex[5][0], hex[5][1], z1, u0, v0 + v_e, ambient, nx, ny, nz);
+
+  transparent_triangle(k0, k1, k2);
+  transparent_triangle(k2, k3, k5);
+  transparent_triangle(k3, k4, k5);
+  transparent_triangle(k5, k0, k2);
+}
+
+void MeshAccumulator::hextop()
+{
+  tile = textures->ts_top;
+  double u0 = 0;
+  double v0 = 0;
+  const double t_s = 1.0/(4*a);
+  const double v_a = a * t_s;
+  const double v_e = edge * t_s;
+  const double u_w = x_stride * t_s;
+
+  v0 += v_a;
+  float ambient = 1.0;
+  switch (current->flags & DEEP_SHADOW) {
+  case DEEP_SHADOW: ambient = 0.5; break;
+  case MEDIUM_SHADOW: ambient = 0.667; break;
+  case LIGHT_SHADOW: ambient = 0.9; break;
+  }
+  float nx = 0, ny = 0, nz = 1;
+  unsigned k0 = vertex(hex[0][0], hex[0][1], z1, u0, v0, ambient, nx, ny, nz);
+  unsigned k1 = vertex(hex[1][0], hex[1][1], z1, u0 + u_w/2, v0 - v_a, ambient, nx, ny, nz);
+  unsigned k2 = vertex(hex[2][0], hex[2][1], z1, u0 + u_w, v0, ambient, nx, ny, nz);
+  unsigned k3 = vertex(hex[3][0], hex[3][1], z1, u0 + u_w, v0 + v_e, ambient, nx, ny, nz);
+  unsigned k4 = vertex(hex[4][0], hex[4][1], z1, u0 + u_w/2, v0 + (v_a+v_e), ambient, nx, ny, nz);
+  unsigned k5 = vertex(hex[5][0], hex[5][1], z1, u0, v0 + v_e, ambient, nx, ny, nz);
+
+  triangle(k0, k1, k2);
+  triangle(k2, k3, k5);
+  triangle(k3, k4, k5);
+  triangle(k5, k0, k2);
+  line(k0, k1);
+  line(k1, k2);
+  line(k2, k3);
+  line(k3, k4);
+  line(k4, k5);
+  line(k5, k0);
+}
+
+void MeshAccumulator::hexbottom()
+{
+  tile = textures->ts_bottom;
+  double u0 = 0;
+  double v0 = 0;
+  const double t_s = 1.0/(4*a);
+  const double v_a = a * t_s;
+  const double v_e = edge * t_s;
+  const double u_w = x_stride * t_s;
+  v0 += v_a;
+
+  float nx = 0, ny = 0, nz = -1;
+
+  unsigned k0 = vertex(hex[0][0], hex[0][1], z0, u0, v0, 1, nx, ny, nz);
+  unsigned k1 = vertex(hex[1][0], hex[1][1], z0, u0 + u_w/2, v0 - v_a, 1, nx, ny, nz);
+  unsigned k2 = vertex(hex[2][0], hex[2][1], z0, u0 + u_w, v0, 1, nx, ny, nz);
+  unsigned k3 = vertex(hex[3][0], hex[3][1], z0, u0 + u_w, v0 + v_e, 1, nx, ny, nz);
+  unsigned k4 = vertex(hex[4][0], hex[4][1], z0, u0 + u_w/2, v0 + (v_a+v_e), 1, nx, ny, nz);
+  unsigned k5 = vertex(hex[5][0], hex[5][1], z0, u0, v0 + v_e, 1, nx, ny, nz);
+
+  triangle(k2, k1, k0);
+  triangle(k5, k3, k2);
+  triangle(k5, k4, k3);
+  triangle(k2, k0, k5);
+  line(k0, k1);
+  line(k1, k2);
+  line(k2, k3);
+  line(k3, k4);
+  line(k4, k5);
+  line(k5, k0);
+}
+
+/*
+ *  The texture coordinates of terrain are relative to a tile of the
+ *  texture, and the shaders wrap them, so a side face is the part
+ *  at the top (side1) in one quad and the rest of it (side2) in as
+ *  few quads as will hold the repeats of its texture
+ */
+void MeshAccumulator::face(int f0)
+{
+  int f1 = (f0+1)%6;
+  int height = (current->z1 - current->z0);
+  // generate the face fragment that's at the top
+  int h = (height > SIDE_TEXTURE_HEIGHT) ? SIDE_TEXTURE_HEIGHT : height;
+  double v_w = h / (double)SIDE_TEXTURE_HEIGHT;
+  short zi = current->z1;
+  double z = zi * z_scale;
+  double dz = h * z_scale;
+
+  tile = textures->ts_side1;
+  float nx = hex_normal[f0][0];
+  float ny = hex_normal[f0][1];
+  float nz = 0;
+  unsigned k0 = vertex(hex[f0][0], hex[f0][1], z, 0, 0, 1, nx, ny, nz);
+  unsigned k1 = vertex(hex[f1][0], hex[f1][1], z, 1, 0, 1, nx, ny, nz);
+  unsigned k2 = vertex(hex[f1][0], hex[f1][1], z-dz, 1, v_w, 0.5, nx, ny, nz);
+  unsigned k3 = vertex(hex[f0][0], hex[f0][1], z-dz, 0, v_w, 0.5, nx, ny, nz);
+
+  triangle(k0, k3, k1);
+  triangle(k1, k3, k2);
+  // generate the rest of the face
+  height -= h;
+  zi -= h;
+
+  tile = textures->ts_side2;
+  while (height > 0) {
+    h = (height > SIDE_REPEAT_MAX*SIDE_TEXTURE_HEIGHT)
+      ? SIDE_REPEAT_MAX*SIDE_TEXTURE_HEIGHT
+      : height;
+    v_w = h / (double)SIDE_TEXTURE_HEIGHT;
+    z = zi * z_scale;
+    dz = h * z_scale;
+
+    unsigned k0 = vertex(hex[f0][0], hex[f0][1], z, 0, 0, 0.5, nx, ny, nz);
+    unsigned k1 = vertex(hex[f1][0], hex[f1][1], z, 1, 0, 0.5, nx, ny, nz);
+    unsigned k2 = vertex(hex[f1][0], hex[f1][1], z-dz, 1, v_w, 0.5, nx, ny, nz);
+    unsigned k3 = vertex(hex[f0][0], hex[f0][1], z-dz, 0, v_w, 0.5, nx, ny, nz);
+
+    triangle(k0, k3, k1);
+    triangle(k1, k3, k2);
+    height -= h;
+    zi -= h;
+  }
+}
+
+/*
+ *  The top of a cell of a coarse mesh, which is the rectangle from
+ *  (x0,y0) to (x1,y1) at z (in z units)
+ */
+void MeshAccumulator::coarse_top(float x0, float y0, float x1, float y1, int z)
+{
+  tile = textures->ts_top;
+  float wz = z * z_scale;
+  float u_w = (x1 - x0) * uv_scale;
+  float v_w = (y1 - y0) * uv_scale;
+  unsigned k0 = vertex(x0, y0, wz, 0, v_w, 1, 0, 0, 1);
+  unsigned k1 = vertex(x1, y0, wz, u_w, v_w, 1, 0, 0, 1);
+  unsigned k2 = vertex(x1, y1, wz, u_w, 0, 1, 0, 0, 1);
+  unsigned k3 = vertex(x0, y1, wz, 0, 0, 1, 0, 0, 1);
+  triangle(k0, k1, k2);
+  triangle(k0, k2, k3);
+}
+
+/*
+ *  A wall of a cell of a coarse mesh along the line from (xa,ya) to
+ *  (xb,yb), with the cell on its left, from z0 up to z1 (in z
+ *  units); like face(), it takes as few quads as will hold the
+ *  repeats of its texture
+ */
+void MeshAccumulator::coarse_wall(float xa, float ya, float xb, float yb, int z0, int z1)
+{
+  tile = textures->ts_side2;
+  float len = sqrt((xb-xa)*(xb-xa) + (yb-ya)*(yb-ya));
+  float nx = (yb - ya) / len;
+  float ny = (xa - xb) / len;
+  float u_w = len * uv_scale;
+  while (z1 > z0) {
+    int h = (z1 - z0 > SIDE_REPEAT_MAX*SIDE_TEXTURE_HEIGHT)
+      ? SIDE_REPEAT_MAX*SIDE_TEXTURE_HEIGHT
+      : (z1 - z0);
+    float v_w = h / (float)SIDE_TEXTURE_HEIGHT;
+    float zt = z1 * z_scale;
+    float zb = (z1 - h) * z_scale;
+    unsigned k0 = vertex(xa, ya, zt, 0, 0, 0.5, nx, ny, 0);
+    unsigned k1 = vertex(xb, yb, zt, u_w, 0, 0.5, nx, ny, 0);
+    unsigned k2 = vertex(xb, yb, zb, u_w, v_w, 0.5, nx, ny, 0);
+    unsigned k3 = vertex(xa, ya, zb, 0, v_w, 0.5, nx, ny, 0);
+    triangle(k0, k3, k1);
+    triangle(k1, k3, k2);
+    z1 -= h;
+  }
+}
+
+frect MeshAccumulator::bbox(glm::mat4 xf)
+{
+  frect b;
+                 
+  if (count == 0) {
+    b.x0 = b.x1 = b.y0 = b.y1 = b.z0 = b.z1 = 0;
+  } else {
+    for (unsigned i=0; i<count; i++) {
+      glm::vec4 p(posn[i*3+0], posn[i*3+1], posn[i*3+2], 1);
+      p = xf * p;
+      if (i == 0) {
+        b.x0 = b.x1 = p[0];
+        b.y0 = b.y1 = p[1];
+        b.z0 = b.z1 = p[2];
+      } else {
+        b.x0 = (p[0] < b.x0) ? p[0] : b.x0;
+        b.x1 = (p[0] > b.x1) ? p[0] : b.x1;
+        b.y0 = (p[1] < b.y0) ? p[1] : b.y0;
+        b.y1 = (p[1] > b.y1) ? p[1] : b.y1;
+        b.z0 = (p[2] < b.z0) ? p[2] : b.z0;
+        b.z1 = (p[2] > b.z1) ? p[2] : b.z1;
+      }
+    }
+  }
+  return b;
+}
+
+// which of the hex's normals, as in PackedVertex::pv_normal
+uint8_t MeshAccumulator::normal_index(float nx, float ny, float nz)
+{
+  if (nz > 0.5) {
+    return PACK_NORMAL_TOP;
+  } else if (nz < -0.5) {
+    return PACK_NORMAL_BOTTOM;
+  }
+  // face 0's normal is at 240 degrees, and they go around by 60
+  int deg = lround(RAD_TO_DEG(atan2(ny, nx)));
+  return ((deg - 240 + 720 + 30) / 60) % 6;
+}
+
+/*
+ *  Convert the vertices to the packed terrain format, positions
+ *  being made relative to the given region origin
+ */
+void MeshAccumulator::pack(Posn const& origin)
+{
+  double ox = hex_x(origin.x, origin.y);
+  double oy = hex_y(origin.x, origin.y);
+  packed.resize(count);
+  for (unsigned i=0; i<count; i++) {
+    PackedVertex *pv = &packed[i];
+    pv->pv_posn[0] = lround((posn[3*i+0] - ox) / PACK_X_UNIT);
+    pv->pv_posn[1] = lround((posn[3*i+1] - oy) / PACK_Y_UNIT);
+    pv->pv_posn[2] = lround(posn[3*i+2] / PACK_Z_UNIT);
+    pv->pv_posn[3] = 0;
+    pv->pv_uv[0] = lround(uv[2*i+0] / PACK_UV_UNIT);
+    pv->pv_uv[1] = lround(uv[2*i+1] / PACK_UV_UNIT);
+    pv->pv_ambient = lround(ambient[i] * 255.0);
+    pv->pv_normal = normal_index(normal[3*i+0], normal[3*i+1], normal[3*i+2]);
+    pv->pv_tile = tiles[i];
+    pv->pv_pad = 0;
+  }
+}
+
+// append num triangles to the staged indices, renumbering their
+// vertices from first to base, and pad them out to room triangles
+// with degenerate ones
+void MeshAccumulator::stage_chunk_index(uint32_t const *p, unsigned num, unsigned room,
+                                        unsigned first, unsigned base)
+{
+  for (unsigned i=0; i<3*num; i++) {
+    staged.push_back(p[i] - first + base);
+  }
+  staged.resize(staged.size() + 3*(room - num), base);
+}
+
+// a mesh that didn't say how it's divided is all one chunk
+void MeshAccumulator::whole_chunk()
+{
+  if (chunks.empty()) {
+    begin_chunk(0);
+    chunks.back().cr_vertex0 = 0;
+    chunks.back().cr_index0 = 0;
+    chunks.back().cr_water0 = 0;
+    chunks.back().cr_vertices = packed.size();
+    chunks.back().cr_triangles = size();
+    chunks.back().cr_water_triangles = num_transparent;
+  }
+}
+
+// how many idle accumulators a thread keeps around
+#define ACCUMULATOR_POOL_SIZE   (2)
+
+// and how many more are shared between threads; region meshes are
+// built on the workers but finished (and released) on the main thread
+#define ACCUMULATOR_SPILL_SIZE  (8)
+
+static thread_local std::vector<MeshAccumulator*> accumulator_pool;
+static std::mutex accumulator_spill_lock;
+static std::vector<MeshAccumulator*> accumulator_spill;
+
+MeshAccumulator *acquire_accumulator(void)
+{
+  MeshAccumulator *ma = NULL;
+  if (!accumulator_pool.empty()) {
+    ma = accumulator_pool.back();
+    accumulator_pool.pop_back();
+  } else {
+    std::lock_guard<std::mutex> lock(accumulator_spill_lock);
+    if (!accumulator_spill.empty()) {
+      ma = accumulator_spill.back();
+      accumulator_spill.pop_back();
+    }
+  }
+  if (!ma) {
+    return new MeshAccumulator();
+  }
+  ma->reset();
+  return ma;
+}
+
+void release_accumulator(MeshAccumulator *ma)
+{
+  if (accumulator_pool.size() < ACCUMULATOR_POOL_SIZE) {
+    accumulator_pool.push_back(ma);
+    return;
+  }
+  {
+    std::lock_guard<std::mutex> lock(accumulator_spill_lock);
+    if (accumulator_spill.size() < ACCUMULATOR_SPILL_SIZE) {
+      accumulator_spill.push_back(ma);
+      return;
+    }
+  }
+  delete ma;
+}
+
+// has nothing to contribute (used to skip space in the subject column)
+static inline bool is_space(int t)
+{
+  return (t==0) || (t==240);
+}
+
+// might be seen through (used to skip solids in the neighbor column)
+static inline bool is_solid(int t)
+{
+  return (t!=0) && (t!=240);
+}
+
+// would a face of type t against type n be seen?  Not if n is solid,
+// nor between two bodies of water
+static inline bool is_exposed(int t, int n)
+{
+  return !is_solid(n) && !((t == 240) && (n == 240));
+}
+
+/**
+ *  Emit the faces of the subject column that are exposed on the
+ *  given side; me_type/me_flags and neighbor_type are the two
+ *  columns expanded from the basement up, for me_z units.  Returns
+ *  the number of runs of face left out for being hidden
+ */
+static unsigned explosive_merge(Region *rgn,
+                                uint8_t const *me_type,
+                                uint8_t const *me_flags,
+                                uint8_t const *neighbor_type,
+                                int me_z,
+                                MeshAccumulator *ma,
+                                int x, int y, 
+                                int face)
+{
+  int i=0;
+  unsigned hidden = 0;
+  Slab s;
+  s.x = x;
+  s.y = y;
+  while (i < me_z) {
+    if (is_space(me_type[i])) {
+      i++;
+    } else if (is_exposed(me_type[i], neighbor_type[i])) {
+      int i0 = i;
+      s.type = me_type[i];
+      s.flags = me_flags[i];
+      while ((i < me_z)
+             && (me_type[i] == s.type) 
+             && (me_flags[i] == s.flags)
+             && is_exposed(me_type[i], neighbor_type[i])) {
+        i++;
+      }
+      s.z0 = i0 + rgn->basement;
+      s.z1 = i + rgn->basement;
+      ma->setup(&s);
+      ma->face(face);
+    } else {
+      while ((i < me_z)
+             && !is_space(me_type[i])
+             && !is_exposed(me_type[i], neighbor_type[i])) {
+        i++;
+      }
+      hidden++;
+    }
+  }
+  return hidden;
+}
+
+// column (x,y) relative to rgns[1][1], which may be up to one column
+// outside it; returns the region it's in (NULL if we don't have that one)
+static Region *neighbor_column(Region *rgns[3][3], int x, int y, SpanColumn *col)
+{
+  int rx = (x < 0) ? 0 : ((x < REGION_SIZE) ? 1 : 2);
+  int ry = (y < 0) ? 0 : ((y < REGION_SIZE) ? 1 : 2);
+  Region *r = rgns[ry][rx];
+  if (r) {
+    *col = r->column(x - (rx-1) * REGION_SIZE, y - (ry-1) * REGION_SIZE);
+  }
+  return r;
+}
+
+void mesh_detail(Region *rgns[3][3], unsigned chunks,
+                 MeshAccumulator *ma, TerrainMeshStats *stats)
+{
+  Region *rgn = rgns[1][1];
+
+  // room to expand a column and its six neighbors, which only
+  // needs to be as tall as the tallest column in the region
+  int tallest = 0;
+  unsigned spans = 0;
+  unsigned height = 0;
+  for (int y=0; y<REGION_SIZE; y++) {
+    for (int x=0; x<REGION_SIZE; x++) {
+      if (!(chunks & TS_CHUNK_BIT(x, y))) {
+        continue;
+      }
+      SpanColumn col(rgn->column(x, y));
+      int z = 0;
+      for (SpanColumn::const_iterator i=col.begin(); i!=col.end(); ++i) {
+        z += i->height;
+      }
+      if (z > tallest) {
+        tallest = z;
+      }
+      spans += col.size();
+      height += z;
+    }
+  }
+  // each span gets a top and a bottom (6 vertices, 4 triangles each);
+  // each side gets a quad per SIDE_TEXTURE_HEIGHT, plus one more for
+  // each place a run of it can be broken by a span, ours or the
+  // neighbor's (which we take to be about as fragmented as ours)
+  unsigned quads = 6 * (height / SIDE_TEXTURE_HEIGHT + 3 * spans);
+  ma->reserve(12 * spans + 4 * quads, 8 * spans + 2 * quads);
+  int stride = tallest + EXPAND_SLOP;
+  std::vector<uint8_t> x_type(7 * stride);
+  std::vector<uint8_t> x_flags(7 * stride);
+
+  for (unsigned chunk=0; chunk<TS_CHUNKS; chunk++) {
+    if (!(chunks & (1U << chunk))) {
+      continue;
+    }
+    ma->begin_chunk(chunk);
+    int x0 = (chunk % TS_CHUNKS_ACROSS) * TS_CHUNK_SIZE;
+    int y0 = (chunk / TS_CHUNKS_ACROSS) * TS_CHUNK_SIZE;
+    for (int y=y0; y<y0+TS_CHUNK_SIZE; y++) {
+      for (int x=x0; x<x0+TS_CHUNK_SIZE; x++) {
+        SpanColumn col(rgn->column(x, y));
+        // the subject column, then its neighbors in face order, and
+        // the region each comes from (NULL if we don't have it)
+        SpanColumn batch[7];
+        Region *owner[7];
+        batch[0] = col;
+        owner[0] = rgn;
+        bool same_region = true;
+        for (int face=0; face<6; face++) {
+          int nx = x, ny = y;
+          hex_neighbor(face, &nx, &ny);
+          owner[face+1] = neighbor_column(rgns, nx, ny, &batch[face+1]);
+          if (owner[face+1] != rgn) {
+            same_region = false;
+          }
+        }
+
+        //printf("bmr (%d,%d)  %u\n", x, y, ma->size());
+        Slab s;
+        s.x = rgn->origin.x + x;
+        s.y = rgn->origin.y + y;
+        s.z0 = rgn->basement;
+
+        for (SpanColumn::const_iterator i=col.begin(); i<col.end(); ++i) {
+          s.z1 = s.z0 + i->height;
+          s.type = i->type;
+          s.flags = i->flags;
+          // a top under a solid span, or a bottom on one (or on the
+          // basement), is never seen
+          bool top = (i+1 == col.end()) || !is_solid(i[1].type);
+          bool bottom = (i != col.begin()) && !is_solid(i[-1].type);
+          if (i->type == 240) {
+            // special handling for water
+            if (top) {
+              ma->setup(&s);
+              ma->water_top();
+            } else {
+              stats->tms_hidden_tops++;
+            }
+          } else if (i->type != 0) {
+            ma->setup(&s);
+            if (top) {
+              ma->hextop();
+            } else {
+              stats->tms_hidden_tops++;
+            }
+            if (bottom) {
+              ma->hexbottom();
+            } else if (i != col.begin()) {
+              stats->tms_hidden_bottoms++;
+            }
+            for (int face=0; face<6; face++) {
+              if (!owner[face+1]) {
+                ma->face(face);
+              }
+            }
+          }
+          s.z0 = s.z1;
+        }
+        int me_z = s.z0 - rgn->basement;
+        if (same_region) {
+          expandColumns(rgn, batch, 7, rgn->basement, me_z, stride,
+                        &x_type[0], &x_flags[0]);
+        } else {
+          // regions have their own basements, so a neighbor in another
+          // region is expanded on its own (but over the same z range)
+          for (int k=0; k<7; k++) {
+            if (owner[k]) {
+              expandColumns(owner[k], &batch[k], 1, rgn->basement, me_z, stride,
+                            &x_type[k * stride], &x_flags[k * stride]);
+            }
+          }
+        }
+        for (int face=0; face<6; face++) {
+          if (owner[face+1]) {
+            stats->tms_hidden_sides += explosive_merge(rgn, &x_type[0], &x_flags[0],
+                                                       &x_type[(face+1) * stride], me_z,
+                                                       ma, rgn->origin.x + x, rgn->origin.y + y,
+                                                       face);
+          }
+        }
+      }
+    }
+    ma->end_chunk();
+  }
+
+  ma->pack(rgn->origin);
+}
+
+/**
+ *   The coarse meshes stand in for a region's detailed one at a
+ *   distance.  The region is divided into cells of COARSE_CELL(level)
+ *   columns on a side, and each cell is drawn as a box as tall as the
+ *   tallest column in it, with the top of whatever type is on top of
+ *   most of them.  The boxes are rectangles that follow the rows and
+ *   columns of hexes, except that along the edges of the region they
+ *   reach out as far as the hexes do, and hang skirts down to the
+ *   basement, so that nothing shows through next to a neighbor drawn
+ *   at another level of detail.  (Being as tall as the tallest column
+ *   also hides any faces of a detailed neighbor that were left out
+ *   for facing into this region.)
+ */
+
+// the tallest column in a cell of k by k columns from (x0,y0), and
+// the type most of them have on top (0 if they're all empty)
+static void coarse_cell(Region *rgn, int x0, int y0, int k, int *top, int *type)
+{
+  unsigned char types[16];
+  unsigned counts[16];
+  int ntypes = 0;
+  *top = rgn->basement;
+  *type = 0;
+  for (int y=y0; y<y0+k; y++) {
+    for (int x=x0; x<x0+k; x++) {
+      SpanColumn col(rgn->column(x, y));
+      int z = rgn->basement;
+      int ztop = z;
+      int t = 0;
+      for (SpanColumn::const_iterator i=col.begin(); i!=col.end(); ++i) {
+        z += i->height;
+        if (i->type != 0) {
+          ztop = z;
+          t = i->type;
+        }
+      }
+      if (ztop > *top) {
+        *top = ztop;
+      }
+      if (t) {
+        int j = 0;
+        while ((j < ntypes) && (types[j] != t)) {
+          j++;
+        }
+        if (j == ntypes) {
+          types[ntypes] = t;
+          counts[ntypes++] = 0;
+        }
+        if (++counts[j] > counts[0]) {
+          std::swap(types[j], types[0]);
+          std::swap(counts[j], counts[0]);
+        }
+      }
+    }
+  }
+  if (ntypes) {
+    *type = types[0];
+  }
+}
+
+void mesh_coarse(Region *rgn, int level, MeshAccumulator *ma)
+{
+  const int k = COARSE_CELL(level);
+  const int n = REGION_SIZE / k;
+  int top[REGION_SIZE/2][REGION_SIZE/2];
+  int type[REGION_SIZE/2][REGION_SIZE/2];
+  for (int j=0; j<n; j++) {
+    for (int i=0; i<n; i++) {
+      coarse_cell(rgn, i*k, j*k, k, &top[j][i], &type[j][i]);
+    }
+  }
+
+  // where the lines between the cells are; these are all on the grid
+  // of the packed format, and the outer ones take in all of the hexes
+  float xs[REGION_SIZE/2+1];
+  float ys[REGION_SIZE/2+1];
+  double ox = hex_x(rgn->origin.x, rgn->origin.y);
+  double oy = hex_y(rgn->origin.x, rgn->origin.y);
+  for (int i=0; i<=n; i++) {
+    xs[i] = ox + ((i == 0) ? 0 : (i == n) ? (REGION_SIZE + 0.5) : (i*k + 0.5)) * x_stride;
+    ys[i] = oy + ((i == n) ? (3*REGION_SIZE) : (3*i*k - 1)) * a;
+  }
+
+  ma->reserve(n * n * 16, n * n * 10);
+  Slab s;
+  s.x = rgn->origin.x;
+  s.y = rgn->origin.y;
+  s.z0 = s.z1 = 0;
+  s.flags = 0;
+  for (int j=0; j<n; j++) {
+    for (int i=0; i<n; i++) {
+      if (!type[j][i]) {
+        continue;
+      }
+      s.type = type[j][i];
+      ma->setup(&s);
+      int z = top[j][i];
+      ma->coarse_top(xs[i], ys[j], xs[i+1], ys[j+1], z);
+      // walls down to any lower cell next door (the cell next door
+      // takes care of it if it's the taller one), or skirts down to
+      // the basement at the edge of the region
+      int w = (i > 0) ? top[j][i-1] : rgn->basement;
+      int e = (i < n-1) ? top[j][i+1] : rgn->basement;
+      int south = (j > 0) ? top[j-1][i] : rgn->basement;
+      int north = (j < n-1) ? top[j+1][i] : rgn->basement;
+      if (w < z) {
+        ma->coarse_wall(xs[i], ys[j+1], xs[i], ys[j], w, z);
+      }
+      if (e < z) {
+        ma->coarse_wall(xs[i+1], ys[j], xs[i+1], ys[j+1], e, z);
+      }
+      if (south < z) {
+        ma->coarse_wall(xs[i], ys[j], xs[i+1], ys[j], south, z);
+      }
+      if (north < z) {
+        ma->coarse_wall(xs[i+1], ys[j+1], xs[i], ys[j+1], north, z);
+      }
+    }
+  }
+  ma->pack(rgn->origin);
+}
@@ -0,0 +1,317 @@
+#ifndef _H_HEXCOM_TERRAINMESH
+#define _H_HEXCOM_TERRAINMESH
+
+#include <vector>
+#include <stdint.h>
+#include <glm/glm.hpp>
+#include "region.h"
+#include "pick.h"
+
+/**
+ *   The terrain mesher: a region (and the edges of the regions around
+ *   it) goes in, and arrays of vertices and triangles come out.  None
+ *   of it touches GL, so it runs on the client's worker threads, and
+ *   on machines without a GPU at all (see bench_mesher); handing the
+ *   arrays to the GPU is up to the client (see client/native/mesh.cpp)
+ */
+
+#define TEXTURE_GRID_WIDTH      (16)
+#define SIDE_TEXTURE_HEIGHT     (10)    // how many z-units the texture covers
+#define SIDE_REPEAT_MAX         (60)    // most repeats of it in one quad
+
+/**
+ *   A region's mesh is made of chunks of TS_CHUNK_SIZE by TS_CHUNK_SIZE
+ *   columns, each of which can be re-meshed on its own; this is the
+ *   bit for the chunk with column (x,y) (relative to the region) in a
+ *   mask of them
+ */
+#define TS_CHUNK_BITS           (3)
+#define TS_CHUNK_SIZE           (1 << TS_CHUNK_BITS)
+#define TS_CHUNKS_ACROSS        (REGION_SIZE / TS_CHUNK_SIZE)
+#define TS_CHUNKS               (TS_CHUNKS_ACROSS * TS_CHUNKS_ACROSS)
+#define TS_ALL_CHUNKS           ((1U << TS_CHUNKS) - 1)
+#define TS_CHUNK_BIT(x,y)       (1U << (((y) >> TS_CHUNK_BITS) * TS_CHUNKS_ACROSS \
+                                        + ((x) >> TS_CHUNK_BITS)))
+
+// the coarse meshes drawn in place of the detailed one at a distance,
+// which have cells of COARSE_CELL(level) columns on a side
+#define TS_COARSE_LEVELS        (2)
+#define COARSE_CELL(level)      (2 << (level))
+
+struct Slab {
+  int x, y;             // location of column
+  short z0;             // bottom
+  short z1;             // top
+  unsigned char type;
+  unsigned char flags;
+};
+
+/**
+ *   The vertex format for terrain meshes: one interleaved buffer of
+ *   16 bytes a vertex, instead of three buffers of 24 bytes in all.
+ *   Positions are relative to the region's origin and counted in the
+ *   units of the hex grid, which makes them exact: x in half columns,
+ *   y in units of a (the hex's short y extent) and z in z units.  The
+ *   shader scales them back with packScale and adds regionOrigin.
+ */
+
+struct PackedVertex {
+  int16_t       pv_posn[4];     // x, y, z (and padding)
+  uint16_t      pv_uv[2];       // within the tile, in PACK_UV_UNITs
+  uint8_t       pv_ambient;     // normalized
+  uint8_t       pv_normal;      // 0-5 for the sides (as faces), 6 top, 7 bottom
+  uint8_t       pv_tile;        // which tile of the terrain texture
+  uint8_t       pv_pad;
+};
+
+#define PACK_X_UNIT     (x_stride/2)
+#define PACK_Y_UNIT     (a)
+#define PACK_Z_UNIT     (z_scale)
+#define PACK_UV_UNIT    (1.0/1024)      // of a tile; see the terrain shaders
+
+#define PACK_NORMAL_TOP         (6)
+#define PACK_NORMAL_BOTTOM      (7)
+
+struct TextureSet;
+
+/**
+ *   Collects the vertices and triangles of a mesh before they go to
+ *   the GPU.  The buffers grow as needed and are kept for the next
+ *   mesh; get one from acquire_accumulator(), which recycles them
+ *   through a per-thread pool, and call reserve() with an estimate of
+ *   the size of the mesh so it doesn't have to grow along the way.
+ */
+
+struct MeshAccumulator {
+  float *posnp, *uvp, *ambientp, *normalp;
+  uint8_t *tilep;
+  uint32_t *indexp, *linep;
+  unsigned count;
+  uint8_t tile;                 // the texture tile of vertex()s to come
+  TextureSet const *textures;   // of the current slab's type
+  Slab *current;
+  float z0, z1;
+  float hex[6][2];
+  std::vector<float> posn;
+  std::vector<float> normal;
+  std::vector<float> uv;
+  std::vector<float> ambient;
+  std::vector<uint8_t> tiles;
+  std::vector<uint32_t> index;
+  std::vector<uint32_t> lines;
+  uint32_t *index_end, *line_end;
+  unsigned vertex_capacity;
+
+  std::vector<uint32_t> transparent_index;
+  unsigned num_transparent;
+  std::vector<PackedVertex> packed;
+  std::vector<uint32_t> staged;         // index buffer contents
+  std::vector<uint16_t> index16;
+
+  // the vertices and triangles of each chunk of a region, which are
+  // accumulated one after the other
+  struct ChunkRange {
+    unsigned    cr_chunk;
+    unsigned    cr_vertex0, cr_vertices;
+    unsigned    cr_index0, cr_triangles;
+    unsigned    cr_water0, cr_water_triangles;
+  };
+  std::vector<ChunkRange> chunks;
+
+  MeshAccumulator()
+    : vertex_capacity(0)
+  {
+    reset();
+  }
+
+  // empty it out, keeping the buffers
+  void reset() {
+    count = 0;
+    num_transparent = 0;
+    posnp = posn.data();
+    uvp = uv.data();
+    ambientp = ambient.data();
+    tilep = tiles.data();
+    tile = 0;
+    normalp = normal.data();
+    indexp = index.data();
+    linep = lines.data();
+    index_end = indexp + index.size();
+    line_end = linep + lines.size();
+    chunks.clear();
+  }
+
+  void begin_chunk(unsigned chunk) {
+    ChunkRange r;
+    r.cr_chunk = chunk;
+    r.cr_vertex0 = count;
+    r.cr_index0 = size();
+    r.cr_water0 = num_transparent;
+    chunks.push_back(r);
+  }
+
+  void end_chunk() {
+    ChunkRange *r = &chunks.back();
+    r->cr_vertices = count - r->cr_vertex0;
+    r->cr_triangles = size() - r->cr_index0;
+    r->cr_water_triangles = num_transparent - r->cr_water0;
+  }
+
+  // make sure there is room for this many more vertices and triangles
+  void reserve(unsigned vertices, unsigned triangles) {
+    if (count + vertices > vertex_capacity) {
+      grow_vertices(count + vertices);
+    }
+    if ((unsigned)(index_end - indexp) < triangles * 3) {
+      grow_triangles((indexp - index.data()) / 3 + triangles);
+    }
+  }
+
+  void grow_vertices(unsigned need) {
+    unsigned n = vertex_capacity ? vertex_capacity : 1024;
+    while (n < need) {
+      n *= 2;
+    }
+    posn.resize(3*n);
+    normal.resize(3*n);
+    uv.resize(2*n);
+    ambient.resize(n);
+    tiles.resize(n);
+    posnp = posn.data() + 3*count;
+    normalp = normal.data() + 3*count;
+    uvp = uv.data() + 2*count;
+    ambientp = ambient.data() + count;
+    tilep = tiles.data() + count;
+    vertex_capacity = n;
+  }
+
+  void grow_triangles(unsigned need) {
+    size_t used = indexp - index.data();
+    size_t n = index.empty() ? 3*1024 : index.size();
+    while (n < 3*(size_t)need) {
+      n *= 2;
+    }
+    index.resize(n);
+    indexp = index.data() + used;
+    index_end = index.data() + n;
+  }
+
+  void grow_lines() {
+    size_t used = linep - lines.data();
+    lines.resize(lines.empty() ? 2*1024 : 2*lines.size());
+    linep = lines.data() + used;
+    line_end = lines.data() + lines.size();
+  }
+
+  unsigned vertex(float x, float y, float z,
+                  float u, float v,
+                  float a,
+                  float nx, float ny, float nz) {
+    if (count == vertex_capacity) {
+      grow_vertices(count + 1);
+    }
+    posnp[0] = x;
+    posnp[1] = y;
+    posnp[2] = z;
+    uvp[0] = u;
+    uvp[1] = v;
+    ambientp[0] = a;
+    tilep[0] = tile;
+    normalp[0] = nx;
+    normalp[1] = ny;
+    normalp[2] = nz;
+    normalp += 3;
+    posnp += 3;
+    uvp += 2;
+    ambientp += 1;
+    tilep += 1;
+    return count++;
+  }
+
+  void line(unsigned a, unsigned b) {
+    if (linep == line_end) {
+      grow_lines();
+    }
+    linep[0] = a;
+    linep[1] = b;
+    linep += 2;
+  }
+
+  void triangle(unsigned a, unsigned b, unsigned c) {
+    if (indexp == index_end) {
+      grow_triangles((indexp - index.data()) / 3 + 1);
+    }
+    indexp[0] = a;
+    indexp[1] = b;
+    indexp[2] = c;
+    indexp += 3;
+  }
+
+  void transparent_triangle(unsigned a, unsigned b, unsigned c) {
+    if (3*(num_transparent+1) > transparent_index.size()) {
+      transparent_index.resize(transparent_index.empty()
+                               ? 3*1024
+                               : 2*transparent_index.size());
+    }
+    transparent_index[3*num_transparent] = a;
+    transparent_index[3*num_transparent+1] = b;
+    transparent_index[3*num_transparent+2] = c;
+    num_transparent++;
+  }
+
+  unsigned size() {
+    return (indexp - index.data())/3;
+  }
+
+  // the faces of a slab; setup() it first
+  void setup(Slab *slab);
+  void water_top();
+  void hextop();
+  void hexbottom();
+  void face(int f0);
+  // the pieces of a coarse mesh, in the texture of the setup() slab
+  void coarse_top(float x0, float y0, float x1, float y1, int z);
+  void coarse_wall(float xa, float ya, float xb, float yb, int z0, int z1);
+
+  frect bbox(glm::mat4 xf);
+
+  // convert to packed vertices relative to a region's origin
+  void pack(Posn const& origin);
+  static uint8_t normal_index(float nx, float ny, float nz);
+
+  // for copying a mesh's chunks into buffers with room to grow
+  void stage_chunk_index(uint32_t const *p, unsigned num, unsigned room,
+                         unsigned first, unsigned base);
+  void whole_chunk();
+};
+
+MeshAccumulator *acquire_accumulator(void);
+void release_accumulator(MeshAccumulator *ma);
+
+// faces left out of a mesh for being up against solid (or water
+// against water)
+struct TerrainMeshStats {
+  unsigned      tms_hidden_tops;
+  unsigned      tms_hidden_bottoms;
+  unsigned      tms_hidden_sides;
+};
+
+/**
+ *   Mesh the chunks (a mask of TS_CHUNK_BITs) of rgns[1][1] in detail,
+ *   into ma (which is left packed), with rgns[][] being the regions
+ *   around it; any of those may be NULL if we don't have it, and need
+ *   only have the columns along the edge.  Adds to *stats
+ */
+
+void mesh_detail(Region *rgns[3][3], unsigned chunks,
+                 MeshAccumulator *ma, TerrainMeshStats *stats);
+
+/**
+ *   The coarse meshes stand in for a region's detailed one at a
+ *   distance; this makes the one with cells of COARSE_CELL(level)
+ *   columns, into ma (which is left packed)
+ */
+
+void mesh_coarse(Region *rgn, int level, MeshAccumulator *ma);
+
+#endif /* _H_HEXCOM_TERRAINMESH */